@@ -0,0 +1,629 @@
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "discrub_interface.h"
+#include "input_helpers.h"
+#include "jsontok.h"
+
+#ifdef DISCRUB_HTTP2
+#include <nghttp2/nghttp2.h>
+#include <openssl/x509.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "http2.h"
+#endif
+
+#define BENCH_MIN_SECONDS 0.5
+#define BENCH_MAX_CASES 64
+
+/* Allocations made through jsontok are counted with the linker's --wrap. */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static size_t allocation_count = 0;
+
+void *__wrap_malloc(size_t size) {
+  allocation_count++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  allocation_count++;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocation_count++;
+  return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+  __real_free(ptr);
+}
+
+struct BenchResult {
+  size_t messages;
+  size_t failures;
+};
+
+static void walk(const char *buffer, struct JsonToken *token, struct BenchResult *result);
+
+static void walk_root(struct JsonToken *token, const char *buffer, struct BenchResult *result) {
+  if (!token) {
+    result->failures++;
+    return;
+  }
+  walk(buffer, token, result);
+  jsontok_free(token);
+}
+
+static void walk(const char *buffer, struct JsonToken *token, struct BenchResult *result) {
+  size_t i;
+  enum JsonError error = JSON_ENOERR;
+  switch (token->type) {
+    case JSON_OBJECT:
+      if (jsontok_get(token->as_object, "author")) result->messages++;
+      for (i = 0; i < token->as_object->count; i++) {
+        struct JsonToken *value = jsontok_get(token->as_object, token->as_object->entries[i]->key);
+        if (!value) {
+          result->failures++;
+          continue;
+        }
+        walk(buffer, value, result);
+      }
+      break;
+    case JSON_ARRAY:
+      for (i = 0; i < token->as_array->length; i++) walk(buffer, token->as_array->elements[i], result);
+      break;
+    case JSON_WRAPPED_OBJECT:
+    case JSON_WRAPPED_ARRAY:
+      /* Expand nested containers level by level, as callers of jsontok_parse do. */
+      walk_root(jsontok_parse_span(buffer, token->as_span, NULL, &error), buffer, result);
+      break;
+    default:
+      break;
+  }
+}
+
+static int run_tree(const char *json_string, size_t length, size_t *messages) {
+  struct BenchResult result = {0, 0};
+  enum JsonError error = JSON_ENOERR;
+  walk_root(jsontok_parse_n(json_string, length, &error), json_string, &result);
+  *messages = result.messages;
+  return !result.failures;
+}
+
+static char *copy_string(const char *string) {
+  char *copy = malloc(strlen(string) + 1);
+  if (copy) strcpy(copy, string);
+  return copy;
+}
+
+static char *copy_timestamp(const char *timestamp) {
+  struct tm tm;
+  char buffer[64];
+  memset(&tm, 0, sizeof(struct tm));
+  if (!strptime(timestamp, "%Y-%m-%dT%H:%M:%S", &tm)) return NULL;
+  time_t time_utc = mktime(&tm);
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", localtime(&time_utc));
+  return copy_string(buffer);
+}
+
+static struct JsonToken *get_string(struct JsonToken *object, const char *key) {
+  struct JsonToken *token = jsontok_get(object->as_object, key);
+  return token && token->type == JSON_STRING ? token : NULL;
+}
+
+/**
+ * The extraction discrub_search did before the field table: four nested
+ * parses per message, then a copy of each field.
+ */
+static int run_search_tree(const char *json_string, size_t length, size_t *messages) {
+  enum JsonError error = JSON_ENOERR;
+  int ok = 0;
+  struct JsonToken *root = jsontok_parse_n(json_string, length, &error);
+  if (!root || root->type != JSON_OBJECT) {
+    jsontok_free(root);
+    return 0;
+  }
+  struct JsonToken *wrapped = jsontok_get(root->as_object, "messages");
+  struct JsonToken *array = wrapped && wrapped->type == JSON_WRAPPED_ARRAY ? jsontok_parse_span(json_string, wrapped->as_span, NULL, &error) : NULL;
+  if (array && array->type == JSON_ARRAY) {
+    struct DiscordMessage *extracted = malloc((array->as_array->length + 1) * sizeof(struct DiscordMessage));
+    size_t i;
+    ok = extracted != NULL;
+    for (i = 0; ok && i < array->as_array->length; i++) {
+      struct JsonToken *container = jsontok_parse_span(json_string, array->as_array->elements[i]->as_span, NULL, &error);
+      struct JsonToken *message = container && container->type == JSON_ARRAY && container->as_array->length ? jsontok_parse_span(json_string, container->as_array->elements[0]->as_span, NULL, &error) : NULL;
+      struct JsonToken *author_token = message && message->type == JSON_OBJECT ? jsontok_get(message->as_object, "author") : NULL;
+      struct JsonToken *author = author_token && author_token->type == JSON_WRAPPED_OBJECT ? jsontok_parse_span(json_string, author_token->as_span, NULL, &error) : NULL;
+      struct JsonToken *id = author ? get_string(message, "id") : NULL, *content = author ? get_string(message, "content") : NULL;
+      struct JsonToken *timestamp = author ? get_string(message, "timestamp") : NULL, *author_id = author ? get_string(author, "id") : NULL;
+      struct JsonToken *username = author ? get_string(author, "username") : NULL;
+      ok = id && content && timestamp && author_id && username;
+      if (ok) {
+        extracted[i].id = copy_string(id->as_string);
+        extracted[i].content = copy_string(content->as_string);
+        extracted[i].timestamp = copy_timestamp(timestamp->as_string);
+        extracted[i].author_id = copy_string(author_id->as_string);
+        extracted[i].author_username = copy_string(username->as_string);
+        *messages = i + 1;
+      }
+      jsontok_free(author);
+      jsontok_free(message);
+      jsontok_free(container);
+    }
+    for (i = 0; extracted && i < *messages; i++) {
+      free(extracted[i].id);
+      free(extracted[i].content);
+      free(extracted[i].timestamp);
+      free(extracted[i].author_id);
+      free(extracted[i].author_username);
+    }
+    free(extracted);
+  }
+  jsontok_free(array);
+  jsontok_free(root);
+  return ok;
+}
+
+static int run_search_extract(const char *json_string, size_t length, size_t *messages) {
+  enum DiscrubError error = DISCRUB_ENOERR;
+  struct SearchResponse *response = discrub_parse_search_response(json_string, length, NULL, &error);
+  if (!response) return 0;
+  *messages = response->length;
+  discrub_free_search_response(response, NULL);
+  return 1;
+}
+
+static int count_username(void *user, struct JsonCursor *cursor) {
+  struct JsonToken view;
+  enum JsonError error = JSON_ENOERR;
+  if (jsontok_cursor_get_string_view(cursor, &view, &error)) (*(size_t *)user)++;
+  return 0;
+}
+
+/* Reads every author's username with one compiled path query. */
+static int run_search_path(const char *json_string, size_t length, size_t *messages) {
+  static struct JsonPath *path = NULL;
+  enum JsonError error = JSON_ENOERR;
+  if (!path && !(path = jsontok_path_compile("/messages/*/0/author/username", &error))) return 0;
+  *messages = 0;
+  return jsontok_path_eval(path, json_string, length, count_username, messages, &error) && *messages;
+}
+
+struct BenchWorkload {
+  const char *name;
+  int (*run)(const char *json_string, size_t length, size_t *messages);
+  /* Optional workloads skip corpus files they cannot handle. */
+  unsigned char optional;
+};
+
+static const struct BenchWorkload workloads[] = {
+    {"tree", run_tree, 0},
+    {"search_tree", run_search_tree, 1},
+    {"search_extract", run_search_extract, 1},
+    {"search_path", run_search_path, 1},
+};
+
+#define BENCH_WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+#define BENCH_SKIPPED 2
+
+static double now_seconds() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void print_result(const char *name, const char *workload, size_t bytes, size_t found, size_t iterations,
+                         double elapsed, size_t messages, double allocations, unsigned char json_output) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  double megabytes_per_second = bytes * (double)iterations / elapsed / 1e6;
+  double ns_per_message = elapsed * 1e9 / ((double)iterations * messages);
+
+  if (json_output) {
+    struct JsonWriter writer;
+    enum JsonError error = JSON_ENOERR;
+    jsontok_writer_init_file(&writer, stdout);
+    jsontok_writer_object_start(&writer);
+    jsontok_writer_key(&writer, "case");
+    jsontok_writer_string(&writer, name);
+    jsontok_writer_key(&writer, "workload");
+    jsontok_writer_string(&writer, workload);
+    jsontok_writer_key(&writer, "bytes");
+    jsontok_writer_unsigned(&writer, bytes);
+    jsontok_writer_key(&writer, "messages");
+    jsontok_writer_unsigned(&writer, found);
+    jsontok_writer_key(&writer, "iterations");
+    jsontok_writer_unsigned(&writer, iterations);
+    jsontok_writer_key(&writer, "mb_per_s");
+    jsontok_writer_number(&writer, megabytes_per_second);
+    jsontok_writer_key(&writer, "ns_per_message");
+    jsontok_writer_number(&writer, ns_per_message);
+    jsontok_writer_key(&writer, "allocations");
+    jsontok_writer_number(&writer, allocations);
+    jsontok_writer_key(&writer, "peak_rss_kb");
+    jsontok_writer_integer(&writer, usage.ru_maxrss);
+    jsontok_writer_object_end(&writer);
+    jsontok_writer_finish(&writer, NULL, &error);
+    putchar('\n');
+  } else {
+    printf("%-28s %-16s %10.1f %14.0f %12.1f %12ld\n", name, workload, megabytes_per_second, ns_per_message, allocations, usage.ru_maxrss);
+  }
+}
+
+static int run_case(const char *directory, const char *name, const struct BenchWorkload *workload, unsigned char json_output) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", directory, name);
+  char *json_string = load_file_as_string(path);
+  if (!json_string) {
+    fprintf(stderr, "Could not read %s\n", path);
+    return 1;
+  }
+  size_t bytes = strlen(json_string), found = 0;
+  if (!workload->run(json_string, bytes, &found)) {
+    free(json_string);
+    if (workload->optional) return BENCH_SKIPPED;
+    fprintf(stderr, "Failed to parse %s\n", path);
+    return 1;
+  }
+  size_t messages = found ? found : 1;
+
+  size_t iterations = 0, batch = 1;
+  allocation_count = 0;
+  double start = now_seconds(), elapsed = 0;
+  while (elapsed < BENCH_MIN_SECONDS) {
+    size_t i;
+    for (i = 0; i < batch; i++) workload->run(json_string, bytes, &found);
+    iterations += batch;
+    batch *= 2;
+    elapsed = now_seconds() - start;
+  }
+  double allocations = (double)allocation_count / iterations;
+  print_result(name, workload->name, bytes, found, iterations, elapsed, messages, allocations, json_output);
+  free(json_string);
+  return 0;
+}
+
+#define BENCH_DELETE_BATCH 8
+#define BENCH_PAIR_SIZE 65536
+
+static const char *const delete_ids[BENCH_DELETE_BATCH] = {
+    "1234567890123456780", "1234567890123456781", "1234567890123456782", "1234567890123456783",
+    "1234567890123456784", "1234567890123456785", "1234567890123456786", "1234567890123456787",
+};
+
+/**
+ * One batch of pipelined deletes from compiled requests, answered from the
+ * other end of an in-memory BIO pair. Returns the request bytes sent, or 0
+ * if a delete was not confirmed.
+ */
+static size_t run_delete_batch(BIO *connection, BIO *server, struct DiscrubRequests *requests) {
+  static const char response[] = "HTTP/1.1 204 No Content\r\nX-RateLimit-Remaining: 9\r\n\r\n";
+  enum DiscrubError error = DISCRUB_ENOERR;
+  bool deleted[BENCH_DELETE_BATCH];
+  char sink[4096];
+  size_t i, sent = 0;
+  int size;
+  for (i = 0; i < BENCH_DELETE_BATCH; i++) BIO_write(server, response, sizeof(response) - 1);
+  if (discrub_requests_delete(connection, requests, delete_ids, BENCH_DELETE_BATCH, BENCH_DELETE_BATCH, deleted,
+                              &error) != BENCH_DELETE_BATCH) {
+    return 0;
+  }
+  for (i = 0; i < BENCH_DELETE_BATCH; i++) {
+    if (!deleted[i]) return 0;
+  }
+  while ((size = BIO_read(server, sink, sizeof(sink))) > 0) sent += size;
+  return sent;
+}
+
+/**
+ * Measures the steady-state delete loop, which must not allocate once the
+ * request and receive buffers have grown to fit.
+ */
+static int run_delete_case(unsigned char json_output) {
+  BIO *connection = NULL, *server = NULL;
+  enum DiscrubError error = DISCRUB_ENOERR;
+  if (!BIO_new_bio_pair(&connection, BENCH_PAIR_SIZE, &server, BENCH_PAIR_SIZE)) return 1;
+  struct DiscrubRequests *requests =
+      discrub_requests_new("Bench.Token.Value", NULL, "1111111111111111111", NULL, NULL, &error);
+  size_t bytes = requests ? run_delete_batch(connection, server, requests) : 0;
+  if (!bytes) {
+    fprintf(stderr, "Failed to run pipelined deletes\n");
+    discrub_requests_free(requests);
+    BIO_free(connection);
+    BIO_free(server);
+    return 1;
+  }
+
+  size_t iterations = 0, batch = 1;
+  allocation_count = 0;
+  double start = now_seconds(), elapsed = 0;
+  while (elapsed < BENCH_MIN_SECONDS) {
+    size_t i;
+    for (i = 0; i < batch; i++) run_delete_batch(connection, server, requests);
+    iterations += batch;
+    batch *= 2;
+    elapsed = now_seconds() - start;
+  }
+  double allocations = (double)allocation_count / iterations;
+  print_result("requests", "delete_pipeline", bytes, BENCH_DELETE_BATCH, iterations, elapsed, BENCH_DELETE_BATCH,
+               allocations, json_output);
+  discrub_requests_free(requests);
+  BIO_free(connection);
+  BIO_free(server);
+  if (allocation_count) {
+    fprintf(stderr, "Steady-state deletes allocated %zu times\n", allocation_count);
+    return 1;
+  }
+  return 0;
+}
+
+#ifdef DISCRUB_HTTP2
+/**
+ * A local stand-in for an h2 server: TLS with a throwaway certificate on
+ * one end of a socket pair, answering every request with a 204 from its own
+ * thread.
+ */
+struct StandIn {
+  SSL_CTX *ctx;
+  SSL *ssl;
+  nghttp2_session *session;
+  pthread_t thread;
+};
+
+static int standin_select_h2(SSL *ssl, const unsigned char **out, unsigned char *out_length, const unsigned char *in,
+                             unsigned int in_length, void *user) {
+  (void)ssl;
+  (void)user;
+  if (SSL_select_next_proto((unsigned char **)out, out_length, (const unsigned char *)"\x02h2", 3, in, in_length) !=
+      OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+static int standin_certify(SSL_CTX *ctx) {
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *cert = X509_new();
+  int ok = key && cert;
+  if (ok) {
+    X509_NAME *name = X509_get_subject_name(cert);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+    ok = X509_sign(cert, key, EVP_sha256()) > 0 && SSL_CTX_use_certificate(ctx, cert) == 1 &&
+         SSL_CTX_use_PrivateKey(ctx, key) == 1;
+  }
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return ok;
+}
+
+static int standin_on_frame(nghttp2_session *session, const nghttp2_frame *frame, void *user) {
+  static const nghttp2_nv headers[] = {
+      {(uint8_t *)":status", (uint8_t *)"204", 7, 3, NGHTTP2_NV_FLAG_NONE},
+      {(uint8_t *)"x-ratelimit-remaining", (uint8_t *)"9", 21, 1, NGHTTP2_NV_FLAG_NONE},
+  };
+  (void)user;
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) ||
+      !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM)) {
+    return 0;
+  }
+  if (nghttp2_submit_response(session, frame->hd.stream_id, headers, 2, NULL)) return NGHTTP2_ERR_CALLBACK_FAILURE;
+  return 0;
+}
+
+/* Serves until the client closes its end of the pair or breaks the protocol. */
+static void standin_serve(struct StandIn *standin) {
+  unsigned char buffer[16384];
+  if (SSL_accept(standin->ssl) <= 0) return;
+  if (nghttp2_submit_settings(standin->session, NGHTTP2_FLAG_NONE, NULL, 0)) return;
+  for (;;) {
+    const uint8_t *data;
+    ssize_t size;
+    while ((size = nghttp2_session_mem_send(standin->session, &data)) > 0) {
+      if (SSL_write(standin->ssl, data, (int)size) <= 0) return;
+    }
+    if (size < 0) return;
+    int received = SSL_read(standin->ssl, buffer, sizeof(buffer));
+    if (received <= 0 || nghttp2_session_mem_recv(standin->session, buffer, received) < 0) return;
+  }
+}
+
+/* A pair cannot be reconnected, so the client is told as soon as serving stops. */
+static void *standin_run(void *argument) {
+  struct StandIn *standin = argument;
+  standin_serve(standin);
+  shutdown(SSL_get_fd(standin->ssl), SHUT_RDWR);
+  return NULL;
+}
+
+static int standin_start(struct StandIn *standin, int fd) {
+  nghttp2_session_callbacks *callbacks;
+  memset(standin, 0, sizeof(struct StandIn));
+  standin->ctx = SSL_CTX_new(TLS_server_method());
+  if (!standin->ctx || !standin_certify(standin->ctx)) return 0;
+  SSL_CTX_set_alpn_select_cb(standin->ctx, standin_select_h2, NULL);
+  standin->ssl = SSL_new(standin->ctx);
+  if (!standin->ssl || !SSL_set_fd(standin->ssl, fd)) return 0;
+  if (nghttp2_session_callbacks_new(&callbacks)) return 0;
+  nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, standin_on_frame);
+  int result = nghttp2_session_server_new(&standin->session, callbacks, standin);
+  nghttp2_session_callbacks_del(callbacks);
+  if (result) return 0;
+  return pthread_create(&standin->thread, NULL, standin_run, standin) == 0;
+}
+
+/* Joins the server thread, which ends once the client's end is closed. */
+static void standin_stop(struct StandIn *standin, int started) {
+  if (started) pthread_join(standin->thread, NULL);
+  nghttp2_session_del(standin->session);
+  SSL_free(standin->ssl);
+  SSL_CTX_free(standin->ctx);
+}
+
+/**
+ * One batch of deletes over h2, sent as concurrent streams. Returns the
+ * bytes written to the socket, TLS and framing included, or 0 if a delete
+ * was not confirmed.
+ */
+static size_t run_h2_delete_batch(BIO *connection, struct DiscrubRequests *requests) {
+  enum DiscrubError error = DISCRUB_ENOERR;
+  bool deleted[BENCH_DELETE_BATCH];
+  uint64_t written = BIO_number_written(BIO_next(connection));
+  size_t i;
+  if (discrub_requests_delete(connection, requests, delete_ids, BENCH_DELETE_BATCH, BENCH_DELETE_BATCH, deleted,
+                              &error) != BENCH_DELETE_BATCH) {
+    return 0;
+  }
+  for (i = 0; i < BENCH_DELETE_BATCH; i++) {
+    if (!deleted[i]) return 0;
+  }
+  return BIO_number_written(BIO_next(connection)) - written;
+}
+
+/**
+ * Runs the delete loop against the stand-in. The connection must negotiate
+ * h2, so this also checks that the HTTP/1.1 requests are carried as streams.
+ */
+static int run_h2_delete_case(unsigned char json_output) {
+  struct StandIn standin;
+  enum DiscrubError error = DISCRUB_ENOERR;
+  enum HTTPError http_error = HTTP_ENOERR;
+  struct DiscrubRequests *requests = NULL;
+  BIO *connection = NULL;
+  size_t bytes = 0;
+  int fds[2], started = 0, status = 1;
+  /* Writes after the stand-in has stopped must fail rather than kill the case. */
+  signal(SIGPIPE, SIG_IGN);
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) return 1;
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  started = ctx && http2_enable(ctx) && standin_start(&standin, fds[1]);
+  if (started) {
+    connection = BIO_new_ssl(ctx, 1);
+    if (connection) BIO_push(connection, BIO_new_socket(fds[0], BIO_CLOSE));
+  }
+  if (connection && http_connect(connection) && http2_session(connection, &http_error)) {
+    requests = discrub_requests_new("Bench.Token.Value", NULL, "1111111111111111111", NULL, NULL, &error);
+    bytes = requests ? run_h2_delete_batch(connection, requests) : 0;
+  }
+  if (bytes) {
+    size_t iterations = 0, batch = 1;
+    allocation_count = 0;
+    double start = now_seconds(), elapsed = 0;
+    while (elapsed < BENCH_MIN_SECONDS) {
+      size_t i;
+      for (i = 0; i < batch; i++) run_h2_delete_batch(connection, requests);
+      iterations += batch;
+      batch *= 2;
+      elapsed = now_seconds() - start;
+    }
+    print_result("requests", "h2_delete", bytes, BENCH_DELETE_BATCH, iterations, elapsed, BENCH_DELETE_BATCH,
+                 (double)allocation_count / iterations, json_output);
+    status = 0;
+  } else {
+    fprintf(stderr, "Failed to run deletes over h2\n");
+  }
+  discrub_requests_free(requests);
+  if (connection) {
+    BIO_free_all(connection);
+  } else {
+    close(fds[0]);
+  }
+  standin_stop(&standin, started);
+  close(fds[1]);
+  SSL_CTX_free(ctx);
+  return status;
+}
+#endif
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int main(int argc, char **argv) {
+  const char *directory = "bench/corpus";
+  unsigned char json_output = 0;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json_output = 1;
+    } else {
+      directory = argv[i];
+    }
+  }
+
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    fprintf(stderr, "Could not open corpus directory %s\n", directory);
+    return 1;
+  }
+  char *names[BENCH_MAX_CASES];
+  size_t count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) && count < BENCH_MAX_CASES) {
+    size_t length = strlen(entry->d_name);
+    if (length < 5 || strcmp(entry->d_name + length - 5, ".json") != 0) continue;
+    names[count] = malloc(length + 1);
+    if (!names[count]) break;
+    memcpy(names[count], entry->d_name, length + 1);
+    count++;
+  }
+  closedir(dir);
+  qsort(names, count, sizeof(char *), compare_names);
+
+  if (!json_output) {
+    printf("%-28s %-16s %10s %14s %12s %12s\n", "case", "workload", "MB/s", "ns/message", "allocs/doc", "peak KiB");
+  }
+  int status = 0;
+  size_t c, w;
+  for (c = 0; c < count; c++) {
+    for (w = 0; w < BENCH_WORKLOAD_COUNT; w++) {
+      /* Each case runs in its own process so peak RSS is not shared. */
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid == 0) exit(run_case(directory, names[c], &workloads[w], json_output));
+      int child_status = 1;
+      if (pid < 0 || waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status)) {
+        status = 1;
+      } else if (WEXITSTATUS(child_status) && WEXITSTATUS(child_status) != BENCH_SKIPPED) {
+        status = 1;
+      }
+    }
+    free(names[c]);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) exit(run_delete_case(json_output));
+  int child_status = 1;
+  if (pid < 0 || waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status)) {
+    status = 1;
+  }
+#ifdef DISCRUB_HTTP2
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) exit(run_h2_delete_case(json_output));
+  child_status = 1;
+  if (pid < 0 || waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status)) {
+    status = 1;
+  }
+#endif
+  return status;
+}
@@ -0,0 +1,97 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stddef.h>
+
+/**
+ * @brief A set of allocation hooks sharing one user pointer.
+ *
+ * Every API that takes a `const struct Allocator *` treats NULL as the C
+ * library's malloc, realloc and free.
+ */
+struct Allocator {
+  void *(*alloc)(void *user, size_t size);
+  void *(*realloc)(void *user, void *ptr, size_t size);
+  void (*free)(void *user, void *ptr);
+  void *user;
+};
+
+/**
+ * @brief Allocation counters gathered by a CountingAllocator.
+ */
+struct AllocatorStats {
+  size_t allocations;
+  size_t reallocations;
+  size_t frees;
+  size_t bytes;
+  size_t in_use;
+  size_t peak;
+  size_t longest_realloc_chain;
+};
+
+/**
+ * @brief An allocator that forwards to `parent` while recording statistics.
+ *
+ * Pass `&counter->allocator` to the APIs being measured. Each block carries a
+ * small header with its size and the number of times it has been resized.
+ */
+struct CountingAllocator {
+  struct Allocator allocator;
+  const struct Allocator *parent;
+  struct AllocatorStats stats;
+};
+
+/**
+ * @brief Allocates `size` bytes through an allocator.
+ *
+ * @param allocator The allocator to use, or NULL for malloc.
+ * @param size The number of bytes to allocate.
+ * @return A pointer to the memory, or NULL if out of memory.
+ */
+void *allocator_alloc(const struct Allocator *allocator, size_t size);
+
+/**
+ * @brief Resizes memory obtained from the same allocator.
+ *
+ * @param allocator The allocator that owns `ptr`, or NULL for realloc.
+ * @param ptr The memory to resize, or NULL to allocate.
+ * @param size The new size in bytes.
+ * @return A pointer to the resized memory, or NULL if out of memory.
+ */
+void *allocator_realloc(const struct Allocator *allocator, void *ptr, size_t size);
+
+/**
+ * @brief Releases memory obtained from the same allocator.
+ *
+ * @param allocator The allocator that owns `ptr`, or NULL for free.
+ * @param ptr The memory to release, or NULL.
+ */
+void allocator_free(const struct Allocator *allocator, void *ptr);
+
+/**
+ * @brief Copies `length` bytes into a new NUL-terminated string.
+ *
+ * @param allocator The allocator to use, or NULL for malloc.
+ * @return The copy, or NULL if out of memory.
+ */
+char *allocator_strndup(const struct Allocator *allocator, const char *string, size_t length);
+
+/**
+ * @brief Sets up a counting allocator with zeroed statistics.
+ *
+ * @param counter The CountingAllocator to initialize.
+ * @param parent The allocator that provides the memory, or NULL for malloc.
+ */
+void counting_allocator_init(struct CountingAllocator *counter, const struct Allocator *parent);
+
+/**
+ * @brief Starts a new measurement, such as one API call.
+ *
+ * Counters return to zero and the peak restarts from the bytes still in use,
+ * which remain tracked so later frees balance out.
+ *
+ * @param counter The CountingAllocator to reset.
+ */
+void counting_allocator_reset(struct CountingAllocator *counter);
+
+#endif
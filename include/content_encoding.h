@@ -0,0 +1,46 @@
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+#include <stddef.h>
+#include <zlib.h>
+
+#include "allocator.h"
+
+/**
+ * Streaming decoder for gzip and deflate response bodies. Input may be
+ * split anywhere, so bodies can be inflated as they are read.
+ */
+struct ContentDecoder {
+  z_stream stream;
+  const struct Allocator *allocator;
+  unsigned char active;
+  unsigned char started;
+  unsigned char raw;
+  unsigned char done;
+};
+
+/**
+ * @brief Prepares a decoder for a Content-Encoding header value.
+ *
+ * @param encoding The header value, or NULL if there was none.
+ * @param allocator The allocator for zlib's state, or NULL for malloc.
+ * @return 1 if the body is compressed and the decoder is ready, 0 if it is
+ * not compressed, or -1 for an encoding that cannot be decoded or if out of
+ * memory.
+ */
+int content_decoder_init(struct ContentDecoder *decoder, const char *encoding, const struct Allocator *allocator);
+
+/**
+ * @brief Inflates input into out until either runs out.
+ *
+ * @param data Advanced past the input used.
+ * @param length Reduced by the input used.
+ * @param produced Receives the number of bytes written to out.
+ * @return 1 on success, 0 if the data is corrupt.
+ */
+int content_decoder_run(struct ContentDecoder *decoder, const char **data, size_t *length, char *out,
+                        size_t out_size, size_t *produced);
+
+void content_decoder_end(struct ContentDecoder *decoder);
+
+#endif
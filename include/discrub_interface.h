@@ -10,6 +10,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "allocator.h"
+#include "event_loop.h"
 #include "jsontok.h"
 #include "openssl_helpers.h"
 
@@ -49,19 +51,166 @@ struct LoginResponse {
   char *user_id;
 };
 
+/**
+ * @brief Deletes one message. A 404 counts as deleted, since a re-sent
+ * DELETE that already went through comes back as Unknown Message.
+ *
+ * @return true once the message is gone, or false with *error set.
+ */
 bool discrub_delete_message(BIO *connection, const char *token,
                             const char *channel_id, const char *message_id,
+                            const struct Allocator *allocator,
                             enum DiscrubError *error);
 
+/**
+ * @brief Deletes messages with up to depth DELETE requests pipelined on one
+ * connection, matching the responses back to message IDs. Over HTTP/2 the
+ * requests are concurrent streams and may complete out of order.
+ *
+ * Sending stops at the first failed delete or when the rate-limit window is
+ * used up; requests already in flight are still answered. A dropped
+ * connection is reopened and the unanswered requests sent again.
+ *
+ * @param message_ids The IDs of the messages to delete.
+ * @param count The number of message IDs.
+ * @param depth The most requests to have in flight at once.
+ * @param deleted Receives, for each message, whether it is now deleted.
+ * @param allocator The allocator for requests and responses, or NULL for malloc.
+ * @param error A pointer to an error enum which will store the error if there is one.
+ * @return The number of requests answered. Messages not marked deleted can be re-queued.
+ */
+size_t discrub_delete_messages(BIO *connection, const char *token, const char *channel_id,
+                               const char *const *message_ids, size_t count, size_t depth, bool *deleted,
+                               const struct Allocator *allocator, enum DiscrubError *error);
+
+/**
+ * Searches and deletes compiled once for a session, so that each call only
+ * fills in an offset or message ID and sends a single pre-rendered request.
+ * Once its buffers have grown to fit, deleting allocates nothing.
+ */
+struct DiscrubRequests;
+
+/**
+ * @brief Compiles the session's requests, with the search query
+ * URL-encoded.
+ *
+ * @param server_id The server to search, or NULL to only delete.
+ * @param channel_id The channel to delete from, or NULL to only search.
+ * @param options The search options, or NULL to only delete. The offset is
+ * given to each search instead.
+ * @param allocator The allocator for requests and responses, or NULL for malloc.
+ * @param error A pointer to an error enum which will store the error if there is one.
+ * @return The requests, freed with discrub_requests_free, or NULL on failure.
+ */
+struct DiscrubRequests *discrub_requests_new(const char *token, const char *server_id, const char *channel_id,
+                                             const struct SearchOptions *options, const struct Allocator *allocator,
+                                             enum DiscrubError *error);
+
+/**
+ * @brief Fetches one page of search results, as discrub_search does.
+ *
+ * @param offset How many results to skip.
+ * @return The messages, freed with discrub_free_search_response, or NULL on failure.
+ */
+struct SearchResponse *discrub_requests_search(BIO *connection, struct DiscrubRequests *requests, size_t offset,
+                                               enum DiscrubError *error);
+
+/**
+ * @brief Deletes messages from the compiled channel, as
+ * discrub_delete_messages does.
+ */
+size_t discrub_requests_delete(BIO *connection, struct DiscrubRequests *requests, const char *const *message_ids,
+                               size_t count, size_t depth, bool *deleted, enum DiscrubError *error);
+
+/**
+ * @brief Deletes one message from the compiled channel, as
+ * discrub_delete_message does.
+ */
+bool discrub_requests_delete_one(BIO *connection, struct DiscrubRequests *requests, const char *message_id,
+                                 enum DiscrubError *error);
+
+/**
+ * @brief Queues a page of search results on an event loop, as
+ * discrub_search_async does.
+ *
+ * @param loop The loop the request runs on, created with the requests' allocator.
+ * @param offset How many results to skip.
+ */
+int discrub_requests_search_async(struct EventLoop *loop, struct DiscrubRequests *requests, size_t offset,
+                                  void (*on_complete)(void *user, struct SearchResponse *response,
+                                                      enum DiscrubError error),
+                                  void *user, enum DiscrubError *error);
+
+/**
+ * @brief Queues the deletion of a message from the compiled channel on an
+ * event loop, as discrub_delete_message_async does.
+ *
+ * @param loop The loop the request runs on, created with the requests' allocator.
+ */
+int discrub_requests_delete_async(struct EventLoop *loop, struct DiscrubRequests *requests, const char *message_id,
+                                  void (*on_complete)(void *user, enum DiscrubError error), void *user,
+                                  enum DiscrubError *error);
+
+void discrub_requests_free(struct DiscrubRequests *requests);
+
 struct SearchResponse *discrub_search(BIO *connection, const char *token,
                                       const char *server_id,
                                       struct SearchOptions *options,
+                                      const struct Allocator *allocator,
                                       enum DiscrubError *error);
 
-struct LoginResponse *discrub_login(BIO *connection, const char *username, const char *password, enum DiscrubError *error);
+/**
+ * @brief Queues a search on an event loop and returns without waiting.
+ *
+ * @param loop The loop the request runs on, created with the same allocator.
+ * @param on_complete Called from event_loop_run with the messages, which it
+ * frees with discrub_free_search_response, or with NULL and the error.
+ * @param user Passed through to on_complete.
+ * @return 1 if the search was queued, otherwise 0 with error set.
+ */
+int discrub_search_async(struct EventLoop *loop, const char *token, const char *server_id,
+                         struct SearchOptions *options,
+                         void (*on_complete)(void *user, struct SearchResponse *response, enum DiscrubError error),
+                         void *user, const struct Allocator *allocator, enum DiscrubError *error);
+
+/**
+ * @brief Queues the deletion of a message on an event loop and returns
+ * without waiting.
+ *
+ * @param loop The loop the request runs on, created with the same allocator.
+ * @param on_complete Called from event_loop_run with DISCRUB_ENOERR once the
+ * message is gone, or with the error.
+ * @param user Passed through to on_complete.
+ * @return 1 if the delete was queued, otherwise 0 with error set.
+ */
+int discrub_delete_message_async(struct EventLoop *loop, const char *token, const char *channel_id,
+                                 const char *message_id, void (*on_complete)(void *user, enum DiscrubError error),
+                                 void *user, const struct Allocator *allocator, enum DiscrubError *error);
+
+/**
+ * @brief Extracts the messages of a /messages/search response body in a
+ * single pass over the raw bytes.
+ *
+ * @param json_string The response body, which need not be NUL-terminated.
+ * @param length The length of the body in bytes.
+ * @param allocator The allocator for the messages, or NULL for malloc.
+ * @param error A pointer to an error enum which will store the error if there is one.
+ * @return The messages, freed with discrub_free_search_response, or NULL on failure.
+ */
+struct SearchResponse *discrub_parse_search_response(const char *json_string, size_t length, const struct Allocator *allocator, enum DiscrubError *error);
+
+struct LoginResponse *discrub_login(BIO *connection, const char *username, const char *password, const struct Allocator *allocator, enum DiscrubError *error);
 
 const char *discrub_strerror(enum DiscrubError *error);
 
-void discrub_free_search_response(struct SearchResponse *response);
+void discrub_free_search_response(struct SearchResponse *response, const struct Allocator *allocator);
+
+/**
+ * @brief Frees the fields of one message, leaving the struct itself alone.
+ *
+ * @param message The message whose fields are freed.
+ * @param allocator The allocator the message was extracted with.
+ */
+void discrub_free_message(struct DiscordMessage *message, const struct Allocator *allocator);
 
 #endif
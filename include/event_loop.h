@@ -0,0 +1,45 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+
+#include "allocator.h"
+#include "openssl_helpers.h"
+
+/**
+ * Drives requests over a pool of non-blocking TLS connections from one
+ * thread with epoll. Each connection carries one request at a time and is
+ * kept alive between them, so up to as many requests as there are
+ * connections are in flight at once. Linux only.
+ */
+struct EventLoop;
+
+/**
+ * Creates a loop for host ("name:port") with up to connections open at
+ * once, opened as needed from ctx. Requests start at least interval_ms
+ * apart to stay within rate limits. Returns NULL on failure.
+ */
+struct EventLoop *event_loop_new(SSL_CTX *ctx, const char *host, size_t connections, unsigned int interval_ms,
+                                 const struct Allocator *allocator, enum HTTPError *error);
+
+/**
+ * Queues a request, which is copied. on_complete is called from
+ * event_loop_run with the response, which it then owns, or with NULL and
+ * the error. Returns 1 on success, 0 if out of memory.
+ */
+int event_loop_submit(struct EventLoop *loop, const char *request,
+                      void (*on_complete)(void *user, struct HTTPResponse *response, enum HTTPError error),
+                      void *user);
+
+/**
+ * Runs until every queued request has completed, including any queued by
+ * completion callbacks. A request that has not completed 30 seconds after
+ * it started fails with HTTP_ETIMEOUT and its connection is closed.
+ * Returns 1 on success, 0 if polling failed.
+ */
+int event_loop_run(struct EventLoop *loop);
+
+void event_loop_free(struct EventLoop *loop);
+
+#endif
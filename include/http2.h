@@ -0,0 +1,49 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <openssl/bio.h>
+#include <openssl/ssl.h>
+
+#include "allocator.h"
+#include "openssl_helpers.h"
+
+/**
+ * An HTTP/2 session over one TLS connection, carrying requests as
+ * concurrent streams with HPACK-compressed headers. Only available when
+ * built with HTTP2=1, which links nghttp2.
+ */
+struct HTTP2Session;
+
+/**
+ * Offers h2 ahead of http/1.1 via ALPN on connections made from ctx.
+ * Returns 1 on success, 0 if HTTP/2 support is not compiled in.
+ */
+int http2_enable(SSL_CTX *ctx);
+
+/**
+ * Returns the HTTP/2 session of a connection that negotiated h2, starting
+ * it on first use, or NULL if the connection speaks HTTP/1.1. A connection
+ * that is not open yet, or was reset, is connected first and gets a new
+ * session if it negotiates h2 again. Sets error only if a session could not
+ * be started.
+ */
+struct HTTP2Session *http2_session(BIO *connection, enum HTTPError *error);
+
+/**
+ * Sends one request, written in HTTP/1.1 form, as an HTTP/2 stream and
+ * waits for its response.
+ */
+struct HTTPResponse *http2_request(struct HTTP2Session *session, const char *request,
+                                   const struct Allocator *allocator, enum HTTPError *error);
+
+/**
+ * The HTTP/2 counterpart of http_pipeline: up to depth requests are open as
+ * concurrent streams, and on_response is called as each completes, which
+ * may be out of order. Refused streams and dropped connections are retried.
+ * Returns how many requests were answered.
+ */
+size_t http2_pipeline(struct HTTP2Session *session, const char *const *requests, size_t count, size_t depth,
+                      int (*on_response)(void *user, size_t index, const struct HTTPResponse *response), void *user,
+                      const struct Allocator *allocator, enum HTTPError *error);
+
+#endif
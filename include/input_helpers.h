@@ -3,6 +3,8 @@
 #ifdef _WIN32
 #include <conio.h>
 #else
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 #endif
@@ -10,3 +12,7 @@
 char* get_password();
 
 char* load_file_as_string(const char* filename);
+
+/* Opens a file for writing that only the current user can read, tightening
+ * the permissions of an existing file. */
+FILE* fopen_private(const char* filename);
@@ -6,14 +6,19 @@ extern "C" {
 #endif
 
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "allocator.h"
+
 enum JsonError {
   JSON_ENOERR,
   JSON_EFMT,
   JSON_ENOMEM,
   JSON_ETYPE,
+  JSON_EIO,
 };
 
 enum JsonType {
@@ -25,9 +30,28 @@ enum JsonType {
   JSON_NULL,
   JSON_WRAPPED_OBJECT,
   JSON_WRAPPED_ARRAY,
+  JSON_STRING_VIEW,
+  JSON_INTEGER,
 };
 
 struct JsonToken;
+struct JsonArena;
+struct JsonStream;
+struct JsonTape;
+struct JsonPath;
+
+enum JsonEvent {
+  JSON_EVENT_OBJECT_START,
+  JSON_EVENT_OBJECT_END,
+  JSON_EVENT_ARRAY_START,
+  JSON_EVENT_ARRAY_END,
+  JSON_EVENT_KEY,
+  JSON_EVENT_STRING,
+  JSON_EVENT_NUMBER,
+  JSON_EVENT_TRUE,
+  JSON_EVENT_FALSE,
+  JSON_EVENT_NULL,
+};
 
 struct JsonArray {
   size_t length;
@@ -36,21 +60,108 @@ struct JsonArray {
 
 struct JsonEntry {
   char *key;
+  size_t key_length;
+  uint32_t hash;
   struct JsonToken *value;
 };
 
+/**
+ * Objects with more than a handful of entries also carry an open-addressing
+ * index of `index_size` slots holding entry positions plus one (0 is empty).
+ */
 struct JsonObject {
   size_t count;
   struct JsonEntry **entries;
+  uint32_t *index;
+  size_t index_size;
+};
+
+#define JSONTOK_CURSOR_MAX_DEPTH 64
+
+/**
+ * Forward-only reader over a raw JSON buffer. A cursor sits either on a
+ * value (`pending`) or between values; values it is moved past without
+ * being read are skipped without allocating anything.
+ */
+struct JsonCursor {
+  const char *ptr;
+  const char *end;
+  size_t depth;
+  unsigned char pending;
+  unsigned char at_start;
+  char containers[JSONTOK_CURSOR_MAX_DEPTH];
+  const char *starts[JSONTOK_CURSOR_MAX_DEPTH];
+  const struct Allocator *allocator;
+};
+
+#define JSONTOK_WRITER_BUFFER_SIZE 4096
+
+/**
+ * Serializes JSON into a growable buffer, a caller-supplied buffer, or a
+ * FILE* or file descriptor through an internal buffer. Write errors are
+ * sticky and reported by jsontok_writer_finish.
+ */
+struct JsonWriter {
+  char *buffer;
+  size_t length;
+  size_t capacity;
+  unsigned char growable;
+  unsigned char comma;
+  FILE *file;
+  int fd;
+  enum JsonError error;
+  const struct Allocator *allocator;
+  char inline_buffer[JSONTOK_WRITER_BUFFER_SIZE];
+};
+
+/**
+ * A key resolved once with jsontok_key so repeated lookups skip hashing.
+ */
+struct JsonKey {
+  const char *name;
+  size_t length;
+  uint32_t hash;
+};
+
+/**
+ * A string that has not been copied out of the source buffer. The bytes are
+ * not NUL-terminated and still contain escape sequences when the owning
+ * token has `escaped` set.
+ */
+struct JsonStringView {
+  const char *data;
+  size_t length;
+};
+
+/**
+ * The location of a nested object or array as a byte offset and length in
+ * the buffer that was parsed. JSON_WRAPPED_OBJECT and JSON_WRAPPED_ARRAY
+ * tokens hold a span instead of a copy of the text, so the buffer must
+ * outlive them.
+ */
+struct JsonSpan {
+  size_t offset;
+  size_t length;
 };
 
+/**
+ * Numbers without a fraction or exponent that fit in 64 bits are stored as
+ * JSON_INTEGER, in `as_unsigned` when `unsigned_integer` is set and in
+ * `as_integer` otherwise. All other numbers are JSON_NUMBER doubles.
+ */
 struct JsonToken {
   enum JsonType type : 4;
+  unsigned int escaped : 1;
+  unsigned int unsigned_integer : 1;
   union {
     struct JsonObject *as_object;
     struct JsonArray *as_array;
     char *as_string;
+    struct JsonStringView as_view;
+    struct JsonSpan as_span;
     double as_number;
+    int64_t as_integer;
+    uint64_t as_unsigned;
     unsigned char as_boolean;
   };
 };
@@ -70,6 +181,14 @@ const char *jsontok_strerror(enum JsonError error);
  */
 void jsontok_free(struct JsonToken *token);
 
+/**
+ * @brief Frees a JsonToken parsed with jsontok_parse_allocator.
+ *
+ * @param token The JsonToken to be freed.
+ * @param allocator The allocator the token was parsed with.
+ */
+void jsontok_free_allocator(struct JsonToken *token, const struct Allocator *allocator);
+
 /**
  * @brief Retrieves the value for a specified key in a JSON object.
  *
@@ -79,14 +198,601 @@ void jsontok_free(struct JsonToken *token);
  */
 struct JsonToken *jsontok_get(struct JsonObject *object, const char *key);
 
+/**
+ * @brief Resolves a key name to a reusable lookup handle.
+ *
+ * @param name The key to resolve. It must outlive the returned handle.
+ * @return The JsonKey for the name.
+ */
+struct JsonKey jsontok_key(const char *name);
+
+/**
+ * @brief Retrieves the value for a pre-resolved key in a JSON object.
+ *
+ * @param object The JSON object to search.
+ * @param key The key handle returned by jsontok_key.
+ * @return The value associated with the key, or NULL if not found.
+ */
+struct JsonToken *jsontok_get_key(struct JsonObject *object, const struct JsonKey *key);
+
 /**
  * @brief Parses a JSON string and returns a JsonToken.
  *
+ * Only the root container is expanded. Nested containers become
+ * JSON_WRAPPED_* spans into `json_string`, which jsontok_parse_span expands
+ * without copying.
+ *
  * @param json_string The JSON string to parse.
  * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
  */
 struct JsonToken *jsontok_parse(const char *json_string, enum JsonError *error);
 
+/**
+ * @brief Parses exactly `length` bytes of JSON, which need not be
+ * NUL-terminated.
+ *
+ * No byte at or past `json_string + length` is read, so a slice of a larger
+ * buffer such as an HTTP response body can be parsed where it lies.
+ *
+ * @param json_string The JSON text to parse.
+ * @param length The number of bytes of JSON text.
+ * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_n(const char *json_string, size_t length, enum JsonError *error);
+
+/**
+ * @brief Like jsontok_parse_n, with every node obtained from `allocator`.
+ *
+ * @param json_string The JSON text to parse.
+ * @param length The number of bytes of JSON text.
+ * @param allocator The allocator for the tree, or NULL for malloc.
+ * @return A JsonToken to be freed with jsontok_free_allocator, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_allocator(const char *json_string, size_t length, const struct Allocator *allocator, enum JsonError *error);
+
+/**
+ * @brief Creates a bump allocator for arena-backed parsing.
+ *
+ * @param block_size The size of each backing block, or 0 for the default.
+ * @return A pointer to the new JsonArena, or NULL if out of memory.
+ */
+struct JsonArena *jsontok_arena_new(size_t block_size);
+
+/**
+ * @brief Creates an arena whose blocks come from `allocator`.
+ *
+ * @param block_size The size of each backing block, or 0 for the default.
+ * @param allocator The allocator for the arena and its blocks, or NULL for malloc.
+ * @return A pointer to the new JsonArena, or NULL if out of memory.
+ */
+struct JsonArena *jsontok_arena_new_allocator(size_t block_size, const struct Allocator *allocator);
+
+/**
+ * @brief Releases every token parsed into the arena while keeping one block
+ * around for the next document.
+ *
+ * @param arena The JsonArena to be reset.
+ */
+void jsontok_arena_reset(struct JsonArena *arena);
+
+/**
+ * @brief Frees a JsonArena along with every token parsed into it.
+ *
+ * @param arena The JsonArena to be freed.
+ */
+void jsontok_arena_free(struct JsonArena *arena);
+
+/**
+ * @brief Parses a JSON string with every node allocated from an arena.
+ *
+ * Tokens returned by this function must not be passed to jsontok_free; they
+ * are released all at once by jsontok_arena_reset or jsontok_arena_free.
+ *
+ * @param json_string The JSON string to parse.
+ * @param arena The JsonArena that owns the resulting tree.
+ * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_arena(const char *json_string, struct JsonArena *arena, enum JsonError *error);
+
+/**
+ * @brief Parses a mutable JSON string without copying any strings.
+ *
+ * Strings and keys are unescaped inside json_string and terminated where
+ * their closing quote was, so JSON_STRING tokens and keys point into the
+ * caller's buffer. The buffer must outlive the tree.
+ *
+ * @param json_string The JSON string to parse, modified in place.
+ * @param arena The JsonArena that owns the resulting tree.
+ * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_inplace(char *json_string, struct JsonArena *arena, enum JsonError *error);
+
+/**
+ * @brief Parses a JSON string into JSON_STRING_VIEW tokens that point into
+ * the source.
+ *
+ * Strings are left escaped until jsontok_view_dup or jsontok_view_unescape is
+ * called. Keys are views as well, described by key and key_length; the rare
+ * key with escape sequences is unescaped into the arena. The buffer must
+ * outlive the tree.
+ *
+ * @param json_string The JSON string to parse.
+ * @param arena The JsonArena that owns the resulting tree.
+ * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_views(const char *json_string, struct JsonArena *arena, enum JsonError *error);
+
+/**
+ * @brief Unescapes a JSON_STRING_VIEW token into a caller-supplied buffer.
+ *
+ * @param token The JSON_STRING_VIEW token to unescape.
+ * @param dest A buffer of at least token->as_view.length + 1 bytes.
+ * @return The number of bytes written before the terminating NUL.
+ */
+size_t jsontok_view_unescape(const struct JsonToken *token, char *dest);
+
+/**
+ * @brief Compares a possibly escaped string view with an unescaped key.
+ *
+ * @param view The view to compare, as found in a JSON_STRING_VIEW token or
+ * a cursor key.
+ * @param key The unescaped key to compare against.
+ * @param length The length of `key` in bytes.
+ * @return 1 if the unescaped view equals `key`, 0 otherwise.
+ */
+int jsontok_view_equals(const struct JsonStringView *view, const char *key, size_t length);
+
+/**
+ * @brief Copies a JSON_STRING or JSON_STRING_VIEW token into a new
+ * NUL-terminated, unescaped string.
+ *
+ * @param token The string token to copy.
+ * @return The malloc'd string, or NULL if out of memory or not a string.
+ */
+char *jsontok_view_dup(const struct JsonToken *token);
+
+/**
+ * @brief Like jsontok_view_dup, with the copy obtained from `allocator`.
+ *
+ * @param token The string token to copy.
+ * @param allocator The allocator for the copy, or NULL for malloc.
+ * @return The copy, or NULL if out of memory or not a string.
+ */
+char *jsontok_view_dup_allocator(const struct JsonToken *token, const struct Allocator *allocator);
+
+/**
+ * @brief Expands a JSON_WRAPPED_* span without copying its text.
+ *
+ * Spans inside the result stay relative to `buffer`, so every level of a
+ * document can be expanded from the same buffer.
+ *
+ * @param buffer The buffer the span was parsed from.
+ * @param span The span to parse.
+ * @param arena The JsonArena that owns the resulting tree, or NULL to allocate it with malloc.
+ * @param error A pointer to an error enum which will store the error if there is one.
+ * @return A pointer to a JsonToken representing the parsed JSON, or NULL if an error occurs.
+ */
+struct JsonToken *jsontok_parse_span(const char *buffer, struct JsonSpan span, struct JsonArena *arena, enum JsonError *error);
+
+/**
+ * @brief Expands a JSON_WRAPPED_* span like jsontok_parse_inplace, unescaping
+ * its strings inside `buffer`.
+ */
+struct JsonToken *jsontok_parse_span_inplace(char *buffer, struct JsonSpan span, struct JsonArena *arena, enum JsonError *error);
+
+/**
+ * @brief Counts the elements of a wrapped array, or the fields of a wrapped
+ * object, without materializing them.
+ *
+ * @return 1 on success, 0 if the span is malformed.
+ */
+int jsontok_span_count(const char *buffer, struct JsonSpan span, size_t *count, enum JsonError *error);
+
+/**
+ * @brief Finds an element of a wrapped array by skipping the ones before it.
+ *
+ * @param element Receives the span of the element's text.
+ * @return 1 if the element exists, 0 if the array is shorter or malformed.
+ */
+int jsontok_span_element(const char *buffer, struct JsonSpan span, size_t index, struct JsonSpan *element, enum JsonError *error);
+
+/**
+ * @brief Positions a cursor on the root value of a JSON buffer.
+ *
+ * Cursor functions return 1 on success. They return 0 at the end of a
+ * container or on failure, and only set *error on failure.
+ *
+ * @param cursor The JsonCursor to initialize.
+ * @param json_string The JSON buffer, which need not be NUL-terminated.
+ * @param length The length of the buffer in bytes.
+ */
+void jsontok_cursor_init(struct JsonCursor *cursor, const char *json_string, size_t length);
+
+/**
+ * @brief Like jsontok_cursor_init, copying numbers too long for the stack
+ * through `allocator`.
+ *
+ * @param allocator The allocator for temporary copies, or NULL for malloc.
+ */
+void jsontok_cursor_init_allocator(struct JsonCursor *cursor, const char *json_string, size_t length, const struct Allocator *allocator);
+
+/**
+ * @brief Reports the type of the value under the cursor without consuming it.
+ * Nested containers report JSON_OBJECT or JSON_ARRAY and strings report
+ * JSON_STRING.
+ */
+int jsontok_cursor_peek(struct JsonCursor *cursor, enum JsonType *type, enum JsonError *error);
+
+/**
+ * @brief Steps into the object under the cursor.
+ */
+int jsontok_cursor_enter_object(struct JsonCursor *cursor, enum JsonError *error);
+
+/**
+ * @brief Steps into the array under the cursor.
+ */
+int jsontok_cursor_enter_array(struct JsonCursor *cursor, enum JsonError *error);
+
+/**
+ * @brief Moves to the next element of the current array, skipping the
+ * current one if it was not read. Returns 0 once the array is exhausted.
+ */
+int jsontok_cursor_next(struct JsonCursor *cursor, enum JsonError *error);
+
+/**
+ * @brief Moves to the value of the next field of the current object,
+ * skipping the current one if it was not read. Returns 0 once the object
+ * is exhausted.
+ *
+ * @param key Receives the raw, still escaped key, or may be NULL.
+ */
+int jsontok_cursor_next_field(struct JsonCursor *cursor, struct JsonStringView *key, enum JsonError *error);
+
+/**
+ * @brief Moves to the value of the named field of the current object.
+ *
+ * The search starts after the current field and wraps around to the start
+ * of the object once, so fields can be requested in any order. When the key
+ * is missing the cursor is left between fields of the same object.
+ */
+int jsontok_cursor_find_field(struct JsonCursor *cursor, const char *key, enum JsonError *error);
+
+/**
+ * @brief Skips the rest of the current container and steps out of it.
+ */
+int jsontok_cursor_leave(struct JsonCursor *cursor, enum JsonError *error);
+
+/**
+ * @brief Skips the value under the cursor.
+ */
+int jsontok_cursor_skip_value(struct JsonCursor *cursor, enum JsonError *error);
+
+/**
+ * @brief Reads the string under the cursor as a JSON_STRING_VIEW token
+ * pointing into the buffer.
+ */
+int jsontok_cursor_get_string_view(struct JsonCursor *cursor, struct JsonToken *view, enum JsonError *error);
+
+/**
+ * @brief Reads the number under the cursor.
+ */
+int jsontok_cursor_get_number(struct JsonCursor *cursor, double *number, enum JsonError *error);
+
+/**
+ * @brief Reads the integer under the cursor exactly. Fails with JSON_ETYPE
+ * if the value is not an integer that fits in int64_t.
+ */
+int jsontok_cursor_get_integer(struct JsonCursor *cursor, int64_t *integer, enum JsonError *error);
+
+/**
+ * @brief Reads the boolean under the cursor.
+ */
+int jsontok_cursor_get_boolean(struct JsonCursor *cursor, unsigned char *boolean, enum JsonError *error);
+
+/**
+ * @brief Returns the raw text of the value under the cursor, such as a whole
+ * nested object, and moves past it.
+ */
+int jsontok_cursor_get_raw(struct JsonCursor *cursor, struct JsonStringView *raw, enum JsonError *error);
+
+/**
+ * @brief Compiles a JSON Pointer style path such as "/messages/0/author"
+ * for jsontok_path_eval.
+ *
+ * Each segment names an object key, an array index, or `*` for every member
+ * of an object or array, so one path can select the author of every search
+ * hit. "~0" and "~1" escape '~' and '/', and the empty
+ * path matches the root.
+ *
+ * @param path The path to compile.
+ * @return The compiled path, freed with jsontok_path_free, or NULL on failure.
+ */
+struct JsonPath *jsontok_path_compile(const char *path, enum JsonError *error);
+
+/**
+ * @brief Like jsontok_path_compile, with the path obtained from `allocator`.
+ *
+ * jsontok_path_eval passes the same allocator to the cursor it walks with.
+ *
+ * @param allocator The allocator for the path, or NULL for malloc.
+ */
+struct JsonPath *jsontok_path_compile_allocator(const char *path, const struct Allocator *allocator, enum JsonError *error);
+
+/**
+ * @brief Frees a compiled path.
+ *
+ * @param path The JsonPath to be freed.
+ */
+void jsontok_path_free(struct JsonPath *path);
+
+/**
+ * @brief Calls `callback` for every value matching `path` in one forward
+ * pass over the buffer.
+ *
+ * Nested objects and arrays are walked in place, so matches inside
+ * containers that jsontok_parse would leave wrapped need no further parsing.
+ * The callback receives a cursor on the match and may read it with any
+ * cursor function; whatever it leaves unread is skipped. Returning nonzero
+ * stops the walk.
+ *
+ * @param path The compiled path.
+ * @param json_string The JSON buffer, which need not be NUL-terminated.
+ * @param length The length of the buffer in bytes.
+ * @param callback The function receiving each match.
+ * @param user An opaque pointer passed back to the callback.
+ * @return 1 once the walk is complete or stopped, 0 if the buffer is malformed.
+ */
+int jsontok_path_eval(const struct JsonPath *path, const char *json_string, size_t length, int (*callback)(void *user, struct JsonCursor *cursor), void *user, enum JsonError *error);
+
+/**
+ * @brief Parses a JSON string into a flat tape.
+ *
+ * The tape is one contiguous array of 64-bit entries tagged in their top
+ * byte. Containers store the index just past their matching end entry, so
+ * skipping a subtree is a single jump. Strings are unescaped into a buffer
+ * that follows the entries in the same allocation, and numbers take two
+ * entries. Objects hold alternating key and value entries.
+ *
+ * The tape is built with a pull cursor, so documents nested deeper than
+ * JSONTOK_CURSOR_MAX_DEPTH levels fail with JSON_EFMT.
+ *
+ * @param json_string The JSON string to be parsed.
+ * @param error A pointer to an error enum which will store the error if there is one.
+ * @return The tape, released with a single jsontok_tape_free, or NULL on failure.
+ */
+struct JsonTape *jsontok_parse_tape(const char *json_string, enum JsonError *error);
+
+/**
+ * @brief Like jsontok_parse_tape, with the tape and its scratch buffers
+ * obtained from `allocator`.
+ *
+ * @param allocator The allocator for the tape, or NULL for malloc.
+ * @return The tape, released with jsontok_tape_free, or NULL on failure.
+ */
+struct JsonTape *jsontok_parse_tape_allocator(const char *json_string, const struct Allocator *allocator, enum JsonError *error);
+
+/**
+ * @brief Frees a tape returned by jsontok_parse_tape.
+ */
+void jsontok_tape_free(struct JsonTape *tape);
+
+/**
+ * @brief Returns the entry of the root value.
+ */
+const uint64_t *jsontok_tape_root(const struct JsonTape *tape);
+
+/**
+ * @brief Returns the type of a tape entry. Numbers report JSON_INTEGER or
+ * JSON_NUMBER and strings report JSON_STRING.
+ */
+enum JsonType jsontok_tape_type(const uint64_t *entry);
+
+/**
+ * @brief Returns the first member of a container, or NULL if it is empty
+ * or not a container. For objects this is the first key.
+ */
+const uint64_t *jsontok_tape_child(const uint64_t *container);
+
+/**
+ * @brief Returns the entry following the value at `entry` within the same
+ * container, or NULL after the last member.
+ */
+const uint64_t *jsontok_tape_next(const struct JsonTape *tape, const uint64_t *entry);
+
+/**
+ * @brief Returns the number of elements in an array or fields in an object.
+ */
+size_t jsontok_tape_count(const struct JsonTape *tape, const uint64_t *container);
+
+/**
+ * @brief Returns the NUL-terminated, unescaped contents of a string entry.
+ *
+ * @param length Receives the length in bytes, or may be NULL.
+ * @return The string, or NULL if the entry is not a string.
+ */
+const char *jsontok_tape_string(const struct JsonTape *tape, const uint64_t *entry, size_t *length);
+
+/**
+ * @brief Returns the value of a JSON_INTEGER entry. Unsigned values above
+ * INT64_MAX can be recovered by casting to uint64_t.
+ */
+int64_t jsontok_tape_integer(const uint64_t *entry);
+
+/**
+ * @brief Returns the value of a numeric entry as a double.
+ */
+double jsontok_tape_number(const uint64_t *entry);
+
+/**
+ * @brief Returns the value of a boolean entry.
+ */
+unsigned char jsontok_tape_boolean(const uint64_t *entry);
+
+/**
+ * @brief Gets the value of a field in a tape object.
+ *
+ * @return The value entry, or NULL if the key is missing or `object` is not an object.
+ */
+const uint64_t *jsontok_tape_get(const struct JsonTape *tape, const uint64_t *object, const char *key);
+
+/**
+ * @brief Gets an element of a tape array by index.
+ *
+ * @return The element entry, or NULL if out of range or `array` is not an array.
+ */
+const uint64_t *jsontok_tape_index(const struct JsonTape *tape, const uint64_t *array, size_t index);
+
+/**
+ * @brief Starts a writer that collects output in a heap buffer, growing it
+ * as needed. Release it with jsontok_writer_free.
+ */
+void jsontok_writer_init(struct JsonWriter *writer);
+
+/**
+ * @brief Like jsontok_writer_init, growing the buffer through `allocator`.
+ */
+void jsontok_writer_init_allocator(struct JsonWriter *writer, const struct Allocator *allocator);
+
+/**
+ * @brief Starts a writer that fills a caller-supplied buffer. Output that
+ * does not fit, including the trailing NUL, fails with JSON_ENOMEM.
+ */
+void jsontok_writer_init_buffer(struct JsonWriter *writer, char *buffer, size_t capacity);
+
+/**
+ * @brief Starts a writer that streams to a FILE*, flushing whenever its
+ * internal buffer fills.
+ */
+void jsontok_writer_init_file(struct JsonWriter *writer, FILE *file);
+
+/**
+ * @brief Starts a writer that streams to a file descriptor, flushing
+ * whenever its internal buffer fills.
+ */
+void jsontok_writer_init_fd(struct JsonWriter *writer, int fd);
+
+void jsontok_writer_object_start(struct JsonWriter *writer);
+void jsontok_writer_object_end(struct JsonWriter *writer);
+void jsontok_writer_array_start(struct JsonWriter *writer);
+void jsontok_writer_array_end(struct JsonWriter *writer);
+
+/**
+ * @brief Writes an object key and the colon that follows it.
+ */
+void jsontok_writer_key(struct JsonWriter *writer, const char *key);
+
+/**
+ * @brief Writes a quoted string, escaping quotes, backslashes and control
+ * characters.
+ */
+void jsontok_writer_string(struct JsonWriter *writer, const char *string);
+void jsontok_writer_string_n(struct JsonWriter *writer, const char *string, size_t length);
+
+void jsontok_writer_integer(struct JsonWriter *writer, int64_t integer);
+void jsontok_writer_unsigned(struct JsonWriter *writer, uint64_t integer);
+
+/**
+ * @brief Writes a double. Infinities and NaN fail with JSON_ETYPE.
+ */
+void jsontok_writer_number(struct JsonWriter *writer, double number);
+void jsontok_writer_boolean(struct JsonWriter *writer, unsigned char boolean);
+void jsontok_writer_null(struct JsonWriter *writer);
+
+/**
+ * @brief Writes already serialized JSON as the next value.
+ */
+void jsontok_writer_raw(struct JsonWriter *writer, const char *json, size_t length);
+
+/**
+ * @brief Flushes buffered output and NUL-terminates in-memory output.
+ *
+ * @param length Receives the number of bytes written to memory, or may be NULL.
+ * @return The output for in-memory writers, or NULL for streams and on failure.
+ */
+char *jsontok_writer_finish(struct JsonWriter *writer, size_t *length, enum JsonError *error);
+
+/**
+ * @brief Releases the buffer of a growable writer.
+ */
+void jsontok_writer_free(struct JsonWriter *writer);
+
+/**
+ * @brief Parses a JSON string whose root is a large array using several
+ * threads.
+ *
+ * A structural pass finds the span of each element, then the elements are
+ * parsed concurrently into a pre-sized elements array, each as
+ * jsontok_parse_span would parse it. Object and array elements therefore
+ * come back expanded, with only the containers inside them wrapped. The
+ * result is freed with jsontok_free. Small arrays are parsed the same way on
+ * the calling thread, and roots that are not arrays as by jsontok_parse.
+ *
+ * @param json_string The JSON string to be parsed.
+ * @param threads The number of threads to use, or 0 for one per online CPU.
+ * @param error A pointer to an error enum which will store the error if there is one.
+ * @return The parsed token, or NULL on failure.
+ */
+struct JsonToken *jsontok_parse_parallel(const char *json_string, size_t threads, enum JsonError *error);
+
+/**
+ * @brief Like jsontok_parse_parallel, with every node obtained from
+ * `allocator`.
+ *
+ * The workers call the allocator concurrently, so it must be thread-safe.
+ *
+ * @param allocator The allocator for the tree, or NULL for malloc.
+ * @return A JsonToken to be freed with jsontok_free_allocator, or NULL on failure.
+ */
+struct JsonToken *jsontok_parse_parallel_allocator(const char *json_string, size_t threads, const struct Allocator *allocator, enum JsonError *error);
+
+/**
+ * @brief Creates a push parser that accepts a document in arbitrary chunks.
+ *
+ * The callback receives one event per token. KEY and STRING data is
+ * unescaped, NUMBER data is the raw number text; neither is NUL-terminated
+ * and both are only valid for the duration of the call. Returning nonzero
+ * from an OBJECT_START or ARRAY_START event skips that container without
+ * emitting events for its contents or its end.
+ *
+ * @param callback The function receiving parse events.
+ * @param user An opaque pointer passed back to the callback.
+ * @return A pointer to the new JsonStream, or NULL if out of memory.
+ */
+struct JsonStream *jsontok_stream_new(int (*callback)(void *user, enum JsonEvent event, const char *data, size_t length), void *user);
+
+/**
+ * @brief Like jsontok_stream_new, with the stream and its buffers obtained
+ * from `allocator`.
+ *
+ * @param allocator The allocator for the stream, or NULL for malloc.
+ */
+struct JsonStream *jsontok_stream_new_allocator(int (*callback)(void *user, enum JsonEvent event, const char *data, size_t length), void *user, const struct Allocator *allocator);
+
+/**
+ * @brief Feeds the next chunk of a document to a push parser.
+ *
+ * @param stream The JsonStream to feed.
+ * @param buffer The chunk, which may split tokens anywhere.
+ * @param length The length of the chunk in bytes.
+ * @return 1 on success, or 0 if the document is malformed or out of memory.
+ */
+int jsontok_feed(struct JsonStream *stream, const char *buffer, size_t length, enum JsonError *error);
+
+/**
+ * @brief Signals the end of input to a push parser.
+ *
+ * @param stream The JsonStream to finish.
+ * @return 1 if a complete document was parsed, otherwise 0.
+ */
+int jsontok_finish(struct JsonStream *stream, enum JsonError *error);
+
+/**
+ * @brief Frees a push parser.
+ *
+ * @param stream The JsonStream to be freed.
+ */
+void jsontok_stream_free(struct JsonStream *stream);
+
 #ifdef __cplusplus
 }
 #endif
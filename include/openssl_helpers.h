@@ -8,10 +8,28 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "allocator.h"
+
+/**
+ * One response header. Name and value point into the response's header
+ * buffer and are NUL-terminated, with surrounding whitespace removed.
+ */
+struct HTTPHeader {
+  const char *name;
+  size_t name_length;
+  const char *value;
+  size_t value_length;
+};
+
 struct HTTPResponse {
   uint16_t code;
+  /* The body with any chunked framing removed, NUL-terminated. */
   char *data;
-  unsigned int length;
+  size_t length;
+  struct HTTPHeader *headers;
+  size_t header_count;
+  /* The status line and header block the header table points into. */
+  char *buffer;
 };
 
 enum HTTPError {
@@ -19,11 +37,150 @@ enum HTTPError {
   HTTP_ENOMEM,
   HTTP_EBIO,
   HTTP_EPARSE,
+  HTTP_ETIMEOUT,
 };
 
+/**
+ * An incremental response parser, for callers that do their own I/O.
+ */
+struct HTTPParser;
+
+struct HTTPParser *http_parser_new(const struct Allocator *allocator);
+
+/**
+ * Parses the next bytes of a response and returns how many belong to it,
+ * or (size_t)-1 with error set if it is malformed. Bytes past the end of
+ * the response are left for the next one.
+ */
+size_t http_parser_feed(struct HTTPParser *parser, const char *data, size_t length, enum HTTPError *error);
+
+/**
+ * Tells the parser the connection closed. Returns 1 if the response is
+ * complete, or 0 with error set: HTTP_EBIO if nothing had arrived, which
+ * on a kept-alive connection means the request can be sent again.
+ */
+int http_parser_finish(struct HTTPParser *parser, enum HTTPError *error);
+
+int http_parser_done(const struct HTTPParser *parser);
+
+/**
+ * Takes the completed response and readies the parser for the next one.
+ * close_after is set if the server will close the connection after it.
+ */
+struct HTTPResponse *http_parser_take(struct HTTPParser *parser, int *close_after);
+
+void http_parser_free(struct HTTPParser *parser);
+
+/**
+ * Enables TLS session resumption for connections made from ctx. The last
+ * session is loaded from path, and every new session or ticket the server
+ * issues is written back there, readable only by the current user.
+ * Returns 1 on success, 0 if out of memory.
+ */
+int tls_session_cache_enable(SSL_CTX *ctx, const char *path);
+
+/**
+ * Connects or reconnects a BIO from BIO_new_ssl_connect, offering the cached
+ * session when there is one. Returns 1 on success, 0 on failure.
+ */
+int http_connect(BIO *connection);
+
+/**
+ * Sends a request on a kept-alive connection and reads exactly one response,
+ * framed by Content-Length or chunked encoding. The body is decoded into a
+ * single buffer, allocated once up front when the length is known. If the
+ * server has closed the idle connection, it is reopened and the request sent
+ * once more. On a connection that negotiated h2, the request is sent as an
+ * HTTP/2 stream instead.
+ */
 struct HTTPResponse *http_request(BIO *connection, const char *request,
+                                  const struct Allocator *allocator,
                                   enum HTTPError *error);
 
+/**
+ * Like http_request, but the response is read into buffers kept with the
+ * connection and reused by every request on it, so once they have grown to
+ * fit, no memory is allocated. The response is a view into those buffers:
+ * it must not be freed and is only valid until the next request on the
+ * connection. The buffers are freed with the connection.
+ */
+const struct HTTPResponse *http_request_view(BIO *connection, const char *request,
+                                             const struct Allocator *allocator, enum HTTPError *error);
+
+/**
+ * Sends a request and passes the response body to on_body piece by piece as
+ * it is read, with chunked transfer encoding already removed. The returned
+ * response carries the status code and total body length but no data.
+ */
+struct HTTPResponse *http_request_stream(BIO *connection, const char *request,
+                                         void (*on_body)(void *user, const char *data, size_t length),
+                                         void *user, const struct Allocator *allocator,
+                                         enum HTTPError *error);
+
+/**
+ * Sends requests on one kept-alive connection with up to depth of them in
+ * flight, reading the responses in order and passing each to on_response
+ * with the index of its request. When on_response returns nonzero no more
+ * requests are sent, but those already sent are still answered. If the
+ * connection drops, it is reopened and every unacknowledged request sent
+ * again. Responses are read into the connection's buffers as with
+ * http_request_view and are only valid during on_response. Returns how many
+ * requests were answered; on failure error is set and requests from that
+ * index on can be re-queued. On a connection that negotiated h2, see
+ * http2_pipeline, where responses may arrive out of order.
+ */
+size_t http_pipeline(BIO *connection, const char *const *requests, size_t count, size_t depth,
+                     int (*on_response)(void *user, size_t index, const struct HTTPResponse *response), void *user,
+                     const struct Allocator *allocator, enum HTTPError *error);
+
+/**
+ * A request compiled once and rendered many times, such as one with the
+ * header block and token already in place and only an ID left to fill in.
+ * Rendering gathers the fixed pieces and the slot values into one buffer,
+ * so the request goes out in a single write.
+ */
+struct HTTPTemplate;
+
+/**
+ * Compiles a request from count pieces of text with a slot between each two
+ * of them, so count - 1 slots in all. The pieces are copied. Returns NULL
+ * if out of memory.
+ */
+struct HTTPTemplate *http_template_compile(const char *const *pieces, size_t count,
+                                           const struct Allocator *allocator, enum HTTPError *error);
+
+/**
+ * Returns the length of the request with values in its slots, not counting
+ * the NUL http_template_render adds.
+ */
+size_t http_template_size(const struct HTTPTemplate *request_template, const char *const *values);
+
+/**
+ * Renders the request with values in its slots into out, which must hold
+ * http_template_size bytes and a NUL. Allocates nothing. Returns the length.
+ */
+size_t http_template_render(const struct HTTPTemplate *request_template, const char *const *values, char *out);
+
+void http_template_free(struct HTTPTemplate *request_template);
+
+/**
+ * Returns the value of the named header, compared case-insensitively, or
+ * NULL if the response does not have it.
+ */
+const char *http_response_header(const struct HTTPResponse *response, const char *name);
+
+/**
+ * Parses a Content-Length value into length. Returns 0 if it is not a plain
+ * decimal number or is larger than any body this client accepts.
+ */
+int http_content_length(const char *value, size_t *length);
+
+/**
+ * Releases a response, its headers and its body, using the allocator the
+ * request was made with.
+ */
+void http_response_free(struct HTTPResponse *response, const struct Allocator *allocator);
+
 const char *http_strerror(enum HTTPError *error);
 
 #endif
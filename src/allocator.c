@@ -0,0 +1,97 @@
+#include "allocator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Prefixed to every counted block; the union keeps the payload max-aligned. */
+union CountingHeader {
+  struct {
+    size_t size;
+    size_t chain;
+  } block;
+  long double align;
+};
+
+void *allocator_alloc(const struct Allocator *allocator, size_t size) {
+  if (!allocator) return malloc(size);
+  return allocator->alloc(allocator->user, size);
+}
+
+void *allocator_realloc(const struct Allocator *allocator, void *ptr, size_t size) {
+  if (!allocator) return realloc(ptr, size);
+  return allocator->realloc(allocator->user, ptr, size);
+}
+
+void allocator_free(const struct Allocator *allocator, void *ptr) {
+  if (!ptr) return;
+  if (!allocator) {
+    free(ptr);
+    return;
+  }
+  allocator->free(allocator->user, ptr);
+}
+
+char *allocator_strndup(const struct Allocator *allocator, const char *string, size_t length) {
+  char *copy = allocator_alloc(allocator, length + 1);
+  if (!copy) return NULL;
+  memcpy(copy, string, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+static void counting_grow(struct AllocatorStats *stats, size_t size) {
+  stats->bytes += size;
+  stats->in_use += size;
+  if (stats->in_use > stats->peak) stats->peak = stats->in_use;
+}
+
+static void *counting_alloc(void *user, size_t size) {
+  struct CountingAllocator *counter = user;
+  union CountingHeader *header = allocator_alloc(counter->parent, sizeof(union CountingHeader) + size);
+  if (!header) return NULL;
+  header->block.size = size;
+  header->block.chain = 0;
+  counter->stats.allocations++;
+  counting_grow(&counter->stats, size);
+  return header + 1;
+}
+
+static void counting_free(void *user, void *ptr) {
+  struct CountingAllocator *counter = user;
+  union CountingHeader *header = (union CountingHeader *)ptr - 1;
+  counter->stats.frees++;
+  counter->stats.in_use -= header->block.size < counter->stats.in_use ? header->block.size : counter->stats.in_use;
+  allocator_free(counter->parent, header);
+}
+
+static void *counting_realloc(void *user, void *ptr, size_t size) {
+  struct CountingAllocator *counter = user;
+  if (!ptr) return counting_alloc(user, size);
+  union CountingHeader *header = (union CountingHeader *)ptr - 1;
+  size_t old_size = header->block.size;
+  header = allocator_realloc(counter->parent, header, sizeof(union CountingHeader) + size);
+  if (!header) return NULL;
+  header->block.size = size;
+  header->block.chain++;
+  counter->stats.reallocations++;
+  if (header->block.chain > counter->stats.longest_realloc_chain) counter->stats.longest_realloc_chain = header->block.chain;
+  counter->stats.in_use -= old_size < counter->stats.in_use ? old_size : counter->stats.in_use;
+  counting_grow(&counter->stats, size);
+  return header + 1;
+}
+
+void counting_allocator_init(struct CountingAllocator *counter, const struct Allocator *parent) {
+  counter->allocator.alloc = counting_alloc;
+  counter->allocator.realloc = counting_realloc;
+  counter->allocator.free = counting_free;
+  counter->allocator.user = counter;
+  counter->parent = parent;
+  memset(&counter->stats, 0, sizeof(struct AllocatorStats));
+}
+
+void counting_allocator_reset(struct CountingAllocator *counter) {
+  size_t in_use = counter->stats.in_use;
+  memset(&counter->stats, 0, sizeof(struct AllocatorStats));
+  counter->stats.in_use = in_use;
+  counter->stats.peak = in_use;
+}
@@ -0,0 +1,69 @@
+#include "content_encoding.h"
+
+#include <string.h>
+#include <strings.h>
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+  return allocator_alloc(opaque, (size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf address) { allocator_free(opaque, address); }
+
+static int decoder_start(struct ContentDecoder *decoder, int window_bits) {
+  memset(&decoder->stream, 0, sizeof(z_stream));
+  decoder->stream.zalloc = zlib_alloc;
+  decoder->stream.zfree = zlib_free;
+  decoder->stream.opaque = (voidpf)decoder->allocator;
+  return inflateInit2(&decoder->stream, window_bits) == Z_OK;
+}
+
+int content_decoder_init(struct ContentDecoder *decoder, const char *encoding, const struct Allocator *allocator) {
+  memset(decoder, 0, sizeof(struct ContentDecoder));
+  decoder->allocator = allocator;
+  if (!encoding || !*encoding || strcasecmp(encoding, "identity") == 0) return 0;
+  if (strcasecmp(encoding, "gzip") != 0 && strcasecmp(encoding, "x-gzip") != 0 &&
+      strcasecmp(encoding, "deflate") != 0) {
+    return -1;
+  }
+  /* 32 lets zlib tell gzip from zlib-wrapped deflate by the header. */
+  if (!decoder_start(decoder, MAX_WBITS + 32)) return -1;
+  decoder->active = 1;
+  return 1;
+}
+
+int content_decoder_run(struct ContentDecoder *decoder, const char **data, size_t *length, char *out,
+                        size_t out_size, size_t *produced) {
+  *produced = 0;
+  /* Anything after the end of the compressed stream is ignored. */
+  if (decoder->done) {
+    *data += *length;
+    *length = 0;
+    return 1;
+  }
+  decoder->stream.next_in = (Bytef *)*data;
+  decoder->stream.avail_in = (uInt)*length;
+  decoder->stream.next_out = (Bytef *)out;
+  decoder->stream.avail_out = (uInt)out_size;
+  int result = inflate(&decoder->stream, Z_NO_FLUSH);
+  /* Some servers send "deflate" without the zlib wrapper. */
+  if (result == Z_DATA_ERROR && !decoder->started && !decoder->raw) {
+    inflateEnd(&decoder->stream);
+    decoder->raw = 1;
+    if (!decoder_start(decoder, -MAX_WBITS)) return 0;
+    return content_decoder_run(decoder, data, length, out, out_size, produced);
+  }
+  if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) return 0;
+  size_t used = *length - decoder->stream.avail_in;
+  if (used) decoder->started = 1;
+  *data += used;
+  *length -= used;
+  *produced = out_size - decoder->stream.avail_out;
+  if (result == Z_STREAM_END) decoder->done = 1;
+  return 1;
+}
+
+void content_decoder_end(struct ContentDecoder *decoder) {
+  if (!decoder->active) return;
+  inflateEnd(&decoder->stream);
+  decoder->active = 0;
+}
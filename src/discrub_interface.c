@@ -1,55 +1,73 @@
 #include "discrub_interface.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static void add_param(char **params, size_t *size, const char *key,
-                      const char *value) {
-  if (value) {
-    size_t len = strlen(key) + strlen(value) + 2;
-    *params = realloc(*params, *size + len);
-    if (*params) {
-      strcat(*params, key);
-      strcat(*params, "=");
-      strcat(*params, value);
-      strcat(*params, "&");
-      *size += len;
-    }
-  }
+static int url_unreserved(unsigned char c) {
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' ||
+         c == '.' || c == '~';
 }
 
-static char *get_params(struct SearchOptions *options) {
-  size_t params_size = 1;
-  char *params = malloc(params_size);
-  if (!params) return NULL;
-  params[0] = '\0';
-
-  add_param(&params, &params_size, "author_id", options->author_id);
-  add_param(&params, &params_size, "channel_id", options->channel_id);
-  add_param(&params, &params_size, "content", options->content);
-  add_param(&params, &params_size, "mentions", options->mentions);
-  add_param(&params, &params_size, "include_nsfw",
-            options->include_nsfw ? "true" : "false");
-  add_param(&params, &params_size, "pinned",
-            options->pinned ? "true" : "false");
-
-  if (options->offset) {
-    char uint_str[12];
-    snprintf(uint_str, sizeof(uint_str), "%lu", options->offset);
-    add_param(&params, &params_size, "offset", uint_str);
+/**
+ * Appends "key=value" to the query at out + size, after a '&' if the query
+ * is not empty, with the value URL-encoded. With out NULL it only measures,
+ * so a query can be sized and then written into one allocation. Returns
+ * the new size.
+ */
+static size_t add_param(char *out, size_t size, const char *key, const char *value) {
+  static const char hex[] = "0123456789ABCDEF";
+  const unsigned char *ptr;
+  size_t key_length = strlen(key);
+  if (!value) return size;
+  if (size) {
+    if (out) out[size] = '&';
+    size++;
+  }
+  if (out) {
+    memcpy(out + size, key, key_length);
+    out[size + key_length] = '=';
+  }
+  size += key_length + 1;
+  for (ptr = (const unsigned char *)value; *ptr; ptr++) {
+    if (url_unreserved(*ptr)) {
+      if (out) out[size] = *ptr;
+      size++;
+    } else {
+      if (out) {
+        out[size] = '%';
+        out[size + 1] = hex[*ptr >> 4];
+        out[size + 2] = hex[*ptr & 15];
+      }
+      size += 3;
+    }
   }
+  return size;
+}
 
-  if (params_size == 1) {
-    free(params);
-    return NULL;
-  }
+static size_t search_params(const struct SearchOptions *options, char *out) {
+  size_t size = 0;
+  size = add_param(out, size, "author_id", options->author_id);
+  size = add_param(out, size, "channel_id", options->channel_id);
+  size = add_param(out, size, "content", options->content);
+  size = add_param(out, size, "mentions", options->mentions);
+  size = add_param(out, size, "include_nsfw", options->include_nsfw ? "true" : "false");
+  size = add_param(out, size, "pinned", options->pinned ? "true" : "false");
+  return size;
+}
 
-  params[params_size - 2] = '\0';
+/* Builds the URL-encoded search query, without the offset, in a single allocation. */
+static char *get_params(const struct SearchOptions *options, const struct Allocator *allocator) {
+  size_t size = search_params(options, NULL);
+  char *params = allocator_alloc(allocator, size + 1);
+  if (!params) return NULL;
+  search_params(options, params);
+  params[size] = '\0';
   return params;
 }
 
-static char *fmt_timestamp(const char *timestamp) {
+static char *fmt_timestamp(const char *timestamp, const struct Allocator *allocator) {
   struct tm tm;
   memset(&tm, 0, sizeof(struct tm));
   if (strptime(timestamp, "%Y-%m-%dT%H:%M:%S", &tm) == NULL) return NULL;
@@ -58,405 +76,674 @@ static char *fmt_timestamp(const char *timestamp) {
   struct tm *local_tm = localtime(&time_utc);
   char buffer[64];
   strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", local_tm);
-  char *new_timestamp = malloc(strlen(buffer) + 1);
+  size_t length = strlen(buffer);
+  char *new_timestamp = allocator_alloc(allocator, length + 1);
   if (!new_timestamp) return NULL;
-  strncpy(new_timestamp, buffer, strlen(buffer));
-  new_timestamp[strlen(buffer)] = '\0';
+  memcpy(new_timestamp, buffer, length + 1);
   return new_timestamp;
 }
 
-bool discrub_delete_message(BIO *connection, const char *token,
-                            const char *channel_id, const char *message_id,
-                            enum DiscrubError *error) {
-  if (!connection || !token || !channel_id || !message_id) {
-    *error = DISCRUB_EARGS;
-    return 1;
+/**
+ * Fields copied into struct DiscordMessage from each search hit, as
+ * X(field, scope, key, convert). Only these key paths are materialized;
+ * everything else in the response is skipped without allocating.
+ */
+#define DISCORD_MESSAGE_FIELDS(X)                                   \
+  X(id, DISCORD_SCOPE_MESSAGE, "id", NULL)                          \
+  X(content, DISCORD_SCOPE_MESSAGE, "content", NULL)                \
+  X(timestamp, DISCORD_SCOPE_MESSAGE, "timestamp", fmt_timestamp)   \
+  X(author_id, DISCORD_SCOPE_AUTHOR, "id", NULL)                    \
+  X(author_username, DISCORD_SCOPE_AUTHOR, "username", NULL)
+
+enum DiscordScope {
+  DISCORD_SCOPE_MESSAGE,
+  DISCORD_SCOPE_AUTHOR,
+};
+
+struct DiscordField {
+  enum DiscordScope scope;
+  const char *key;
+  size_t key_length;
+  size_t offset;
+  char *(*convert)(const char *value, const struct Allocator *allocator);
+};
+
+static const struct DiscordField discord_message_fields[] = {
+#define DISCORD_FIELD(field, scope, key, convert) {scope, key, sizeof(key) - 1, offsetof(struct DiscordMessage, field), convert},
+    DISCORD_MESSAGE_FIELDS(DISCORD_FIELD)
+#undef DISCORD_FIELD
+};
+
+#define DISCORD_FIELD_COUNT (sizeof(discord_message_fields) / sizeof(discord_message_fields[0]))
+#define DISCORD_FIELDS_ALL ((1u << DISCORD_FIELD_COUNT) - 1)
+
+void discrub_free_message(struct DiscordMessage *message, const struct Allocator *allocator) {
+  size_t i;
+  for (i = 0; i < DISCORD_FIELD_COUNT; i++) {
+    allocator_free(allocator, *(char **)((char *)message + discord_message_fields[i].offset));
   }
-  const char *request_fmt =
-      "DELETE /api/v9/channels/%s/messages/%s HTTP/1.1\r\n"
-      "Host: discord.com\r\n"
-      "Authorization: %s\r\n"
-      "Connection: close\r\n"
-      "\r\n";
-  size_t request_size =
-      snprintf(NULL, 0, request_fmt, channel_id, message_id, token) + 1;
-  char *request_string = malloc(request_size);
-  if (!request_string) {
+}
+
+static int store_field(struct JsonCursor *cursor, struct DiscordMessage *message, const struct DiscordField *field, const struct Allocator *allocator, enum DiscrubError *error) {
+  enum JsonError json_error = JSON_ENOERR;
+  struct JsonToken view;
+  if (!jsontok_cursor_get_string_view(cursor, &view, &json_error)) {
+    *error = json_error == JSON_ENOMEM ? DISCRUB_ENOMEM : DISCRUB_EPARSE;
+    return 0;
+  }
+  char *value = jsontok_view_dup_allocator(&view, allocator);
+  if (!value) {
     *error = DISCRUB_ENOMEM;
-    return false;
+    return 0;
+  }
+  if (field->convert) {
+    char *converted = field->convert(value, allocator);
+    allocator_free(allocator, value);
+    if (!converted) {
+      *error = DISCRUB_EPARSE;
+      return 0;
+    }
+    value = converted;
   }
-  snprintf(request_string, request_size, request_fmt, channel_id, message_id,
-           token);
-  enum HTTPError http_error = HTTP_ENOERR;
-  struct HTTPResponse *response =
-      http_request(connection, request_string, &http_error);
-  if (http_error) {
-    printf("Error while fetching: %s\n\nWith request: %s\n",
-           http_strerror(&http_error), request_string);
-    free(request_string);
-    *error = DISCRUB_EHTTP;
-    return false;
+  char **slot = (char **)((char *)message + field->offset);
+  allocator_free(allocator, *slot);
+  *slot = value;
+  return 1;
+}
+
+/* Walks one object of a message in a single pass, storing the fields in its scope. */
+static int extract_fields(struct JsonCursor *cursor, struct DiscordMessage *message, enum DiscordScope scope, unsigned int *seen, const struct Allocator *allocator, enum DiscrubError *error) {
+  enum JsonError json_error = JSON_ENOERR;
+  struct JsonStringView key;
+  if (!jsontok_cursor_enter_object(cursor, &json_error)) {
+    *error = DISCRUB_EPARSE;
+    return 0;
   }
-  free(request_string);
-  if (!response) {
-    printf("Failed to delete message: No response\n");
-    return 1;
+  while (jsontok_cursor_next_field(cursor, &key, &json_error)) {
+    if (scope == DISCORD_SCOPE_MESSAGE && jsontok_view_equals(&key, "author", 6)) {
+      if (!extract_fields(cursor, message, DISCORD_SCOPE_AUTHOR, seen, allocator, error)) return 0;
+      continue;
+    }
+    size_t i;
+    for (i = 0; i < DISCORD_FIELD_COUNT; i++) {
+      const struct DiscordField *field = &discord_message_fields[i];
+      if (field->scope != scope || !jsontok_view_equals(&key, field->key, field->key_length)) continue;
+      if (!store_field(cursor, message, field, allocator, error)) return 0;
+      *seen |= 1u << i;
+      break;
+    }
+  }
+  if (json_error) {
+    *error = DISCRUB_EPARSE;
+    return 0;
+  }
+  return 1;
+}
+
+struct SearchResponse *discrub_parse_search_response(const char *json_string, size_t length, const struct Allocator *allocator, enum DiscrubError *error) {
+  struct JsonCursor cursor;
+  enum JsonError json_error = JSON_ENOERR;
+  jsontok_cursor_init_allocator(&cursor, json_string, length, allocator);
+  if (!jsontok_cursor_enter_object(&cursor, &json_error) ||
+      !jsontok_cursor_find_field(&cursor, "messages", &json_error) ||
+      !jsontok_cursor_enter_array(&cursor, &json_error)) {
+    *error = DISCRUB_EPARSE;
+    return NULL;
+  }
+  struct SearchResponse *search_response = allocator_alloc(allocator, sizeof(struct SearchResponse));
+  if (!search_response) {
+    *error = DISCRUB_ENOMEM;
+    return NULL;
+  }
+  search_response->messages = NULL;
+  search_response->length = 0;
+  size_t capacity = 0;
+  while (jsontok_cursor_next(&cursor, &json_error)) {
+    if (search_response->length == capacity) {
+      size_t new_capacity = capacity ? capacity * 2 : 32;
+      struct DiscordMessage *messages = allocator_realloc(allocator, search_response->messages, new_capacity * sizeof(struct DiscordMessage));
+      if (!messages) {
+        discrub_free_search_response(search_response, allocator);
+        *error = DISCRUB_ENOMEM;
+        return NULL;
+      }
+      search_response->messages = messages;
+      capacity = new_capacity;
+    }
+    /* Each hit is wrapped in an array whose first element is the message. */
+    struct DiscordMessage *message = &search_response->messages[search_response->length];
+    memset(message, 0, sizeof(struct DiscordMessage));
+    unsigned int seen = 0;
+    enum DiscrubError extract_error = DISCRUB_EPARSE;
+    if (!jsontok_cursor_enter_array(&cursor, &json_error) ||
+        !jsontok_cursor_next(&cursor, &json_error) ||
+        !extract_fields(&cursor, message, DISCORD_SCOPE_MESSAGE, &seen, allocator, &extract_error) ||
+        !jsontok_cursor_leave(&cursor, &json_error) ||
+        seen != DISCORD_FIELDS_ALL) {
+      discrub_free_message(message, allocator);
+      discrub_free_search_response(search_response, allocator);
+      *error = extract_error;
+      return NULL;
+    }
+    search_response->length++;
+  }
+  if (json_error) {
+    discrub_free_search_response(search_response, allocator);
+    *error = DISCRUB_EPARSE;
+    return NULL;
   }
-  if (response->code != 204) {
+  return search_response;
+}
+
+struct DeleteBatch {
+  bool *deleted;
+  enum DiscrubError *error;
+};
+
+static int on_delete_response(void *user, size_t index, const struct HTTPResponse *response) {
+  struct DeleteBatch *batch = user;
+  /* A re-sent DELETE that already went through comes back as Unknown Message. */
+  batch->deleted[index] = response->code == 204 || response->code == 404;
+  if (!batch->deleted[index]) {
     printf("Failed to delete message: Status code is %hu\n", response->code);
+    *batch->error = DISCRUB_EHTTP;
     return 1;
   }
-  return 0;
+  /* Stop at the end of the rate-limit window rather than run into a 429. */
+  const char *remaining = http_response_header(response, "X-RateLimit-Remaining");
+  return remaining && strcmp(remaining, "0") == 0;
 }
 
-struct SearchResponse *discrub_search(BIO *connection, const char *token,
-                                      const char *server_id,
-                                      struct SearchOptions *options,
-                                      enum DiscrubError *error) {
-  if (!connection || !token || !server_id || !options) {
+/**
+ * Searches and deletes compiled for one session. The request line, token
+ * and other headers are rendered once; each call only fills in the offset
+ * or message ID, into buffers reused from call to call.
+ */
+struct DiscrubRequests {
+  const struct Allocator *allocator;
+  struct HTTPTemplate *search;
+  struct HTTPTemplate *delete_message;
+  char *buffer;
+  size_t buffer_capacity;
+  const char **batch;
+  size_t batch_capacity;
+};
+
+/* Joins strings into a new one, for building template pieces. */
+static char *join_strings(const char *const *parts, size_t count, const struct Allocator *allocator) {
+  size_t size = 0, i;
+  for (i = 0; i < count; i++) size += strlen(parts[i]);
+  char *joined = allocator_alloc(allocator, size + 1);
+  if (!joined) return NULL;
+  size = 0;
+  for (i = 0; i < count; i++) {
+    size_t length = strlen(parts[i]);
+    memcpy(joined + size, parts[i], length);
+    size += length;
+  }
+  joined[size] = '\0';
+  return joined;
+}
+
+/* Compiles a request with one slot between the joined head and tail parts. */
+static struct HTTPTemplate *compile_request(const char *const *head, size_t head_count, const char *const *tail,
+                                            size_t tail_count, const struct Allocator *allocator) {
+  enum HTTPError http_error = HTTP_ENOERR;
+  struct HTTPTemplate *request_template = NULL;
+  const char *pieces[2];
+  char *head_string = join_strings(head, head_count, allocator);
+  char *tail_string = join_strings(tail, tail_count, allocator);
+  if (head_string && tail_string) {
+    pieces[0] = head_string;
+    pieces[1] = tail_string;
+    request_template = http_template_compile(pieces, 2, allocator, &http_error);
+  }
+  allocator_free(allocator, head_string);
+  allocator_free(allocator, tail_string);
+  return request_template;
+}
+
+struct DiscrubRequests *discrub_requests_new(const char *token, const char *server_id, const char *channel_id,
+                                             const struct SearchOptions *options, const struct Allocator *allocator,
+                                             enum DiscrubError *error) {
+  if (!token || (!channel_id && (!server_id || !options))) {
     *error = DISCRUB_EARGS;
     return NULL;
   }
+  struct DiscrubRequests *requests = allocator_alloc(allocator, sizeof(struct DiscrubRequests));
+  if (!requests) {
+    *error = DISCRUB_ENOMEM;
+    return NULL;
+  }
+  memset(requests, 0, sizeof(struct DiscrubRequests));
+  requests->allocator = allocator;
+  if (server_id && options) {
+    char *params = get_params(options, allocator);
+    const char *head[5];
+    const char *tail[3];
+    head[0] = "GET /api/v9/guilds/";
+    head[1] = server_id;
+    head[2] = "/messages/search?";
+    head[3] = params;
+    head[4] = "&offset=";
+    tail[0] = " HTTP/1.1\r\nHost: discord.com\r\nAuthorization: ";
+    tail[1] = token;
+    tail[2] = "\r\nAccept-Encoding: gzip, deflate\r\nConnection: keep-alive\r\n\r\n";
+    requests->search = params ? compile_request(head, 5, tail, 3, allocator) : NULL;
+    allocator_free(allocator, params);
+    if (!requests->search) {
+      discrub_requests_free(requests);
+      *error = DISCRUB_ENOMEM;
+      return NULL;
+    }
+  }
+  if (channel_id) {
+    const char *head[3];
+    const char *tail[3];
+    head[0] = "DELETE /api/v9/channels/";
+    head[1] = channel_id;
+    head[2] = "/messages/";
+    tail[0] = " HTTP/1.1\r\nHost: discord.com\r\nAuthorization: ";
+    tail[1] = token;
+    tail[2] = "\r\nConnection: keep-alive\r\n\r\n";
+    requests->delete_message = compile_request(head, 3, tail, 3, allocator);
+    if (!requests->delete_message) {
+      discrub_requests_free(requests);
+      *error = DISCRUB_ENOMEM;
+      return NULL;
+    }
+  }
+  return requests;
+}
+
+void discrub_requests_free(struct DiscrubRequests *requests) {
+  if (!requests) return;
+  http_template_free(requests->search);
+  http_template_free(requests->delete_message);
+  allocator_free(requests->allocator, requests->buffer);
+  allocator_free(requests->allocator, requests->batch);
+  allocator_free(requests->allocator, requests);
+}
 
-  char *params = get_params(options);
-  if (!params) {
+/* Grows the render buffer geometrically to hold size bytes. */
+static int requests_reserve(struct DiscrubRequests *requests, size_t size) {
+  if (size <= requests->buffer_capacity) return 1;
+  size_t capacity = requests->buffer_capacity ? requests->buffer_capacity * 2 : 1024;
+  while (capacity < size) capacity *= 2;
+  char *buffer = allocator_realloc(requests->allocator, requests->buffer, capacity);
+  if (!buffer) return 0;
+  requests->buffer = buffer;
+  requests->buffer_capacity = capacity;
+  return 1;
+}
+
+/* Renders a request with one slot into the reused buffer. */
+static const char *requests_render(struct DiscrubRequests *requests, const struct HTTPTemplate *request_template,
+                                   const char *value) {
+  const char *values[1];
+  values[0] = value;
+  if (!requests_reserve(requests, http_template_size(request_template, values) + 1)) return NULL;
+  http_template_render(request_template, values, requests->buffer);
+  return requests->buffer;
+}
+
+size_t discrub_requests_delete(BIO *connection, struct DiscrubRequests *requests, const char *const *message_ids,
+                               size_t count, size_t depth, bool *deleted, enum DiscrubError *error) {
+  if (!connection || !requests || !requests->delete_message || !message_ids || !deleted) {
     *error = DISCRUB_EARGS;
+    return 0;
+  }
+  if (!count) return 0;
+  size_t size = 0, i;
+  for (i = 0; i < count; i++) size += http_template_size(requests->delete_message, &message_ids[i]) + 1;
+  if (count > requests->batch_capacity) {
+    size_t capacity = requests->batch_capacity ? requests->batch_capacity * 2 : 16;
+    while (capacity < count) capacity *= 2;
+    const char **batch = allocator_realloc(requests->allocator, requests->batch, capacity * sizeof(char *));
+    if (!batch) {
+      *error = DISCRUB_ENOMEM;
+      return 0;
+    }
+    requests->batch = batch;
+    requests->batch_capacity = capacity;
+  }
+  if (!requests_reserve(requests, size)) {
+    *error = DISCRUB_ENOMEM;
+    return 0;
+  }
+  /* The batch is rendered back to back, one NUL-terminated request each. */
+  char *ptr = requests->buffer;
+  for (i = 0; i < count; i++) {
+    deleted[i] = false;
+    requests->batch[i] = ptr;
+    ptr += http_template_render(requests->delete_message, &message_ids[i], ptr) + 1;
+  }
+  struct DeleteBatch batch;
+  enum HTTPError http_error = HTTP_ENOERR;
+  batch.deleted = deleted;
+  batch.error = error;
+  size_t answered = http_pipeline(connection, requests->batch, count, depth, on_delete_response, &batch,
+                                  requests->allocator, &http_error);
+  if (http_error) {
+    printf("Error while deleting: %s\n", http_strerror(&http_error));
+    *error = DISCRUB_EHTTP;
+  }
+  return answered;
+}
+
+struct SearchResponse *discrub_requests_search(BIO *connection, struct DiscrubRequests *requests, size_t offset,
+                                               enum DiscrubError *error) {
+  if (!connection || !requests || !requests->search) {
+    *error = DISCRUB_EARGS;
+    return NULL;
+  }
+  char offset_string[24];
+  sprintf(offset_string, "%lu", (unsigned long)offset);
+  const char *request_string = requests_render(requests, requests->search, offset_string);
+  if (!request_string) {
+    *error = DISCRUB_ENOMEM;
     return NULL;
   }
-  const char *request_fmt =
-      "GET /api/v9/guilds/%s/messages/search?%s HTTP/1.1\r\n"
-      "Host: discord.com\r\n"
-      "Authorization: %s\r\n"
-      "Connection: close\r\n"
-      "\r\n";
-  size_t request_size =
-      snprintf(NULL, 0, request_fmt, server_id, params, token) + 1;
-  char *request_string = malloc(request_size);
-  snprintf(request_string, request_size, request_fmt, server_id, params, token);
-  free(params);
   enum HTTPError http_error = HTTP_ENOERR;
-  struct HTTPResponse *response =
-      http_request(connection, request_string, &http_error);
+  /* The body is only read from, so it can stay in the connection's buffers. */
+  const struct HTTPResponse *response =
+      http_request_view(connection, request_string, requests->allocator, &http_error);
   if (http_error) {
     printf("Error while fetching: %s\n\nWith request: %s\n",
            http_strerror(&http_error), request_string);
-    free(request_string);
     *error = DISCRUB_EHTTP;
     return NULL;
   }
-  free(request_string);
   if (!response) {
     printf("Failed to search: No response\n");
     return NULL;
   }
   if (response->code != 200) {
     printf("Failed to search: Status code is %hu\n", response->code);
-    free(response);
     return NULL;
   }
+  return discrub_parse_search_response(response->data, response->length, requests->allocator, error);
+}
 
-  if (!strtok(response->data, "\n")) {
-    free(response);
-    *error = DISCRUB_EHTTP;
-    return NULL;
+size_t discrub_delete_messages(BIO *connection, const char *token, const char *channel_id,
+                               const char *const *message_ids, size_t count, size_t depth, bool *deleted,
+                               const struct Allocator *allocator, enum DiscrubError *error) {
+  if (!connection || !token || !channel_id || !message_ids || !deleted) {
+    *error = DISCRUB_EARGS;
+    return 0;
   }
+  struct DiscrubRequests *requests = discrub_requests_new(token, NULL, channel_id, NULL, allocator, error);
+  if (!requests) return 0;
+  size_t answered = discrub_requests_delete(connection, requests, message_ids, count, depth, deleted, error);
+  discrub_requests_free(requests);
+  return answered;
+}
 
-  const char *json_start = strtok(NULL, "\n");
-  const char *json_end = strtok(NULL, "\n");
-
-  if (!json_start || !json_end) {
-    free(response);
-    *error = DISCRUB_EHTTP;
+struct SearchResponse *discrub_search(BIO *connection, const char *token,
+                                      const char *server_id,
+                                      struct SearchOptions *options,
+                                      const struct Allocator *allocator,
+                                      enum DiscrubError *error) {
+  if (!connection || !token || !server_id || !options) {
+    *error = DISCRUB_EARGS;
     return NULL;
   }
+  struct DiscrubRequests *requests = discrub_requests_new(token, server_id, NULL, options, allocator, error);
+  if (!requests) return NULL;
+  struct SearchResponse *search_response = discrub_requests_search(connection, requests, options->offset, error);
+  discrub_requests_free(requests);
+  return search_response;
+}
 
-  size_t json_length = json_end - json_start;
-  char *json_string = malloc(json_length + 1);
-  if (!json_string) {
-    free(response);
-    *error = DISCRUB_ENOMEM;
-    return NULL;
+bool discrub_requests_delete_one(BIO *connection, struct DiscrubRequests *requests, const char *message_id,
+                                 enum DiscrubError *error) {
+  if (!connection || !requests || !requests->delete_message || !message_id) {
+    *error = DISCRUB_EARGS;
+    return false;
   }
-  strncpy(json_string, json_start, json_length);
-  json_string[json_length] = '\0';
-  free(response);
-
-  enum JsonError json_error;
-  struct JsonToken *response_object = jsontok_parse(json_string, &json_error);
-  if (!response_object) {
-    printf("Error parsing response JSON: %s\n", jsontok_strerror(json_error));
-    *error = DISCRUB_EPARSE;
-    return NULL;
+  const char *request_string = requests_render(requests, requests->delete_message, message_id);
+  if (!request_string) {
+    *error = DISCRUB_ENOMEM;
+    return false;
   }
-
-  if (response_object->type != JSON_OBJECT) {
-    *error = DISCRUB_EPARSE;
-    return NULL;
+  enum HTTPError http_error = HTTP_ENOERR;
+  /* The response stays in the connection's buffers; there is nothing to free. */
+  const struct HTTPResponse *response =
+      http_request_view(connection, request_string, requests->allocator, &http_error);
+  if (http_error) {
+    printf("Error while fetching: %s\n\nWith request: %s\n",
+           http_strerror(&http_error), request_string);
+    *error = DISCRUB_EHTTP;
+    return false;
   }
-
-  struct JsonToken *messages_subarray = jsontok_get(response_object->as_object, "messages");
-  if (!messages_subarray) {
-    *error = DISCRUB_EPARSE;
-    return NULL;
+  if (!response) {
+    printf("Failed to delete message: No response\n");
+    *error = DISCRUB_EHTTP;
+    return false;
   }
-  if (messages_subarray->type != JSON_WRAPPED_ARRAY) {
-    jsontok_free(response_object);
-    *error = DISCRUB_EPARSE;
-    return NULL;
+  /* A re-sent DELETE that already went through comes back as Unknown Message. */
+  if (response->code != 204 && response->code != 404) {
+    printf("Failed to delete message: Status code is %hu\n", response->code);
+    *error = DISCRUB_EHTTP;
+    return false;
   }
+  return true;
+}
 
-  struct JsonToken *messages_array = jsontok_parse(messages_subarray->as_string, &json_error);
-  if (!messages_array) {
-    jsontok_free(messages_subarray);
-    jsontok_free(response_object);
-    *error = DISCRUB_EPARSE;
-    return NULL;
+bool discrub_delete_message(BIO *connection, const char *token,
+                            const char *channel_id, const char *message_id,
+                            const struct Allocator *allocator,
+                            enum DiscrubError *error) {
+  if (!connection || !token || !channel_id || !message_id) {
+    *error = DISCRUB_EARGS;
+    return false;
   }
+  struct DiscrubRequests *requests = discrub_requests_new(token, NULL, channel_id, NULL, allocator, error);
+  if (!requests) return false;
+  bool result = discrub_requests_delete_one(connection, requests, message_id, error);
+  discrub_requests_free(requests);
+  return result;
+}
 
-  if (messages_array->type != JSON_ARRAY) {
-    jsontok_free(messages_subarray);
-    jsontok_free(response_object);
-    *error = DISCRUB_EPARSE;
-    return NULL;
-  }
-  struct JsonArray *message_containers = messages_array->as_array;
-  struct SearchResponse *search_response = malloc(sizeof(struct SearchResponse));
-  if (!search_response) {
-    jsontok_free(messages_subarray);
-    jsontok_free(response_object);
-    *error = DISCRUB_ENOMEM;
-    return NULL;
+/* What an asynchronous call needs once its response arrives. */
+struct AsyncCall {
+  void (*on_search)(void *user, struct SearchResponse *response, enum DiscrubError error);
+  void (*on_delete)(void *user, enum DiscrubError error);
+  void *user;
+  const struct Allocator *allocator;
+};
+
+static struct AsyncCall *async_call(const struct Allocator *allocator, void *user) {
+  struct AsyncCall *call = allocator_alloc(allocator, sizeof(struct AsyncCall));
+  if (!call) return NULL;
+  call->on_search = NULL;
+  call->on_delete = NULL;
+  call->user = user;
+  call->allocator = allocator;
+  return call;
+}
+
+static void on_search_complete(void *user, struct HTTPResponse *response, enum HTTPError http_error) {
+  struct AsyncCall *call = user;
+  struct SearchResponse *search_response = NULL;
+  enum DiscrubError error = DISCRUB_ENOERR;
+  if (!response) {
+    printf("Error while fetching: %s\n", http_strerror(&http_error));
+    error = DISCRUB_EHTTP;
+  } else if (response->code != 200) {
+    printf("Failed to search: Status code is %hu\n", response->code);
+    error = DISCRUB_EHTTP;
+  } else {
+    search_response = discrub_parse_search_response(response->data, response->length, call->allocator, &error);
   }
+  http_response_free(response, call->allocator);
+  call->on_search(call->user, search_response, error);
+  allocator_free(call->allocator, call);
+}
 
-  search_response->messages = malloc(message_containers->length * sizeof(struct DiscordMessage));
-  if (!search_response->messages) {
-    free(search_response);
-    jsontok_free(messages_subarray);
-    jsontok_free(response_object);
+int discrub_requests_search_async(struct EventLoop *loop, struct DiscrubRequests *requests, size_t offset,
+                                  void (*on_complete)(void *user, struct SearchResponse *response,
+                                                      enum DiscrubError error),
+                                  void *user, enum DiscrubError *error) {
+  if (!loop || !requests || !requests->search || !on_complete) {
+    *error = DISCRUB_EARGS;
+    return 0;
+  }
+  char offset_string[24];
+  sprintf(offset_string, "%lu", (unsigned long)offset);
+  /* The loop copies the request, so the buffer is free again right away. */
+  const char *request_string = requests_render(requests, requests->search, offset_string);
+  struct AsyncCall *call = request_string ? async_call(requests->allocator, user) : NULL;
+  if (!call || !event_loop_submit(loop, request_string, on_search_complete, call)) {
+    allocator_free(requests->allocator, call);
     *error = DISCRUB_ENOMEM;
-    return NULL;
+    return 0;
   }
+  call->on_search = on_complete;
+  return 1;
+}
 
-  search_response->length = message_containers->length;
-  size_t i = 0;
-  for (; i < message_containers->length; i++) {
-    struct JsonToken *message_container_token = message_containers->elements[i];
-    if (!message_container_token->as_string) {
-      printf("Message container token at %zu is NULL\n", i);
-      break;
-    }
-
-    struct JsonToken *message_container_array = jsontok_parse(message_container_token->as_string, &json_error);
-    if (!message_container_array ||
-        message_container_array->type != JSON_ARRAY ||
-        message_container_array->as_array->length != 1) {
-      printf("Invalid message container array at index %zu\n", i);
-      jsontok_free(message_container_array);
-      break;
-    }
-
-    struct JsonToken *message_token = message_container_array->as_array->elements[0];
-    if (message_token->type != JSON_WRAPPED_OBJECT) {
-      jsontok_free(message_container_array);
-      break;
-    }
-
-    struct JsonToken *message_object = jsontok_parse(message_token->as_string, &json_error);
-    if (!message_object) {
-      printf("Error in parsing message token at index %zu: %s\n\n%s\n",
-             i, jsontok_strerror(json_error), message_token->as_string);
-      jsontok_free(message_container_array);
-      break;
-    }
-
-    struct JsonToken *author_token = jsontok_get(message_object->as_object, "author");
-    if (!author_token || author_token->type != JSON_WRAPPED_OBJECT) {
-      jsontok_free(message_container_array);
-      break;
-    }
-
-    struct JsonToken *author_object = jsontok_parse(author_token->as_string, &json_error);
-    if (!author_object) {
-      jsontok_free(message_container_array);
-      break;
-    }
-
-    struct JsonToken *id_token = jsontok_get(message_object->as_object, "id");
-    struct JsonToken *content_token = jsontok_get(message_object->as_object, "content");
-    struct JsonToken *timestamp_token = jsontok_get(message_object->as_object, "timestamp");
-    struct JsonToken *author_id_token = jsontok_get(author_object->as_object, "id");
-    struct JsonToken *author_username_token = jsontok_get(author_object->as_object, "username");
-
-    if (!id_token || id_token->type != JSON_STRING ||
-        !content_token || content_token->type != JSON_STRING ||
-        !timestamp_token || timestamp_token->type != JSON_STRING ||
-        !author_id_token || author_id_token->type != JSON_STRING ||
-        !author_username_token || author_username_token->type != JSON_STRING) {
-      printf("Missing or invalid fields in message object at index %zu\n", i);
-      jsontok_free(message_container_array);
-      break;
-    }
-
-    struct DiscordMessage *message = &search_response->messages[i];
-    message->id = malloc(strlen(id_token->as_string) + 1);
-    if (!message->id) {
-      free(message);
-      *error = DISCRUB_ENOMEM;
-      return NULL;
-    }
-    strcpy(message->id, id_token->as_string);
-
-    message->content = malloc(strlen(content_token->as_string) + 1);
-    if (!message->content) {
-      free(message->id);
-      free(message);
-      *error = DISCRUB_ENOMEM;
-      return NULL;
-    }
-    strcpy(message->content, content_token->as_string);
+int discrub_search_async(struct EventLoop *loop, const char *token, const char *server_id,
+                         struct SearchOptions *options,
+                         void (*on_complete)(void *user, struct SearchResponse *response, enum DiscrubError error),
+                         void *user, const struct Allocator *allocator, enum DiscrubError *error) {
+  if (!loop || !token || !server_id || !options || !on_complete) {
+    *error = DISCRUB_EARGS;
+    return 0;
+  }
+  struct DiscrubRequests *requests = discrub_requests_new(token, server_id, NULL, options, allocator, error);
+  if (!requests) return 0;
+  int result = discrub_requests_search_async(loop, requests, options->offset, on_complete, user, error);
+  discrub_requests_free(requests);
+  return result;
+}
 
-    message->timestamp = malloc(strlen(fmt_timestamp(timestamp_token->as_string)) + 1);
-    if (!message->timestamp) {
-      free(message->content);
-      free(message->id);
-      free(message);
-      *error = DISCRUB_ENOMEM;
-      return NULL;
-    }
-    strcpy(message->timestamp, fmt_timestamp(timestamp_token->as_string));
-
-    message->author_id = malloc(strlen(author_id_token->as_string) + 1);
-    if (!message->author_id) {
-      free(message->timestamp);
-      free(message->content);
-      free(message->id);
-      free(message);
-      *error = DISCRUB_ENOMEM;
-      return NULL;
-    }
-    strcpy(message->author_id, author_id_token->as_string);
-
-    message->author_username = malloc(strlen(author_username_token->as_string) + 1);
-    if (!message->author_username) {
-      free(message->author_id);
-      free(message->timestamp);
-      free(message->content);
-      free(message->id);
-      free(message);
-      *error = DISCRUB_ENOMEM;
-      return NULL;
-    }
-    strcpy(message->author_username, author_username_token->as_string);
+static void on_delete_complete(void *user, struct HTTPResponse *response, enum HTTPError http_error) {
+  struct AsyncCall *call = user;
+  enum DiscrubError error = DISCRUB_ENOERR;
+  if (!response) {
+    printf("Error while deleting: %s\n", http_strerror(&http_error));
+    error = DISCRUB_EHTTP;
+  } else if (response->code != 204 && response->code != 404) {
+    printf("Failed to delete message: Status code is %hu\n", response->code);
+    error = DISCRUB_EHTTP;
+  }
+  http_response_free(response, call->allocator);
+  call->on_delete(call->user, error);
+  allocator_free(call->allocator, call);
+}
 
-    jsontok_free(message_container_array);
+int discrub_requests_delete_async(struct EventLoop *loop, struct DiscrubRequests *requests, const char *message_id,
+                                  void (*on_complete)(void *user, enum DiscrubError error), void *user,
+                                  enum DiscrubError *error) {
+  if (!loop || !requests || !requests->delete_message || !message_id || !on_complete) {
+    *error = DISCRUB_EARGS;
+    return 0;
+  }
+  const char *request_string = requests_render(requests, requests->delete_message, message_id);
+  struct AsyncCall *call = request_string ? async_call(requests->allocator, user) : NULL;
+  if (!call || !event_loop_submit(loop, request_string, on_delete_complete, call)) {
+    allocator_free(requests->allocator, call);
+    *error = DISCRUB_ENOMEM;
+    return 0;
   }
+  call->on_delete = on_complete;
+  return 1;
+}
 
-  jsontok_free(messages_array);
-  jsontok_free(response_object);
-  free(json_string);
-  return search_response;
+int discrub_delete_message_async(struct EventLoop *loop, const char *token, const char *channel_id,
+                                 const char *message_id, void (*on_complete)(void *user, enum DiscrubError error),
+                                 void *user, const struct Allocator *allocator, enum DiscrubError *error) {
+  if (!loop || !token || !channel_id || !message_id || !on_complete) {
+    *error = DISCRUB_EARGS;
+    return 0;
+  }
+  struct DiscrubRequests *requests = discrub_requests_new(token, NULL, channel_id, NULL, allocator, error);
+  if (!requests) return 0;
+  int result = discrub_requests_delete_async(loop, requests, message_id, on_complete, user, error);
+  discrub_requests_free(requests);
+  return result;
 }
 
-void discrub_free_search_response(struct SearchResponse *response) {
+void discrub_free_search_response(struct SearchResponse *response, const struct Allocator *allocator) {
   if (!response) return;
 
   size_t i = 0;
-  for (; i < response->length; i++) {
-    struct DiscordMessage *message = &response->messages[i];
-    free(message->id);
-    free(message->content);
-    free(message->timestamp);
-    free(message->author_id);
-    free(message->author_username);
-  }
+  for (; i < response->length; i++) discrub_free_message(&response->messages[i], allocator);
 
-  free(response->messages);
-  free(response);
+  allocator_free(allocator, response->messages);
+  allocator_free(allocator, response);
 }
 
-struct LoginResponse *discrub_login(BIO *connection, const char *username, const char *password, enum DiscrubError *error) {
+struct LoginResponse *discrub_login(BIO *connection, const char *username, const char *password, const struct Allocator *allocator, enum DiscrubError *error) {
   if (!connection || !username || !password) {
     *error = DISCRUB_EARGS;
     return NULL;
   }
-  const char *request_fmt =
-      "POST /api/v9/auth/login HTTP/1.1\r\n"
-      "Host: discord.com\r\n"
-      "Content-Type: application/json\r\n"
-      "Content-Length: %d\r\n"
-      "Connection: close\r\n"
-      "\r\n"
-      "{"
-      "\"gift_code_sku_id\":null,"
-      "\"login\":\"%s\","
-      "\"login_source\":null,"
-      "\"password\":\"%s\","
-      "\"undelete\":false"
-      "}";
-  size_t json_size = snprintf(NULL, 0,
-                              "{"
-                              "\"gift_code_sku_id\":null,"
-                              "\"login\":\"%s\","
-                              "\"login_source\":null,"
-                              "\"password\":\"%s\","
-                              "\"undelete\":false"
-                              "}",
-                              username, password);
-  size_t request_size =
-      snprintf(NULL, 0, request_fmt, (int)json_size, username, password) + 1;
-  char *request_string = malloc(request_size);
+  struct JsonWriter writer;
+  jsontok_writer_init_allocator(&writer, allocator);
+  jsontok_writer_object_start(&writer);
+  jsontok_writer_key(&writer, "gift_code_sku_id");
+  jsontok_writer_null(&writer);
+  jsontok_writer_key(&writer, "login");
+  jsontok_writer_string(&writer, username);
+  jsontok_writer_key(&writer, "login_source");
+  jsontok_writer_null(&writer);
+  jsontok_writer_key(&writer, "password");
+  jsontok_writer_string(&writer, password);
+  jsontok_writer_key(&writer, "undelete");
+  jsontok_writer_boolean(&writer, 0);
+  jsontok_writer_object_end(&writer);
+  enum JsonError json_error = JSON_ENOERR;
+  size_t body_length;
+  const char *body = jsontok_writer_finish(&writer, &body_length, &json_error);
+  if (!body) {
+    jsontok_writer_free(&writer);
+    *error = DISCRUB_ENOMEM;
+    return NULL;
+  }
+  char headers[256];
+  int headers_length = sprintf(headers,
+                               "POST /api/v9/auth/login HTTP/1.1\r\n"
+                               "Host: discord.com\r\n"
+                               "Content-Type: application/json\r\n"
+                               "Content-Length: %lu\r\n"
+                               "Accept-Encoding: gzip, deflate\r\n"
+                               "Connection: keep-alive\r\n"
+                               "\r\n",
+                               (unsigned long)body_length);
+  char *request_string = allocator_alloc(allocator, headers_length + body_length + 1);
   if (!request_string) {
+    jsontok_writer_free(&writer);
     *error = DISCRUB_ENOMEM;
     return NULL;
   }
-  snprintf(request_string, request_size, request_fmt, (int)json_size, username, password);
+  memcpy(request_string, headers, headers_length);
+  memcpy(request_string + headers_length, body, body_length + 1);
+  jsontok_writer_free(&writer);
   enum HTTPError http_error = HTTP_ENOERR;
   struct HTTPResponse *response =
-      http_request(connection, request_string, &http_error);
+      http_request(connection, request_string, allocator, &http_error);
   if (http_error) {
     printf("Error while fetching: %s\n\nWith request: %s\n",
            http_strerror(&http_error), request_string);
-    free(request_string);
+    allocator_free(allocator, request_string);
     *error = DISCRUB_EHTTP;
     return false;
   }
-  free(request_string);
+  allocator_free(allocator, request_string);
   if (!response) {
     printf("Failed to log in: No response\n");
     return NULL;
   }
   if (response->code != 200) {
     printf("Failed to log in: Status code is %hu\n", response->code);
+    http_response_free(response, allocator);
     return NULL;
   }
-  if (!strtok(response->data, "\n")) {
-    free(response);
-    *error = DISCRUB_EHTTP;
-    return NULL;
-  }
-
-  const char *json_start = strtok(NULL, "\n");
-  const char *json_end = strtok(NULL, "\n");
-
-  if (!json_start || !json_end) {
-    free(response);
-    *error = DISCRUB_EHTTP;
-    return NULL;
-  }
-
-  size_t json_length = json_end - json_start;
-  char *json_string = malloc(json_length + 1);
-  if (!json_string) {
-    free(response);
-    *error = DISCRUB_ENOMEM;
-    return NULL;
-  }
-  strncpy(json_string, json_start, json_length);
-  json_string[json_length] = '\0';
-  free(response);
-
-  enum JsonError json_error = JSON_ENOERR;
-  struct JsonToken *response_object = jsontok_parse(json_string, &json_error);
+  json_error = JSON_ENOERR;
+  struct JsonToken *response_object = jsontok_parse_allocator(response->data, response->length, allocator, &json_error);
+  http_response_free(response, allocator);
   if (!response_object) {
     printf("Error parsing response JSON: %s\n", jsontok_strerror(json_error));
     *error = DISCRUB_EPARSE;
@@ -464,6 +751,7 @@ struct LoginResponse *discrub_login(BIO *connection, const char *username, const
   }
 
   if (response_object->type != JSON_OBJECT) {
+    jsontok_free_allocator(response_object, allocator);
     *error = DISCRUB_EPARSE;
     return NULL;
   }
@@ -471,35 +759,36 @@ struct LoginResponse *discrub_login(BIO *connection, const char *username, const
   struct JsonToken *token_string = jsontok_get(response_object->as_object, "token");
   struct JsonToken *user_id_string = jsontok_get(response_object->as_object, "user_id");
   if (!token_string || token_string->type != JSON_STRING || !user_id_string || user_id_string->type != JSON_STRING) {
-    jsontok_free(response_object);
+    jsontok_free_allocator(response_object, allocator);
     *error = DISCRUB_EPARSE;
     return NULL;
   }
 
-  struct LoginResponse *login_response = malloc(sizeof(struct LoginResponse));
+  struct LoginResponse *login_response = allocator_alloc(allocator, sizeof(struct LoginResponse));
   if (!login_response) {
-    jsontok_free(response_object);
+    jsontok_free_allocator(response_object, allocator);
     *error = DISCRUB_ENOMEM;
     return NULL;
   }
-  login_response->token = malloc(strlen(token_string->as_string) + 1);
+  login_response->token = allocator_alloc(allocator, strlen(token_string->as_string) + 1);
   if (!login_response->token) {
-    free(login_response);
-    jsontok_free(response_object);
+    allocator_free(allocator, login_response);
+    jsontok_free_allocator(response_object, allocator);
     *error = DISCRUB_ENOMEM;
     return NULL;
   }
   strcpy(login_response->token, token_string->as_string);
 
-  login_response->user_id = malloc(strlen(user_id_string->as_string) + 1);
+  login_response->user_id = allocator_alloc(allocator, strlen(user_id_string->as_string) + 1);
   if (!login_response->user_id) {
-    free(login_response->token);
-    free(login_response);
-    jsontok_free(response_object);
+    allocator_free(allocator, login_response->token);
+    allocator_free(allocator, login_response);
+    jsontok_free_allocator(response_object, allocator);
     *error = DISCRUB_ENOMEM;
     return NULL;
   }
   strcpy(login_response->user_id, user_id_string->as_string);
+  jsontok_free_allocator(response_object, allocator);
 
   return login_response;
 }
@@ -509,6 +798,7 @@ const char *discrub_strerror(enum DiscrubError *error) {
     case DISCRUB_ENOMEM: return "Memory allocation failed";
     case DISCRUB_EARGS: return "Invalid arguments provided";
     case DISCRUB_EHTTP: return "HTTP request failed";
+    case DISCRUB_EPARSE: return "Failed to parse response";
     default: return "Unknown Discrub error";
   }
 }
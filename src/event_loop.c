@@ -0,0 +1,419 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "event_loop.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EVENT_BUFFER_SIZE 16384
+#define EVENT_BATCH 64
+#define SEND_ATTEMPTS 2
+/* How long a request may take, from connecting to the end of the response. */
+#define REQUEST_TIMEOUT_MS 30000
+
+enum ConnectionState {
+  CONNECTION_CLOSED,
+  CONNECTION_CONNECTING,
+  CONNECTION_IDLE,
+  CONNECTION_WRITING,
+  CONNECTION_READING,
+};
+
+struct EventRequest {
+  char *request;
+  size_t length;
+  void (*on_complete)(void *user, struct HTTPResponse *response, enum HTTPError error);
+  void *user;
+  int attempts;
+  struct EventRequest *next;
+};
+
+struct EventConnection {
+  enum ConnectionState state;
+  BIO *bio;
+  /* The socket registered with epoll, which changes on every reconnect. */
+  int fd;
+  uint32_t events;
+  struct EventRequest *request;
+  /* When the request in flight times out, on the now_ms clock. */
+  double deadline;
+  size_t written;
+  size_t received;
+  struct HTTPParser *parser;
+};
+
+struct EventLoop {
+  SSL_CTX *ctx;
+  char *host;
+  const struct Allocator *allocator;
+  int epoll_fd;
+  struct EventConnection *connections;
+  size_t connection_count;
+  unsigned int interval_ms;
+  double next_start;
+  struct EventRequest *head;
+  struct EventRequest *tail;
+  size_t active;
+};
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+struct EventLoop *event_loop_new(SSL_CTX *ctx, const char *host, size_t connections, unsigned int interval_ms,
+                                 const struct Allocator *allocator, enum HTTPError *error) {
+  if (!connections) connections = 1;
+  struct EventLoop *loop = allocator_alloc(allocator, sizeof(struct EventLoop));
+  if (!loop) {
+    *error = HTTP_ENOMEM;
+    return NULL;
+  }
+  memset(loop, 0, sizeof(struct EventLoop));
+  loop->ctx = ctx;
+  loop->allocator = allocator;
+  loop->interval_ms = interval_ms;
+  loop->next_start = now_ms();
+  loop->connection_count = connections;
+  loop->host = allocator_strndup(allocator, host, strlen(host));
+  loop->connections = allocator_alloc(allocator, connections * sizeof(struct EventConnection));
+  loop->epoll_fd = epoll_create1(0);
+  if (!loop->host || !loop->connections || loop->epoll_fd < 0) {
+    *error = loop->epoll_fd < 0 ? HTTP_EBIO : HTTP_ENOMEM;
+    loop->connection_count = 0;
+    event_loop_free(loop);
+    return NULL;
+  }
+  memset(loop->connections, 0, connections * sizeof(struct EventConnection));
+  size_t i;
+  for (i = 0; i < connections; i++) loop->connections[i].fd = -1;
+  return loop;
+}
+
+int event_loop_submit(struct EventLoop *loop, const char *request,
+                      void (*on_complete)(void *user, struct HTTPResponse *response, enum HTTPError error),
+                      void *user) {
+  struct EventRequest *entry = allocator_alloc(loop->allocator, sizeof(struct EventRequest));
+  if (!entry) return 0;
+  entry->length = strlen(request);
+  entry->request = allocator_strndup(loop->allocator, request, entry->length);
+  if (!entry->request) {
+    allocator_free(loop->allocator, entry);
+    return 0;
+  }
+  entry->on_complete = on_complete;
+  entry->user = user;
+  entry->attempts = 0;
+  entry->next = NULL;
+  if (loop->tail) {
+    loop->tail->next = entry;
+  } else {
+    loop->head = entry;
+  }
+  loop->tail = entry;
+  return 1;
+}
+
+/* Registers the connection's current socket for events, or updates them. */
+static int connection_watch(struct EventLoop *loop, struct EventConnection *connection, uint32_t events) {
+  struct epoll_event event;
+  int fd = -1;
+  BIO_get_fd(connection->bio, &fd);
+  if (fd < 0) return 0;
+  event.events = events;
+  event.data.ptr = connection;
+  if (fd != connection->fd) {
+    if (connection->fd >= 0) epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    connection->fd = fd;
+    connection->events = events;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+  }
+  if (events == connection->events) return 1;
+  connection->events = events;
+  return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+static void connection_close(struct EventLoop *loop, struct EventConnection *connection) {
+  if (connection->fd >= 0) epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  connection->fd = -1;
+  if (connection->bio) BIO_reset(connection->bio);
+  connection->state = CONNECTION_CLOSED;
+  http_parser_free(connection->parser);
+  connection->parser = NULL;
+}
+
+static void complete(struct EventLoop *loop, struct EventConnection *connection, struct HTTPResponse *response,
+                     enum HTTPError error) {
+  struct EventRequest *request = connection->request;
+  connection->request = NULL;
+  loop->active--;
+  request->on_complete(request->user, response, error);
+  allocator_free(loop->allocator, request->request);
+  allocator_free(loop->allocator, request);
+}
+
+/**
+ * Drops the connection after a failure. A request the server cannot have
+ * answered yet, like one written to a connection it had already closed, is
+ * put back at the front of the queue once.
+ */
+static void fail(struct EventLoop *loop, struct EventConnection *connection, enum HTTPError error, int retryable) {
+  struct EventRequest *request = connection->request;
+  connection_close(loop, connection);
+  if (retryable && ++request->attempts < SEND_ATTEMPTS) {
+    connection->request = NULL;
+    loop->active--;
+    request->next = loop->head;
+    loop->head = request;
+    if (!loop->tail) loop->tail = request;
+    return;
+  }
+  complete(loop, connection, NULL, error);
+}
+
+/* Waits for whatever the last BIO call said it needs. */
+static void wait_for(struct EventLoop *loop, struct EventConnection *connection) {
+  uint32_t events = 0;
+  if (BIO_should_read(connection->bio)) events |= EPOLLIN;
+  if (BIO_should_write(connection->bio) || BIO_should_io_special(connection->bio)) events |= EPOLLOUT;
+  if (!events) events = EPOLLIN | EPOLLOUT;
+  if (!connection_watch(loop, connection, events)) fail(loop, connection, HTTP_EBIO, 1);
+}
+
+static void finish_response(struct EventLoop *loop, struct EventConnection *connection) {
+  int close_after = 0;
+  struct HTTPResponse *response = http_parser_take(connection->parser, &close_after);
+  if (close_after) {
+    connection_close(loop, connection);
+  } else {
+    connection->state = CONNECTION_IDLE;
+  }
+  complete(loop, connection, response, HTTP_ENOERR);
+}
+
+/* Advances a connection as far as it can go without blocking. */
+static void drive(struct EventLoop *loop, struct EventConnection *connection) {
+  char buffer[EVENT_BUFFER_SIZE];
+  if (connection->state == CONNECTION_CONNECTING) {
+    if (BIO_do_connect(connection->bio) <= 0) {
+      if (BIO_should_retry(connection->bio)) {
+        wait_for(loop, connection);
+      } else {
+        fail(loop, connection, HTTP_EBIO, 1);
+      }
+      return;
+    }
+    connection->state = CONNECTION_WRITING;
+  }
+  if (connection->state == CONNECTION_WRITING) {
+    struct EventRequest *request = connection->request;
+    while (connection->written < request->length) {
+      int size = BIO_write(connection->bio, request->request + connection->written,
+                           (int)(request->length - connection->written));
+      if (size > 0) {
+        connection->written += size;
+      } else if (BIO_should_retry(connection->bio)) {
+        wait_for(loop, connection);
+        return;
+      } else {
+        fail(loop, connection, HTTP_EBIO, 1);
+        return;
+      }
+    }
+    connection->state = CONNECTION_READING;
+  }
+  if (connection->state != CONNECTION_READING) return;
+  /* TLS may hold decrypted bytes epoll knows nothing about, so read until
+   * the BIO asks to wait. */
+  for (;;) {
+    enum HTTPError error = HTTP_ENOERR;
+    int size = BIO_read(connection->bio, buffer, EVENT_BUFFER_SIZE);
+    if (size < 0 && BIO_should_retry(connection->bio)) {
+      wait_for(loop, connection);
+      return;
+    }
+    if (size < 1) {
+      /* Nothing at all came back: the server closed the idle connection. */
+      if (!connection->received) {
+        fail(loop, connection, HTTP_EBIO, 1);
+      } else if (http_parser_finish(connection->parser, &error)) {
+        finish_response(loop, connection);
+        connection_close(loop, connection);
+      } else {
+        fail(loop, connection, error, 0);
+      }
+      return;
+    }
+    connection->received += size;
+    if (http_parser_feed(connection->parser, buffer, size, &error) == (size_t)-1) {
+      fail(loop, connection, error, 0);
+      return;
+    }
+    if (http_parser_done(connection->parser)) {
+      finish_response(loop, connection);
+      return;
+    }
+  }
+}
+
+static int start(struct EventLoop *loop, struct EventConnection *connection, struct EventRequest *request) {
+  if (!connection->parser) {
+    connection->parser = http_parser_new(loop->allocator);
+    if (!connection->parser) return 0;
+  }
+  if (!connection->bio) {
+    SSL *ssl = NULL;
+    connection->bio = BIO_new_ssl_connect(loop->ctx);
+    if (!connection->bio) return 0;
+    BIO_set_conn_hostname(connection->bio, loop->host);
+    BIO_set_nbio(connection->bio, 1);
+    /* These connections speak HTTP/1.1 even if ctx offers h2. */
+    BIO_get_ssl(connection->bio, &ssl);
+    if (ssl) SSL_set_alpn_protos(ssl, (const unsigned char *)"\x08http/1.1", 9);
+  }
+  connection->request = request;
+  connection->deadline = now_ms() + REQUEST_TIMEOUT_MS;
+  connection->written = 0;
+  connection->received = 0;
+  loop->active++;
+  if (connection->state == CONNECTION_CLOSED) {
+    /* Offers the cached session; the handshake itself continues in drive. */
+    connection->state = CONNECTION_CONNECTING;
+    http_connect(connection->bio);
+  } else {
+    connection->state = CONNECTION_WRITING;
+  }
+  drive(loop, connection);
+  return 1;
+}
+
+/* Fails every request that has passed its deadline and returns the earliest
+ * deadline left, or 0 if no request is in flight. */
+static double expire(struct EventLoop *loop, double now) {
+  double earliest = 0;
+  size_t i;
+  for (i = 0; i < loop->connection_count; i++) {
+    struct EventConnection *connection = &loop->connections[i];
+    if (!connection->request) continue;
+    if (now >= connection->deadline) {
+      fail(loop, connection, HTTP_ETIMEOUT, 0);
+    } else if (!earliest || connection->deadline < earliest) {
+      earliest = connection->deadline;
+    }
+  }
+  return earliest;
+}
+
+static struct EventConnection *free_connection(struct EventLoop *loop) {
+  size_t i;
+  for (i = 0; i < loop->connection_count; i++) {
+    struct EventConnection *connection = &loop->connections[i];
+    if (connection->state == CONNECTION_IDLE || connection->state == CONNECTION_CLOSED) return connection;
+  }
+  return NULL;
+}
+
+int event_loop_run(struct EventLoop *loop) {
+  struct epoll_event events[EVENT_BATCH];
+  for (;;) {
+    struct EventConnection *connection;
+    double now = now_ms();
+    /* Queued requests start on free connections, paced by the interval. */
+    while (loop->head && now >= loop->next_start && (connection = free_connection(loop))) {
+      struct EventRequest *request = loop->head;
+      loop->head = request->next;
+      if (!loop->head) loop->tail = NULL;
+      request->next = NULL;
+      loop->next_start = now + loop->interval_ms;
+      if (!start(loop, connection, request)) {
+        request->on_complete(request->user, NULL, HTTP_ENOMEM);
+        allocator_free(loop->allocator, request->request);
+        allocator_free(loop->allocator, request);
+      }
+    }
+    double deadline = expire(loop, now);
+    if (!loop->head && !loop->active) return 1;
+    /* Wake for the next paced start or the next deadline, whichever is first. */
+    if (loop->head && free_connection(loop) && (!deadline || loop->next_start < deadline)) {
+      deadline = loop->next_start;
+    }
+    int timeout = -1;
+    if (deadline) timeout = deadline > now ? (int)(deadline - now) + 1 : 0;
+    int count = epoll_wait(loop->epoll_fd, events, EVENT_BATCH, timeout);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    int i;
+    for (i = 0; i < count; i++) {
+      connection = events[i].data.ptr;
+      /* Activity on an idle kept-alive connection means the server closed it. */
+      if (connection->state == CONNECTION_IDLE) {
+        connection_close(loop, connection);
+      } else {
+        drive(loop, connection);
+      }
+    }
+  }
+}
+
+void event_loop_free(struct EventLoop *loop) {
+  if (!loop) return;
+  size_t i;
+  for (i = 0; i < loop->connection_count; i++) {
+    struct EventConnection *connection = &loop->connections[i];
+    http_parser_free(connection->parser);
+    if (connection->bio) BIO_free_all(connection->bio);
+    if (connection->request) {
+      allocator_free(loop->allocator, connection->request->request);
+      allocator_free(loop->allocator, connection->request);
+    }
+  }
+  while (loop->head) {
+    struct EventRequest *next = loop->head->next;
+    allocator_free(loop->allocator, loop->head->request);
+    allocator_free(loop->allocator, loop->head);
+    loop->head = next;
+  }
+  if (loop->epoll_fd >= 0) close(loop->epoll_fd);
+  allocator_free(loop->allocator, loop->connections);
+  allocator_free(loop->allocator, loop->host);
+  allocator_free(loop->allocator, loop);
+}
+
+#else
+
+struct EventLoop *event_loop_new(SSL_CTX *ctx, const char *host, size_t connections, unsigned int interval_ms,
+                                 const struct Allocator *allocator, enum HTTPError *error) {
+  (void)ctx;
+  (void)host;
+  (void)connections;
+  (void)interval_ms;
+  (void)allocator;
+  *error = HTTP_EBIO;
+  return NULL;
+}
+
+int event_loop_submit(struct EventLoop *loop, const char *request,
+                      void (*on_complete)(void *user, struct HTTPResponse *response, enum HTTPError error),
+                      void *user) {
+  (void)loop;
+  (void)request;
+  (void)on_complete;
+  (void)user;
+  return 0;
+}
+
+int event_loop_run(struct EventLoop *loop) {
+  (void)loop;
+  return 0;
+}
+
+void event_loop_free(struct EventLoop *loop) { (void)loop; }
+
+#endif
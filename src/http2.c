@@ -0,0 +1,598 @@
+#include "http2.h"
+
+#ifdef DISCRUB_HTTP2
+
+#include <nghttp2/nghttp2.h>
+#include <strings.h>
+
+#include "content_encoding.h"
+
+#define H2_READ_SIZE 16384
+#define H2_WINDOW_SIZE (1 << 20)
+#define H2_MAX_STREAMS 100
+#define H2_ATTEMPTS 3
+
+enum StreamRequestState {
+  REQUEST_PENDING,
+  REQUEST_IN_FLIGHT,
+  REQUEST_DONE,
+};
+
+/**
+ * One open stream. The request is converted into a header list pointing
+ * into a private copy of it; response headers are gathered as
+ * "name\0value\0" pairs and indexed once the stream closes.
+ */
+struct HTTP2Stream {
+  size_t index;
+  char *request;
+  nghttp2_nv *headers;
+  const char *body;
+  size_t body_length;
+  uint16_t code;
+  char *head;
+  size_t head_size;
+  size_t head_capacity;
+  size_t header_count;
+  char *data;
+  size_t length;
+  size_t capacity;
+  struct ContentDecoder content;
+  unsigned char body_started;
+  unsigned char closed;
+  uint32_t error_code;
+  const struct Allocator *allocator;
+};
+
+struct HTTP2Session {
+  BIO *connection;
+  nghttp2_session *session;
+};
+
+static int session_index = -1;
+
+static void free_session(void *parent, void *ptr, CRYPTO_EX_DATA *data, int index, long argl, void *argp) {
+  struct HTTP2Session *h2 = ptr;
+  (void)parent;
+  (void)data;
+  (void)index;
+  (void)argl;
+  (void)argp;
+  if (!h2) return;
+  nghttp2_session_del(h2->session);
+  free(h2);
+}
+
+/* Grows a buffer geometrically to hold extra more bytes and a NUL. */
+static int reserve(const struct Allocator *allocator, char **buffer, size_t size, size_t *capacity, size_t extra) {
+  if (size + extra + 1 > *capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 256;
+    while (new_capacity < size + extra + 1) new_capacity *= 2;
+    char *new_buffer = allocator_realloc(allocator, *buffer, new_capacity);
+    if (!new_buffer) return 0;
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+  }
+  return 1;
+}
+
+/* Appends to a buffer that grows geometrically, keeping room for a NUL. */
+static int append(const struct Allocator *allocator, char **buffer, size_t *size, size_t *capacity,
+                  const void *data, size_t length) {
+  if (!reserve(allocator, buffer, *size, capacity, length)) return 0;
+  memcpy(*buffer + *size, data, length);
+  *size += length;
+  return 1;
+}
+
+static int on_header(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *name, size_t name_length,
+                     const uint8_t *value, size_t value_length, uint8_t flags, void *user) {
+  struct HTTP2Stream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  (void)flags;
+  (void)user;
+  if (!stream || frame->hd.type != NGHTTP2_HEADERS) return 0;
+  if (name_length == 7 && memcmp(name, ":status", 7) == 0) {
+    size_t i;
+    stream->code = 0;
+    for (i = 0; i < value_length && i < 3; i++) stream->code = stream->code * 10 + (value[i] - '0');
+    return 0;
+  }
+  /* A final response replaces any informational headers before it. */
+  if (stream->code / 100 == 1) return 0;
+  if (!append(stream->allocator, &stream->head, &stream->head_size, &stream->head_capacity, name, name_length + 1) ||
+      !append(stream->allocator, &stream->head, &stream->head_size, &stream->head_capacity, value, value_length + 1)) {
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  }
+  /* Names and values arrive NUL-terminated, and the copies above keep that. */
+  stream->header_count++;
+  return 0;
+}
+
+static const char *stream_header(const struct HTTP2Stream *stream, const char *name) {
+  const char *ptr = stream->head, *end = stream->head + stream->head_size;
+  while (ptr < end) {
+    const char *value = ptr + strlen(ptr) + 1;
+    if (strcasecmp(ptr, name) == 0) return value;
+    ptr = value + strlen(value) + 1;
+  }
+  return NULL;
+}
+
+static int on_data_chunk(nghttp2_session *session, uint8_t flags, int32_t stream_id, const uint8_t *data,
+                         size_t length, void *user) {
+  struct HTTP2Stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+  (void)flags;
+  (void)user;
+  if (!stream) return 0;
+  if (!stream->body_started) {
+    int compressed = content_decoder_init(&stream->content, stream_header(stream, "content-encoding"),
+                                          stream->allocator);
+    const char *content_length = stream_header(stream, "content-length");
+    stream->body_started = 1;
+    if (compressed < 0) return NGHTTP2_ERR_CALLBACK_FAILURE;
+    /* The body buffer is allocated once when the length is announced. */
+    if (content_length && !compressed) {
+      size_t expected;
+      if (!http_content_length(content_length, &expected)) return NGHTTP2_ERR_CALLBACK_FAILURE;
+      stream->data = allocator_alloc(stream->allocator, expected + 1);
+      if (!stream->data) return NGHTTP2_ERR_CALLBACK_FAILURE;
+      stream->capacity = expected + 1;
+    }
+  }
+  if (!stream->content.active) {
+    if (!append(stream->allocator, &stream->data, &stream->length, &stream->capacity, data, length)) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    return 0;
+  }
+  /* Compressed bodies are inflated straight into the body buffer. */
+  const char *input = (const char *)data;
+  size_t produced, room;
+  do {
+    size_t estimate = length * 4 > H2_READ_SIZE ? length * 4 : H2_READ_SIZE;
+    if (!reserve(stream->allocator, &stream->data, stream->length, &stream->capacity, estimate)) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    room = stream->capacity - stream->length - 1;
+    if (!content_decoder_run(&stream->content, &input, &length, stream->data + stream->length, room, &produced)) {
+      return NGHTTP2_ERR_CALLBACK_FAILURE;
+    }
+    stream->length += produced;
+  } while (length || produced == room);
+  return 0;
+}
+
+static int on_stream_close(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user) {
+  struct HTTP2Stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+  (void)user;
+  if (!stream) return 0;
+  stream->closed = 1;
+  stream->error_code = error_code;
+  /* A compressed body cut short is treated like a reset stream. */
+  if (!error_code && stream->content.active && !stream->content.done) stream->error_code = NGHTTP2_INTERNAL_ERROR;
+  content_decoder_end(&stream->content);
+  return 0;
+}
+
+static ssize_t read_request_body(nghttp2_session *session, int32_t stream_id, uint8_t *buffer, size_t length,
+                                 uint32_t *data_flags, nghttp2_data_source *source, void *user) {
+  struct HTTP2Stream *stream = source->ptr;
+  size_t take = length < stream->body_length ? length : stream->body_length;
+  (void)session;
+  (void)stream_id;
+  (void)user;
+  memcpy(buffer, stream->body, take);
+  stream->body += take;
+  stream->body_length -= take;
+  if (!stream->body_length) *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  return take;
+}
+
+static int session_flush(struct HTTP2Session *h2) {
+  for (;;) {
+    const uint8_t *data;
+    ssize_t size = nghttp2_session_mem_send(h2->session, &data);
+    if (size < 0) return 0;
+    if (size == 0) return 1;
+    if (BIO_write(h2->connection, data, (int)size) != size) return 0;
+  }
+}
+
+static int session_receive(struct HTTP2Session *h2) {
+  uint8_t buffer[H2_READ_SIZE];
+  int size = BIO_read(h2->connection, buffer, H2_READ_SIZE);
+  if (size < 1) return 0;
+  return nghttp2_session_mem_recv(h2->session, buffer, size) == size;
+}
+
+/* Starts the client side of a session on a connection that negotiated h2. */
+static int session_start(struct HTTP2Session *h2) {
+  nghttp2_session_callbacks *callbacks;
+  nghttp2_settings_entry settings[2];
+  nghttp2_session_del(h2->session);
+  h2->session = NULL;
+  if (nghttp2_session_callbacks_new(&callbacks)) return 0;
+  nghttp2_session_callbacks_set_on_header_callback(callbacks, on_header);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks, on_data_chunk);
+  nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, on_stream_close);
+  int result = nghttp2_session_client_new(&h2->session, callbacks, h2);
+  nghttp2_session_callbacks_del(callbacks);
+  if (result) return 0;
+  settings[0].settings_id = NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  settings[0].value = H2_MAX_STREAMS;
+  settings[1].settings_id = NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+  settings[1].value = H2_WINDOW_SIZE;
+  if (nghttp2_submit_settings(h2->session, NGHTTP2_FLAG_NONE, settings, 2)) return 0;
+  if (nghttp2_session_set_local_window_size(h2->session, NGHTTP2_FLAG_NONE, 0, H2_WINDOW_SIZE)) return 0;
+  return session_flush(h2);
+}
+
+static int negotiated_h2(SSL *ssl) {
+  const unsigned char *protocol = NULL;
+  unsigned int length = 0;
+  SSL_get0_alpn_selected(ssl, &protocol, &length);
+  return length == 2 && memcmp(protocol, "h2", 2) == 0;
+}
+
+/* Replaces a dropped connection with a new one, which must speak h2 too. */
+static int session_reconnect(struct HTTP2Session *h2) {
+  SSL *ssl = NULL;
+  BIO_reset(h2->connection);
+  if (!http_connect(h2->connection)) return 0;
+  BIO_get_ssl(h2->connection, &ssl);
+  if (!ssl || !negotiated_h2(ssl)) {
+    BIO_reset(h2->connection);
+    return 0;
+  }
+  return session_start(h2);
+}
+
+int http2_enable(SSL_CTX *ctx) {
+  static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+  return SSL_CTX_set_alpn_protos(ctx, protocols, sizeof(protocols) - 1) == 0;
+}
+
+struct HTTP2Session *http2_session(BIO *connection, enum HTTPError *error) {
+  SSL *ssl = NULL;
+  int reconnected = 0;
+  BIO_get_ssl(connection, &ssl);
+  if (!ssl) return NULL;
+  /* A new or reset connection is opened here, since which protocol it speaks
+   * is only known once ALPN has run. If that fails, the HTTP/1.1 path reports
+   * it when it tries to write. */
+  if (!SSL_is_init_finished(ssl)) {
+    if (!http_connect(connection)) return NULL;
+    reconnected = 1;
+  }
+  struct HTTP2Session *h2 = session_index < 0 ? NULL : SSL_get_ex_data(ssl, session_index);
+  /* A session from before a reset belongs to the old connection. */
+  if (h2 && h2->session && !reconnected) return h2;
+  if (!negotiated_h2(ssl)) return NULL;
+  if (session_index < 0) {
+    session_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_session);
+    if (session_index < 0) {
+      *error = HTTP_ENOMEM;
+      return NULL;
+    }
+  }
+  if (!h2) {
+    h2 = malloc(sizeof(struct HTTP2Session));
+    if (!h2) {
+      *error = HTTP_ENOMEM;
+      return NULL;
+    }
+    h2->connection = connection;
+    h2->session = NULL;
+    if (!SSL_set_ex_data(ssl, session_index, h2)) {
+      free(h2);
+      *error = HTTP_ENOMEM;
+      return NULL;
+    }
+  }
+  if (!session_start(h2)) {
+    *error = HTTP_EBIO;
+    return NULL;
+  }
+  return h2;
+}
+
+static void stream_clear(struct HTTP2Stream *stream) {
+  content_decoder_end(&stream->content);
+  allocator_free(stream->allocator, stream->request);
+  allocator_free(stream->allocator, stream->headers);
+  allocator_free(stream->allocator, stream->head);
+  allocator_free(stream->allocator, stream->data);
+  memset(stream, 0, sizeof(struct HTTP2Stream));
+}
+
+static void set_header(nghttp2_nv *header, const char *name, size_t name_length, const char *value,
+                       size_t value_length) {
+  header->name = (uint8_t *)name;
+  header->namelen = name_length;
+  header->value = (uint8_t *)value;
+  header->valuelen = value_length;
+  header->flags = NGHTTP2_NV_FLAG_NO_COPY_NAME | NGHTTP2_NV_FLAG_NO_COPY_VALUE;
+}
+
+/**
+ * Opens a stream for a request written in HTTP/1.1 form. The request line
+ * becomes pseudo-headers, Host becomes :authority, connection-specific
+ * headers are dropped and the other names lowercased. HPACK then sends
+ * repeated headers as table indexes, except Authorization, which nghttp2
+ * never indexes so the token cannot be probed through compression.
+ */
+static int stream_submit(struct HTTP2Session *h2, struct HTTP2Stream *stream, const char *request,
+                         enum HTTPError *error) {
+  size_t size = strlen(request), line_count = 0, count = 4, i;
+  char *copy = allocator_alloc(stream->allocator, size + 1);
+  if (!copy) {
+    *error = HTTP_ENOMEM;
+    return 0;
+  }
+  memcpy(copy, request, size + 1);
+  stream->request = copy;
+  for (i = 0; i < size; i++) {
+    if (copy[i] == '\n') line_count++;
+  }
+  stream->headers = allocator_alloc(stream->allocator, (line_count + 4) * sizeof(nghttp2_nv));
+  if (!stream->headers) {
+    *error = HTTP_ENOMEM;
+    return 0;
+  }
+  char *method_end = strchr(copy, ' ');
+  char *path = method_end ? method_end + 1 : NULL;
+  char *path_end = path ? strchr(path, ' ') : NULL;
+  char *line = path_end ? strstr(path_end, "\r\n") : NULL;
+  if (!line) {
+    *error = HTTP_EPARSE;
+    return 0;
+  }
+  set_header(&stream->headers[0], ":method", 7, copy, method_end - copy);
+  set_header(&stream->headers[1], ":scheme", 7, "https", 5);
+  set_header(&stream->headers[3], ":path", 5, path, path_end - path);
+  stream->headers[2].name = NULL;
+  line += 2;
+  while (strncmp(line, "\r\n", 2) != 0) {
+    char *line_end = strstr(line, "\r\n");
+    char *colon = line_end ? memchr(line, ':', line_end - line) : NULL;
+    if (!colon) {
+      *error = HTTP_EPARSE;
+      return 0;
+    }
+    char *value = colon + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    size_t name_length = colon - line;
+    for (i = 0; i < name_length; i++) {
+      if (line[i] >= 'A' && line[i] <= 'Z') line[i] += 'a' - 'A';
+    }
+    if (name_length == 4 && memcmp(line, "host", 4) == 0) {
+      set_header(&stream->headers[2], ":authority", 10, value, line_end - value);
+    } else if (!(name_length == 10 && memcmp(line, "connection", 10) == 0) &&
+               !(name_length == 10 && memcmp(line, "keep-alive", 10) == 0) &&
+               !(name_length == 17 && memcmp(line, "transfer-encoding", 17) == 0) &&
+               !(name_length == 7 && memcmp(line, "upgrade", 7) == 0)) {
+      set_header(&stream->headers[count++], line, name_length, value, line_end - value);
+    }
+    line = line_end + 2;
+  }
+  if (!stream->headers[2].name) {
+    *error = HTTP_EPARSE;
+    return 0;
+  }
+  stream->body = line + 2;
+  stream->body_length = copy + size - stream->body;
+  nghttp2_data_provider provider;
+  provider.source.ptr = stream;
+  provider.read_callback = read_request_body;
+  if (nghttp2_submit_request(h2->session, NULL, stream->headers, count, stream->body_length ? &provider : NULL,
+                             stream) < 0) {
+    *error = HTTP_EBIO;
+    return 0;
+  }
+  return 1;
+}
+
+/* Hands the finished stream's head and body over to a response. */
+static struct HTTPResponse *stream_response(struct HTTP2Stream *stream) {
+  struct HTTPResponse *response =
+      allocator_alloc(stream->allocator, sizeof(struct HTTPResponse) + stream->header_count * sizeof(struct HTTPHeader));
+  if (!response) return NULL;
+  if (!stream->data && !append(stream->allocator, &stream->data, &stream->length, &stream->capacity, "", 0)) {
+    allocator_free(stream->allocator, response);
+    return NULL;
+  }
+  stream->data[stream->length] = '\0';
+  response->code = stream->code;
+  response->data = stream->data;
+  response->length = stream->length;
+  response->headers = (struct HTTPHeader *)(response + 1);
+  response->header_count = stream->header_count;
+  response->buffer = stream->head;
+  const char *ptr = stream->head;
+  size_t i;
+  for (i = 0; i < stream->header_count; i++) {
+    struct HTTPHeader *header = &response->headers[i];
+    header->name = ptr;
+    header->name_length = strlen(ptr);
+    header->value = ptr + header->name_length + 1;
+    header->value_length = strlen(header->value);
+    ptr = header->value + header->value_length + 1;
+  }
+  stream->data = NULL;
+  stream->head = NULL;
+  return response;
+}
+
+static int any_closed(const struct HTTP2Stream *streams, size_t depth) {
+  size_t i;
+  for (i = 0; i < depth; i++) {
+    if (streams[i].request && streams[i].closed) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Runs requests as concurrent streams, passing each response to
+ * on_response, which takes ownership of it. Streams the server refuses or
+ * resets, and those lost with a dropped connection, are sent again.
+ */
+static size_t run_streams(struct HTTP2Session *h2, const char *const *requests, size_t count, size_t depth,
+                          int (*on_response)(void *user, size_t index, struct HTTPResponse *response), void *user,
+                          const struct Allocator *allocator, enum HTTPError *error) {
+  enum HTTPError failure = HTTP_ENOERR;
+  size_t answered = 0, open = 0, cursor = 0, i;
+  int failures = 0, stopped = 0;
+  uint32_t max_streams = nghttp2_session_get_remote_settings(h2->session, NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+  if (!depth) depth = 1;
+  if (depth > max_streams) depth = max_streams;
+  if (depth > count) depth = count;
+  unsigned char *states = allocator_alloc(allocator, count);
+  struct HTTP2Stream *streams = allocator_alloc(allocator, depth * sizeof(struct HTTP2Stream));
+  if (!states || !streams) {
+    allocator_free(allocator, states);
+    allocator_free(allocator, streams);
+    *error = HTTP_ENOMEM;
+    return 0;
+  }
+  memset(states, REQUEST_PENDING, count);
+  memset(streams, 0, depth * sizeof(struct HTTP2Stream));
+  for (;;) {
+    for (i = 0; i < depth && !failure; i++) {
+      struct HTTP2Stream *stream = &streams[i];
+      if (!stream->request || !stream->closed) continue;
+      if (stream->error_code || !stream->code) {
+        /* Refused or reset by the server, so the request is sent again. */
+        states[stream->index] = REQUEST_PENDING;
+        if (stream->index < cursor) cursor = stream->index;
+        if (++failures == H2_ATTEMPTS) failure = HTTP_EBIO;
+      } else {
+        struct HTTPResponse *response = stream_response(stream);
+        if (!response) {
+          failure = HTTP_ENOMEM;
+          break;
+        }
+        states[stream->index] = REQUEST_DONE;
+        answered++;
+        failures = 0;
+        /* No new streams are opened after a stop; open ones still finish. */
+        if (on_response(user, stream->index, response)) stopped = 1;
+      }
+      stream_clear(stream);
+      open--;
+    }
+    for (i = 0; i < depth && !stopped && !failure; i++) {
+      if (streams[i].request) continue;
+      while (cursor < count && states[cursor] != REQUEST_PENDING) cursor++;
+      if (cursor == count) break;
+      streams[i].allocator = allocator;
+      streams[i].index = cursor;
+      if (!stream_submit(h2, &streams[i], requests[cursor], &failure)) {
+        stream_clear(&streams[i]);
+        break;
+      }
+      states[cursor++] = REQUEST_IN_FLIGHT;
+      open++;
+    }
+    if (failure || !open) break;
+    /* Sending a reset closes its stream, and the server has nothing more to
+     * send for it, so it is handled before waiting on the connection. */
+    if (session_flush(h2) && (any_closed(streams, depth) || session_receive(h2))) continue;
+    /* The connection dropped; everything still open is sent again. */
+    if (++failures == H2_ATTEMPTS || !session_reconnect(h2)) {
+      failure = HTTP_EBIO;
+      break;
+    }
+    for (i = 0; i < depth; i++) {
+      if (streams[i].request) states[streams[i].index] = REQUEST_PENDING;
+      stream_clear(&streams[i]);
+    }
+    open = 0;
+    cursor = 0;
+  }
+  if (failure) {
+    /* Streams may still be open, so the connection cannot be reused. */
+    BIO_reset(h2->connection);
+    nghttp2_session_del(h2->session);
+    h2->session = NULL;
+    *error = failure;
+  }
+  for (i = 0; i < depth; i++) stream_clear(&streams[i]);
+  allocator_free(allocator, streams);
+  allocator_free(allocator, states);
+  return answered;
+}
+
+static int keep_response(void *user, size_t index, struct HTTPResponse *response) {
+  (void)index;
+  *(struct HTTPResponse **)user = response;
+  return 0;
+}
+
+struct HTTPResponse *http2_request(struct HTTP2Session *session, const char *request,
+                                   const struct Allocator *allocator, enum HTTPError *error) {
+  struct HTTPResponse *response = NULL;
+  run_streams(session, &request, 1, 1, keep_response, &response, allocator, error);
+  return response;
+}
+
+struct PipelineCallback {
+  int (*on_response)(void *user, size_t index, const struct HTTPResponse *response);
+  void *user;
+  const struct Allocator *allocator;
+};
+
+static int forward_response(void *user, size_t index, struct HTTPResponse *response) {
+  struct PipelineCallback *callback = user;
+  int stop = callback->on_response(callback->user, index, response);
+  http_response_free(response, callback->allocator);
+  return stop;
+}
+
+size_t http2_pipeline(struct HTTP2Session *session, const char *const *requests, size_t count, size_t depth,
+                      int (*on_response)(void *user, size_t index, const struct HTTPResponse *response), void *user,
+                      const struct Allocator *allocator, enum HTTPError *error) {
+  struct PipelineCallback callback;
+  callback.on_response = on_response;
+  callback.user = user;
+  callback.allocator = allocator;
+  if (!count) return 0;
+  return run_streams(session, requests, count, depth, forward_response, &callback, allocator, error);
+}
+
+#else
+
+int http2_enable(SSL_CTX *ctx) {
+  (void)ctx;
+  return 0;
+}
+
+struct HTTP2Session *http2_session(BIO *connection, enum HTTPError *error) {
+  (void)connection;
+  (void)error;
+  return NULL;
+}
+
+struct HTTPResponse *http2_request(struct HTTP2Session *session, const char *request,
+                                   const struct Allocator *allocator, enum HTTPError *error) {
+  (void)session;
+  (void)request;
+  (void)allocator;
+  *error = HTTP_EBIO;
+  return NULL;
+}
+
+size_t http2_pipeline(struct HTTP2Session *session, const char *const *requests, size_t count, size_t depth,
+                      int (*on_response)(void *user, size_t index, const struct HTTPResponse *response), void *user,
+                      const struct Allocator *allocator, enum HTTPError *error) {
+  (void)session;
+  (void)requests;
+  (void)count;
+  (void)depth;
+  (void)on_response;
+  (void)user;
+  (void)allocator;
+  *error = HTTP_EBIO;
+  return 0;
+}
+
+#endif
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "input_helpers.h"
 
 char *load_file_as_string(const char *filename) {
@@ -15,6 +17,18 @@ char *load_file_as_string(const char *filename) {
   return buffer;
 }
 
+FILE *fopen_private(const char *filename) {
+#ifdef _WIN32
+  return fopen(filename, "w");
+#else
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) return NULL;
+  FILE *file = fchmod(fd, S_IRUSR | S_IWUSR) == 0 ? fdopen(fd, "w") : NULL;
+  if (!file) close(fd);
+  return file;
+#endif
+}
+
 char *get_password() {
   char *password = NULL;
   size_t index = 0;
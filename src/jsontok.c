@@ -1,14 +1,279 @@
 #include "jsontok.h"
 
+#include <float.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <unistd.h>
 
-static void skip_whitespace(const char **ptr);
-static char *jsontok_parse_string(const char **json_string, enum JsonError *error);
-static double *jsontok_parse_number(const char **json_string, enum JsonError *error);
-static struct JsonObject *jsontok_parse_object(const char **json_string, enum JsonError *error);
-static struct JsonArray *jsontok_parse_array(const char **json_string, enum JsonError *error);
-static char *jsontok_parse_sub_object(const char **json_string, enum JsonError *error);
-static char *jsontok_parse_sub_array(const char **json_string, enum JsonError *error);
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define JSONTOK_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define JSON_ARENA_BLOCK_SIZE 16384
+#define JSON_ARENA_ALIGN 16
+#define JSON_ALIGN_UP(size) (((size) + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1))
+#define JSON_ARENA_HEADER_SIZE JSON_ALIGN_UP(sizeof(struct JsonArenaBlock))
+#define JSON_INDEX_THRESHOLD 8
+#define JSON_PARALLEL_THRESHOLD 64
+#define JSON_PARALLEL_MAX_THREADS 64
+#define JSON_PARALLEL_BATCH 16
+#define IS_NUMBER_CHAR(c) (((c) >= '0' && (c) <= '9') || (c) == '-' || (c) == '+' || (c) == '.' || (c) == 'e' || (c) == 'E')
+#define IS_WHITESPACE(c) ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+struct JsonArenaBlock {
+  struct JsonArenaBlock *next;
+  size_t size;
+  size_t used;
+};
+
+struct JsonArena {
+  struct JsonArenaBlock *head;
+  size_t block_size;
+  void *last;
+  const struct Allocator *allocator;
+};
+
+enum JsonStringMode {
+  JSON_STRINGS_COPY,
+  JSON_STRINGS_INPLACE,
+  JSON_STRINGS_VIEW,
+};
+
+/**
+ * Progress through a container whose opening bracket has been consumed, so
+ * bracket matching can resume where the previous buffer ended.
+ */
+struct BracketState {
+  size_t depth;
+  unsigned char in_string;
+  unsigned char skip_first;
+};
+
+/**
+ * Structural scanning primitives. Each variant looks at 1, 16 or 32 bytes per
+ * step, never reads at or past `end` and returns `end` (or NULL for
+ * match_bracket) when nothing is found.
+ */
+struct JsonScanner {
+  const char *(*skip_whitespace)(const char *ptr, const char *end);
+  const char *(*find_string_special)(const char *ptr, const char *end);
+  const char *(*match_bracket)(struct BracketState *state, const char *ptr, const char *end, char open, char close);
+};
+
+/**
+ * Per-parse state threaded through the recursive descent. When `arena` is
+ * NULL every node is a separate heap allocation owned by the tree.
+ */
+struct JsonParser {
+  const char *base;
+  struct JsonArena *arena;
+  const struct Allocator *allocator;
+  enum JsonStringMode strings;
+  const struct JsonScanner *scanner;
+  const char *end;
+};
+
+static const struct JsonScanner *json_scanner(void);
+static void skip_whitespace(struct JsonParser *parser, const char **ptr);
+static void *parser_alloc(struct JsonParser *parser, size_t size);
+static void *parser_realloc(struct JsonParser *parser, void *ptr, size_t old_size, size_t new_size);
+static void parser_free(struct JsonParser *parser, void *ptr);
+static void parser_release(struct JsonParser *parser, struct JsonToken *token);
+static struct JsonToken *jsontok_parse_root(struct JsonParser *parser, const char *json_string, const char *end, enum JsonError *error);
+static struct JsonToken *jsontok_parse_value(struct JsonParser *parser, const char **ptr, enum JsonError *error);
+static char *jsontok_parse_string(struct JsonParser *parser, const char **json_string, size_t *length, unsigned char *escaped, enum JsonError *error);
+static int jsontok_parse_number(const struct Allocator *allocator, const char **json_string, const char *end,
+                                struct JsonToken *token, enum JsonError *error);
+static struct JsonObject *jsontok_parse_object(struct JsonParser *parser, const char **json_string, enum JsonError *error);
+static struct JsonArray *jsontok_parse_array(struct JsonParser *parser, const char **json_string, enum JsonError *error);
+static int jsontok_parse_sub_container(struct JsonParser *parser, const char **json_string, char open, char close, struct JsonSpan *span, enum JsonError *error);
+
+/**
+ * Walks the quotes, backslashes and brackets flagged in `bits` for one block
+ * of `width` bytes. Returns the index of the bracket that closes the
+ * container, or -1 if the block does not contain it.
+ */
+static int bracket_consume(struct BracketState *state, const char *block, unsigned int bits, int width, char close) {
+  if (state->skip_first) {
+    bits &= ~1u;
+    state->skip_first = 0;
+  }
+  while (bits) {
+    int index = __builtin_ctz(bits);
+    char c = block[index];
+    bits &= bits - 1;
+    if (state->in_string) {
+      if (c == '"') {
+        state->in_string = 0;
+      } else if (c == '\\') {
+        if (index + 1 < width) {
+          bits &= ~(1u << (index + 1));
+        } else {
+          state->skip_first = 1;
+        }
+      }
+    } else if (c == '"') {
+      state->in_string = 1;
+    } else if (c == close) {
+      if (--state->depth == 0) return index;
+    } else if (c != '\\') {
+      state->depth++;
+    }
+  }
+  return -1;
+}
+
+static const char *match_bracket_tail(struct BracketState *state, const char *ptr, const char *end, char open, char close) {
+  while (ptr < end) {
+    int width = end - ptr < 32 ? (int)(end - ptr) : 32;
+    unsigned int bits = 0;
+    int i = 0;
+    for (; i < width; i++) {
+      char c = ptr[i];
+      if (c == '"' || c == '\\' || c == open || c == close) bits |= 1u << i;
+    }
+    int index = bracket_consume(state, ptr, bits, width, close);
+    if (index >= 0) return ptr + index;
+    ptr += width;
+  }
+  return NULL;
+}
+
+static const char *skip_whitespace_scalar(const char *ptr, const char *end) {
+  while (ptr < end && IS_WHITESPACE(*ptr)) ptr++;
+  return ptr;
+}
+
+static const char *find_string_special_scalar(const char *ptr, const char *end) {
+  while (ptr < end && *ptr != '"' && *ptr != '\\') ptr++;
+  return ptr;
+}
+
+#ifndef JSONTOK_X86_SIMD
+static const char *match_bracket_scalar(struct BracketState *state, const char *ptr, const char *end, char open, char close) {
+  return match_bracket_tail(state, ptr, end, open, close);
+}
+
+static const struct JsonScanner scalar_scanner = {
+    skip_whitespace_scalar,
+    find_string_special_scalar,
+    match_bracket_scalar,
+};
+#else
+static const char *skip_whitespace_sse2(const char *ptr, const char *end) {
+  const __m128i space = _mm_set1_epi8(' '), newline = _mm_set1_epi8('\n');
+  const __m128i carriage = _mm_set1_epi8('\r'), tab = _mm_set1_epi8('\t');
+  while (end - ptr >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)ptr);
+    __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, newline)),
+                              _mm_or_si128(_mm_cmpeq_epi8(chunk, carriage), _mm_cmpeq_epi8(chunk, tab)));
+    unsigned int mask = ~_mm_movemask_epi8(ws) & 0xFFFF;
+    if (mask) return ptr + __builtin_ctz(mask);
+    ptr += 16;
+  }
+  return skip_whitespace_scalar(ptr, end);
+}
+
+static const char *find_string_special_sse2(const char *ptr, const char *end) {
+  const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+  while (end - ptr >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)ptr);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+    if (mask) return ptr + __builtin_ctz(mask);
+    ptr += 16;
+  }
+  return find_string_special_scalar(ptr, end);
+}
+
+static const char *match_bracket_sse2(struct BracketState *state, const char *ptr, const char *end, char open, char close) {
+  const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+  const __m128i opening = _mm_set1_epi8(open), closing = _mm_set1_epi8(close);
+  while (end - ptr >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)ptr);
+    __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(chunk, opening), _mm_cmpeq_epi8(chunk, closing)));
+    unsigned int bits = _mm_movemask_epi8(special);
+    if (bits) {
+      int index = bracket_consume(state, ptr, bits, 16, close);
+      if (index >= 0) return ptr + index;
+    } else {
+      state->skip_first = 0;
+    }
+    ptr += 16;
+  }
+  return match_bracket_tail(state, ptr, end, open, close);
+}
+
+static const struct JsonScanner sse2_scanner = {
+    skip_whitespace_sse2,
+    find_string_special_sse2,
+    match_bracket_sse2,
+};
+
+__attribute__((target("avx2"))) static const char *skip_whitespace_avx2(const char *ptr, const char *end) {
+  const __m256i space = _mm256_set1_epi8(' '), newline = _mm256_set1_epi8('\n');
+  const __m256i carriage = _mm256_set1_epi8('\r'), tab = _mm256_set1_epi8('\t');
+  while (end - ptr >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)ptr);
+    __m256i ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), _mm256_cmpeq_epi8(chunk, newline)),
+                                 _mm256_or_si256(_mm256_cmpeq_epi8(chunk, carriage), _mm256_cmpeq_epi8(chunk, tab)));
+    unsigned int mask = ~(unsigned int)_mm256_movemask_epi8(ws);
+    if (mask) return ptr + __builtin_ctz(mask);
+    ptr += 32;
+  }
+  return skip_whitespace_sse2(ptr, end);
+}
+
+__attribute__((target("avx2"))) static const char *find_string_special_avx2(const char *ptr, const char *end) {
+  const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+  while (end - ptr >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)ptr);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)));
+    if (mask) return ptr + __builtin_ctz(mask);
+    ptr += 32;
+  }
+  return find_string_special_sse2(ptr, end);
+}
+
+__attribute__((target("avx2"))) static const char *match_bracket_avx2(struct BracketState *state, const char *ptr, const char *end, char open, char close) {
+  const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+  const __m256i opening = _mm256_set1_epi8(open), closing = _mm256_set1_epi8(close);
+  while (end - ptr >= 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)ptr);
+    __m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(chunk, opening), _mm256_cmpeq_epi8(chunk, closing)));
+    unsigned int bits = _mm256_movemask_epi8(special);
+    if (bits) {
+      int index = bracket_consume(state, ptr, bits, 32, close);
+      if (index >= 0) return ptr + index;
+    } else {
+      state->skip_first = 0;
+    }
+    ptr += 32;
+  }
+  return match_bracket_tail(state, ptr, end, open, close);
+}
+
+static const struct JsonScanner avx2_scanner = {
+    skip_whitespace_avx2,
+    find_string_special_avx2,
+    match_bracket_avx2,
+};
+#endif
+
+static const struct JsonScanner *json_scanner(void) {
+  static const struct JsonScanner *selected = NULL;
+  if (!selected) {
+#ifdef JSONTOK_X86_SIMD
+    __builtin_cpu_init();
+    selected = __builtin_cpu_supports("avx2") ? &avx2_scanner : &sse2_scanner;
+#else
+    selected = &scalar_scanner;
+#endif
+  }
+  return selected;
+}
 
 const char *jsontok_strerror(enum JsonError error) {
   switch (error) {
@@ -20,212 +285,419 @@ const char *jsontok_strerror(enum JsonError error) {
       return "Invalid type";
     case JSON_ENOMEM:
       return "Out of memory";
+    case JSON_EIO:
+      return "I/O error";
     default:
       return "Unknown error";
   }
 }
 
 void jsontok_free(struct JsonToken *token) {
+  jsontok_free_allocator(token, NULL);
+}
+
+void jsontok_free_allocator(struct JsonToken *token, const struct Allocator *allocator) {
   if (token == NULL) return;
   switch (token->type) {
     case JSON_ARRAY: {
       size_t i;
       for (i = 0; i < token->as_array->length; i++) {
-        jsontok_free(token->as_array->elements[i]);
+        jsontok_free_allocator(token->as_array->elements[i], allocator);
       }
-      free(token->as_array->elements);
-      free(token->as_array);
+      allocator_free(allocator, token->as_array->elements);
+      allocator_free(allocator, token->as_array);
       break;
     }
     case JSON_OBJECT: {
       size_t i;
       for (i = 0; i < token->as_object->count; i++) {
-        free(token->as_object->entries[i]->key);
-        jsontok_free(token->as_object->entries[i]->value);
-        free(token->as_object->entries[i]);
+        allocator_free(allocator, token->as_object->entries[i]->key);
+        jsontok_free_allocator(token->as_object->entries[i]->value, allocator);
+        allocator_free(allocator, token->as_object->entries[i]);
       }
-      free(token->as_object->entries);
-      free(token->as_object);
+      allocator_free(allocator, token->as_object->entries);
+      allocator_free(allocator, token->as_object->index);
+      allocator_free(allocator, token->as_object);
       break;
     }
-    case JSON_WRAPPED_OBJECT:
-    case JSON_WRAPPED_ARRAY:
     case JSON_STRING:
-      free(token->as_string);
+      allocator_free(allocator, token->as_string);
       break;
     default:
       break;
   }
-  free(token);
+  allocator_free(allocator, token);
 }
 
-struct JsonToken *jsontok_get(struct JsonObject *object, const char *key) {
-  if (!key) {
+struct JsonArena *jsontok_arena_new(size_t block_size) {
+  return jsontok_arena_new_allocator(block_size, NULL);
+}
+
+struct JsonArena *jsontok_arena_new_allocator(size_t block_size, const struct Allocator *allocator) {
+  struct JsonArena *arena = allocator_alloc(allocator, sizeof(struct JsonArena));
+  if (!arena) return NULL;
+  arena->head = NULL;
+  arena->block_size = block_size ? block_size : JSON_ARENA_BLOCK_SIZE;
+  arena->last = NULL;
+  arena->allocator = allocator;
+  return arena;
+}
+
+void jsontok_arena_reset(struct JsonArena *arena) {
+  if (!arena || !arena->head) return;
+  struct JsonArenaBlock *block = arena->head->next;
+  while (block) {
+    struct JsonArenaBlock *next = block->next;
+    allocator_free(arena->allocator, block);
+    block = next;
+  }
+  arena->head->next = NULL;
+  arena->head->used = 0;
+  arena->last = NULL;
+}
+
+void jsontok_arena_free(struct JsonArena *arena) {
+  if (!arena) return;
+  struct JsonArenaBlock *block = arena->head;
+  while (block) {
+    struct JsonArenaBlock *next = block->next;
+    allocator_free(arena->allocator, block);
+    block = next;
+  }
+  allocator_free(arena->allocator, arena);
+}
+
+static uint32_t hash_key(const char *key, size_t length) {
+  uint32_t hash = 2166136261u;
+  size_t i = 0;
+  for (; i < length; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+struct JsonKey jsontok_key(const char *name) {
+  struct JsonKey key;
+  key.name = name;
+  key.length = name ? strlen(name) : 0;
+  key.hash = hash_key(name, key.length);
+  return key;
+}
+
+struct JsonToken *jsontok_get_key(struct JsonObject *object, const struct JsonKey *key) {
+  if (!object || !key || key->length == 0) {
     return NULL;
   }
-  size_t length = strlen(key);
-  if (length == 0) {
+  if (object->index) {
+    size_t mask = object->index_size - 1;
+    size_t slot = key->hash & mask;
+    while (object->index[slot]) {
+      struct JsonEntry *entry = object->entries[object->index[slot] - 1];
+      if (entry->hash == key->hash && entry->key_length == key->length &&
+          memcmp(entry->key, key->name, key->length) == 0) {
+        return entry->value;
+      }
+      slot = (slot + 1) & mask;
+    }
     return NULL;
   }
-  /**
-   * Hashes are not used as the number of entries will never exceed the
-   * bucket count, therefore complexities are the same with or without
-   * hashes (no collisions).
-   */
   size_t i;
   for (i = 0; i < object->count; i++) {
-    if (strncmp(object->entries[i]->key, key, length) == 0) {
-      return object->entries[i]->value;
+    struct JsonEntry *entry = object->entries[i];
+    if (entry->hash == key->hash && entry->key_length == key->length &&
+        memcmp(entry->key, key->name, key->length) == 0) {
+      return entry->value;
     }
   }
   return NULL;
 }
 
+struct JsonToken *jsontok_get(struct JsonObject *object, const char *key) {
+  if (!key) {
+    return NULL;
+  }
+  struct JsonKey resolved = jsontok_key(key);
+  return jsontok_get_key(object, &resolved);
+}
+
 struct JsonToken *jsontok_parse(const char *json_string, enum JsonError *error) {
-  if (!json_string || strlen(json_string) == 0) {
-    *error = JSON_EFMT;
+  struct JsonParser parser;
+  parser.arena = NULL;
+  parser.allocator = NULL;
+  parser.strings = JSON_STRINGS_COPY;
+  parser.base = json_string;
+  return jsontok_parse_root(&parser, json_string, json_string ? json_string + strlen(json_string) : NULL, error);
+}
+
+struct JsonToken *jsontok_parse_n(const char *json_string, size_t length, enum JsonError *error) {
+  struct JsonParser parser;
+  parser.arena = NULL;
+  parser.allocator = NULL;
+  parser.strings = JSON_STRINGS_COPY;
+  parser.base = json_string;
+  return jsontok_parse_root(&parser, json_string, json_string ? json_string + length : NULL, error);
+}
+
+struct JsonToken *jsontok_parse_allocator(const char *json_string, size_t length, const struct Allocator *allocator, enum JsonError *error) {
+  struct JsonParser parser;
+  parser.arena = NULL;
+  parser.allocator = allocator;
+  parser.strings = JSON_STRINGS_COPY;
+  parser.base = json_string;
+  return jsontok_parse_root(&parser, json_string, json_string ? json_string + length : NULL, error);
+}
+
+struct JsonToken *jsontok_parse_arena(const char *json_string, struct JsonArena *arena, enum JsonError *error) {
+  if (!arena) {
+    *error = JSON_ENOMEM;
     return NULL;
   }
-  struct JsonToken *token = malloc(sizeof(struct JsonToken));
-  if (!token) {
+  struct JsonParser parser;
+  parser.arena = arena;
+  parser.allocator = NULL;
+  parser.strings = JSON_STRINGS_COPY;
+  parser.base = json_string;
+  return jsontok_parse_root(&parser, json_string, json_string ? json_string + strlen(json_string) : NULL, error);
+}
+
+struct JsonToken *jsontok_parse_inplace(char *json_string, struct JsonArena *arena, enum JsonError *error) {
+  if (!arena) {
     *error = JSON_ENOMEM;
     return NULL;
   }
-  skip_whitespace(&json_string);
-  if (!memcmp(json_string, "true", 4)) {
-    token->type = JSON_BOOLEAN;
-    token->as_boolean = 1;
-    json_string += 4;
-  } else if (!memcmp(json_string, "false", 5)) {
-    token->type = JSON_BOOLEAN;
-    token->as_boolean = 0;
-    json_string += 5;
-  } else if (!memcmp(json_string, "null", 4)) {
-    token->type = JSON_NULL;
-    json_string += 4;
-  } else {
-    switch (*json_string) {
-      case '"': {
-        char *str = jsontok_parse_string(&json_string, error);
-        if (!str) {
-          free(token);
-          return NULL;
-        }
-        token->type = JSON_STRING;
-        token->as_string = str;
-        break;
-      }
-      case '{': {
-        struct JsonObject *object = jsontok_parse_object(&json_string, error);
-        if (!object) {
-          free(token);
-          return NULL;
-        }
-        token->type = JSON_OBJECT;
-        token->as_object = object;
-        break;
-      }
-      case '[': {
-        struct JsonArray *array = jsontok_parse_array(&json_string, error);
-        if (!array) {
-          free(token);
-          return NULL;
-        }
-        token->type = JSON_ARRAY;
-        token->as_array = array;
-        break;
-      }
-      case '0':
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-      case '9':
-      case '-': {
-        double *number = jsontok_parse_number(&json_string, error);
-        if (!number) {
-          free(token);
-          return NULL;
-        }
-        token->type = JSON_NUMBER;
-        token->as_number = *number;
-        free(number);
-        break;
+  struct JsonParser parser;
+  parser.arena = arena;
+  parser.allocator = NULL;
+  parser.strings = JSON_STRINGS_INPLACE;
+  parser.base = json_string;
+  return jsontok_parse_root(&parser, json_string, json_string ? json_string + strlen(json_string) : NULL, error);
+}
+
+struct JsonToken *jsontok_parse_views(const char *json_string, struct JsonArena *arena, enum JsonError *error) {
+  if (!arena) {
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  struct JsonParser parser;
+  parser.arena = arena;
+  parser.allocator = NULL;
+  parser.strings = JSON_STRINGS_VIEW;
+  parser.base = json_string;
+  return jsontok_parse_root(&parser, json_string, json_string ? json_string + strlen(json_string) : NULL, error);
+}
+
+struct JsonToken *jsontok_parse_span(const char *buffer, struct JsonSpan span, struct JsonArena *arena, enum JsonError *error) {
+  struct JsonParser parser;
+  parser.arena = arena;
+  parser.allocator = NULL;
+  parser.strings = JSON_STRINGS_COPY;
+  parser.base = buffer;
+  return jsontok_parse_root(&parser, buffer + span.offset, buffer + span.offset + span.length, error);
+}
+
+struct JsonToken *jsontok_parse_span_inplace(char *buffer, struct JsonSpan span, struct JsonArena *arena, enum JsonError *error) {
+  if (!arena) {
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  struct JsonParser parser;
+  parser.arena = arena;
+  parser.allocator = NULL;
+  parser.strings = JSON_STRINGS_INPLACE;
+  parser.base = buffer;
+  return jsontok_parse_root(&parser, buffer + span.offset, buffer + span.offset + span.length, error);
+}
+
+static void *arena_alloc(struct JsonArena *arena, size_t size) {
+  size = JSON_ALIGN_UP(size);
+  struct JsonArenaBlock *block = arena->head;
+  if (!block || block->size - block->used < size) {
+    size_t block_size = arena->block_size < size ? size : arena->block_size;
+    block = allocator_alloc(arena->allocator, JSON_ARENA_HEADER_SIZE + block_size);
+    if (!block) return NULL;
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->head;
+    arena->head = block;
+  }
+  void *ptr = (char *)block + JSON_ARENA_HEADER_SIZE + block->used;
+  block->used += size;
+  arena->last = ptr;
+  return ptr;
+}
+
+static void *parser_alloc(struct JsonParser *parser, size_t size) {
+  if (!parser->arena) return allocator_alloc(parser->allocator, size);
+  return arena_alloc(parser->arena, size);
+}
+
+static void *parser_realloc(struct JsonParser *parser, void *ptr, size_t old_size, size_t new_size) {
+  if (!parser->arena) return allocator_realloc(parser->allocator, ptr, new_size);
+  struct JsonArena *arena = parser->arena;
+  if (!ptr) return arena_alloc(arena, new_size);
+  /* The most recent allocation grows in place while its block has room. */
+  if (ptr == arena->last) {
+    struct JsonArenaBlock *block = arena->head;
+    size_t offset = (char *)ptr - ((char *)block + JSON_ARENA_HEADER_SIZE);
+    if (block->size - offset >= JSON_ALIGN_UP(new_size)) {
+      block->used = offset + JSON_ALIGN_UP(new_size);
+      return ptr;
+    }
+  }
+  void *new_ptr = arena_alloc(arena, new_size);
+  if (!new_ptr) return NULL;
+  memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+  return new_ptr;
+}
+
+static void parser_free(struct JsonParser *parser, void *ptr) {
+  if (!parser->arena) allocator_free(parser->allocator, ptr);
+}
+
+static void parser_release(struct JsonParser *parser, struct JsonToken *token) {
+  if (!parser->arena) jsontok_free_allocator(token, parser->allocator);
+}
+
+static void parser_release_object(struct JsonParser *parser, struct JsonObject *object) {
+  if (parser->arena) return;
+  size_t i = 0;
+  for (; i < object->count; i++) {
+    allocator_free(parser->allocator, object->entries[i]->key);
+    jsontok_free_allocator(object->entries[i]->value, parser->allocator);
+    allocator_free(parser->allocator, object->entries[i]);
+  }
+  allocator_free(parser->allocator, object->entries);
+  allocator_free(parser->allocator, object->index);
+  allocator_free(parser->allocator, object);
+}
+
+static void parser_release_array(struct JsonParser *parser, struct JsonArray *array) {
+  if (parser->arena) return;
+  size_t i = 0;
+  for (; i < array->length; i++) jsontok_free_allocator(array->elements[i], parser->allocator);
+  allocator_free(parser->allocator, array->elements);
+  allocator_free(parser->allocator, array);
+}
+
+static struct JsonToken *jsontok_parse_root(struct JsonParser *parser, const char *json_string, const char *end, enum JsonError *error) {
+  if (!json_string || json_string == end) {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  parser->scanner = json_scanner();
+  parser->end = end;
+  skip_whitespace(parser, &json_string);
+  if (json_string == end) {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  struct JsonToken *token;
+  /* Only the top level is expanded, nested containers stay wrapped. */
+  if (*json_string == '{' || *json_string == '[') {
+    token = parser_alloc(parser, sizeof(struct JsonToken));
+    if (!token) {
+      *error = JSON_ENOMEM;
+      return NULL;
+    }
+    token->escaped = 0;
+    if (*json_string == '{') {
+      struct JsonObject *object = jsontok_parse_object(parser, &json_string, error);
+      if (!object) {
+        parser_free(parser, token);
+        return NULL;
       }
-      default:
-        free(token);
-        *error = JSON_EFMT;
+      token->type = JSON_OBJECT;
+      token->as_object = object;
+    } else {
+      struct JsonArray *array = jsontok_parse_array(parser, &json_string, error);
+      if (!array) {
+        parser_free(parser, token);
         return NULL;
+      }
+      token->type = JSON_ARRAY;
+      token->as_array = array;
     }
+  } else {
+    token = jsontok_parse_value(parser, &json_string, error);
+    if (!token) return NULL;
   }
-  skip_whitespace(&json_string);
-  if (*json_string != '\0') {
-    free(token);
+  skip_whitespace(parser, &json_string);
+  if (json_string != parser->end) {
+    parser_release(parser, token);
     *error = JSON_EFMT;
     return NULL;
   }
   return token;
 }
 
-static void skip_whitespace(const char **ptr) {
-  while (**ptr == '\t' || **ptr == '\r' || **ptr == '\n' || **ptr == ' ') {
-    (*ptr)++;
-  }
+static void skip_whitespace(struct JsonParser *parser, const char **ptr) {
+  /* Compact documents have no whitespace at all, so check before dispatching. */
+  if (*ptr == parser->end || !IS_WHITESPACE(**ptr)) return;
+  (*ptr)++;
+  if (*ptr == parser->end || !IS_WHITESPACE(**ptr)) return;
+  *ptr = parser->scanner->skip_whitespace(*ptr, parser->end);
 }
 
-static struct JsonToken *jsontok_parse_value(const char **ptr, enum JsonError *error) {
-  struct JsonToken *token = malloc(sizeof(struct JsonToken));
+static struct JsonToken *jsontok_parse_value(struct JsonParser *parser, const char **ptr, enum JsonError *error) {
+  struct JsonToken *token = parser_alloc(parser, sizeof(struct JsonToken));
   if (!token) {
     *error = JSON_ENOMEM;
     return NULL;
   }
-  if (!memcmp(*ptr, "true", 4)) {
+  token->escaped = 0;
+  size_t remaining = parser->end - *ptr;
+  if (!remaining) {
+    parser_free(parser, token);
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  if (remaining >= 4 && !memcmp(*ptr, "true", 4)) {
     token->type = JSON_BOOLEAN;
     token->as_boolean = 1;
     *ptr += 4;
-  } else if (!memcmp(*ptr, "false", 5)) {
+  } else if (remaining >= 5 && !memcmp(*ptr, "false", 5)) {
     token->type = JSON_BOOLEAN;
     token->as_boolean = 0;
     *ptr += 5;
-  } else if (!memcmp(*ptr, "null", 4)) {
+  } else if (remaining >= 4 && !memcmp(*ptr, "null", 4)) {
     token->type = JSON_NULL;
     *ptr += 4;
   } else {
     switch (**ptr) {
       case '"': {
-        char *str = jsontok_parse_string(ptr, error);
+        size_t length;
+        unsigned char escaped;
+        char *str = jsontok_parse_string(parser, ptr, &length, &escaped, error);
         if (!str) {
-          free(token);
+          parser_free(parser, token);
           return NULL;
         }
-        token->type = JSON_STRING;
-        token->as_string = str;
+        if (parser->strings == JSON_STRINGS_VIEW) {
+          token->type = JSON_STRING_VIEW;
+          token->escaped = escaped;
+          token->as_view.data = str;
+          token->as_view.length = length;
+        } else {
+          token->type = JSON_STRING;
+          token->as_string = str;
+        }
         break;
       }
-      case '{': {
-        char *str = jsontok_parse_sub_object(ptr, error);
-        if (!str) {
-          free(token);
+      case '{':
+        if (!jsontok_parse_sub_container(parser, ptr, '{', '}', &token->as_span, error)) {
+          parser_free(parser, token);
           return NULL;
         }
         token->type = JSON_WRAPPED_OBJECT;
-        token->as_string = str;
         break;
-      }
-      case '[': {
-        char *str = jsontok_parse_sub_array(ptr, error);
-        if (!str) {
-          free(token);
+      case '[':
+        if (!jsontok_parse_sub_container(parser, ptr, '[', ']', &token->as_span, error)) {
+          parser_free(parser, token);
           return NULL;
         }
         token->type = JSON_WRAPPED_ARRAY;
-        token->as_string = str;
         break;
-      }
       case '0':
       case '1':
       case '2':
@@ -237,18 +709,14 @@ static struct JsonToken *jsontok_parse_value(const char **ptr, enum JsonError *e
       case '8':
       case '9':
       case '-': {
-        double *number = jsontok_parse_number(ptr, error);
-        if (!number) {
-          free(token);
+        if (!jsontok_parse_number(parser->arena ? parser->arena->allocator : parser->allocator, ptr, parser->end, token, error)) {
+          parser_free(parser, token);
           return NULL;
         }
-        token->type = JSON_NUMBER;
-        token->as_number = *number;
-        free(number);
         break;
       }
       default:
-        free(token);
+        parser_free(parser, token);
         *error = JSON_EFMT;
         return NULL;
     }
@@ -256,353 +724,2099 @@ static struct JsonToken *jsontok_parse_value(const char **ptr, enum JsonError *e
   return token;
 }
 
-static char *jsontok_parse_string(const char **json_string, enum JsonError *error) {
-  const char *start = *json_string;
-  char *result = NULL;
-  size_t length = 0;
-  if (*start != '"') {
-    *error = JSON_EFMT;
-    return NULL;
-  }
-  start++;
-  while (*start != '"') {
-    if (*start == '\0') {
-      *error = JSON_EFMT;
-      return NULL;
-    }
-    if (*start == '\\') {
-      start++;
-      if (*start == 'u') {
-        start++;
-        unsigned int unicode_value = 0;
-        size_t i = 0;
-        for (; i < 4; i++) {
-          char hex_digit = *start++;
-          unicode_value <<= 4;
-          if (hex_digit >= '0' && hex_digit <= '9') {
-            unicode_value += hex_digit - '0';
-          } else if (hex_digit >= 'a' && hex_digit <= 'f') {
-            unicode_value += hex_digit - 'a' + 10;
-          } else if (hex_digit >= 'A' && hex_digit <= 'F') {
-            unicode_value += hex_digit - 'A' + 10;
-          } else {
-            *error = JSON_EFMT;
-            return NULL;
-          }
-        }
-        if (unicode_value <= 0x7F) {
-          result = realloc(result, length + 1);
-          result[length++] = (char)unicode_value;
-        } else if (unicode_value <= 0x7FF) {
-          result = realloc(result, length + 2);
-          result[length++] = 0xC0 | ((unicode_value >> 6) & 0x1F);
-          result[length++] = 0x80 | (unicode_value & 0x3F);
-        } else if (unicode_value <= 0xFFFF) {
-          result = realloc(result, length + 3);
-          result[length++] = 0xE0 | ((unicode_value >> 12) & 0x0F);
-          result[length++] = 0x80 | ((unicode_value >> 6) & 0x3F);
-          result[length++] = 0x80 | (unicode_value & 0x3F);
-        } else if (unicode_value <= 0x10FFFF) {
-          result = realloc(result, length + 4);
-          result[length++] = 0xF0 | ((unicode_value >> 18) & 0x07);
-          result[length++] = 0x80 | ((unicode_value >> 12) & 0x3F);
-          result[length++] = 0x80 | ((unicode_value >> 6) & 0x3F);
-          result[length++] = 0x80 | (unicode_value & 0x3F);
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static unsigned int read_hex4(const char *ptr) {
+  return (hex_value(ptr[0]) << 12) | (hex_value(ptr[1]) << 8) | (hex_value(ptr[2]) << 4) | hex_value(ptr[3]);
+}
+
+/**
+ * Finds the closing quote of a string whose opening quote has already been
+ * consumed, validating escape sequences on the way. Returns NULL on a
+ * malformed or unterminated string.
+ */
+static const char *scan_string(const struct JsonScanner *scanner, const char *ptr, const char *end, unsigned char *escaped) {
+  *escaped = 0;
+  for (;;) {
+    ptr = scanner->find_string_special(ptr, end);
+    if (ptr == end) return NULL;
+    if (*ptr == '"') return ptr;
+    *escaped = 1;
+    if (++ptr == end) return NULL;
+    switch (*ptr) {
+      case '"':
+      case '\\':
+      case '/':
+      case 'b':
+      case 'f':
+      case 'n':
+      case 'r':
+      case 't':
+        break;
+      case 'u':
+        if (end - ptr < 5 || hex_value(ptr[1]) < 0 || hex_value(ptr[2]) < 0 ||
+            hex_value(ptr[3]) < 0 || hex_value(ptr[4]) < 0) {
+          return NULL;
         }
-      } else {
-        switch (*start) {
-          case 'b':
-            result = realloc(result, length + 1);
-            result[length++] = '\b';
-            break;
-          case 'f':
-            result = realloc(result, length + 1);
-            result[length++] = '\f';
-            break;
-          case 'n':
-            result = realloc(result, length + 1);
-            result[length++] = '\n';
-            break;
-          case 'r':
-            result = realloc(result, length + 1);
-            result[length++] = '\r';
-            break;
-          case 't':
-            result = realloc(result, length + 1);
-            result[length++] = '\t';
-            break;
-          case '"':
-            result = realloc(result, length + 1);
-            result[length++] = '"';
-            break;
-          case '\\':
-            result = realloc(result, length + 1);
-            result[length++] = '\\';
-            break;
-          default:
-            *error = JSON_EFMT;
-            return NULL;
+        ptr += 4;
+        break;
+      default:
+        return NULL;
+    }
+    ptr++;
+  }
+}
+
+static size_t encode_utf8(unsigned int unicode_value, char *out) {
+  if (unicode_value <= 0x7F) {
+    out[0] = (char)unicode_value;
+    return 1;
+  }
+  if (unicode_value <= 0x7FF) {
+    out[0] = 0xC0 | ((unicode_value >> 6) & 0x1F);
+    out[1] = 0x80 | (unicode_value & 0x3F);
+    return 2;
+  }
+  if (unicode_value <= 0xFFFF) {
+    out[0] = 0xE0 | ((unicode_value >> 12) & 0x0F);
+    out[1] = 0x80 | ((unicode_value >> 6) & 0x3F);
+    out[2] = 0x80 | (unicode_value & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | ((unicode_value >> 18) & 0x07);
+  out[1] = 0x80 | ((unicode_value >> 12) & 0x3F);
+  out[2] = 0x80 | ((unicode_value >> 6) & 0x3F);
+  out[3] = 0x80 | (unicode_value & 0x3F);
+  return 4;
+}
+
+/**
+ * Decodes the escape sequence after a backslash at *src into out, advancing
+ * *src past it. Returns the number of bytes written, at most four.
+ */
+static size_t unescape_one(const char **src, const char *end, char *out) {
+  const char *p = *src;
+  size_t written = 1;
+  switch (*p++) {
+    case 'b': *out = '\b'; break;
+    case 'f': *out = '\f'; break;
+    case 'n': *out = '\n'; break;
+    case 'r': *out = '\r'; break;
+    case 't': *out = '\t'; break;
+    case 'u': {
+      unsigned int unicode_value = read_hex4(p);
+      p += 4;
+      if (unicode_value >= 0xD800 && unicode_value <= 0xDBFF && end - p >= 6 &&
+          p[0] == '\\' && p[1] == 'u') {
+        unsigned int low = read_hex4(p + 2);
+        if (low >= 0xDC00 && low <= 0xDFFF) {
+          unicode_value = 0x10000 + ((unicode_value - 0xD800) << 10) + (low - 0xDC00);
+          p += 6;
         }
-        start++;
       }
-    } else {
-      result = realloc(result, length + 1);
-      result[length++] = *start++;
+      written = encode_utf8(unicode_value, out);
+      break;
     }
+    default:
+      *out = p[-1];
+      break;
   }
-  result = realloc(result, length + 1);
-  result[length] = '\0';
-  *json_string = start + 1;
-  return result;
+  *src = p;
+  return written;
 }
 
-static double *jsontok_parse_number(const char **json_string, enum JsonError *error) {
-  char *ptr = (char *)(*json_string + 1);
-  unsigned char needs_digit = **json_string == '-';
-  unsigned char decimal = 1;
-  while (1) {
-    char c = *ptr++;
-    if (c >= '0' && c <= '9') continue;
-    if (needs_digit) {
-      *error = JSON_EFMT;
-      return NULL;
-    }
-    if (decimal && c == '.') {
-      decimal = 0;
-      continue;
-    }
-    break;
+/**
+ * Writes the unescaped form of a validated string body to dest and returns
+ * its length. The output is never longer than the input, so dest may alias
+ * src for in-place unescaping.
+ */
+static size_t unescape_string(const char *src, size_t length, char *dest) {
+  const char *end = src + length;
+  char *out = dest;
+  while (src < end) {
+    const char *backslash = memchr(src, '\\', end - src);
+    size_t run = (backslash ? backslash : end) - src;
+    if (out != src) memmove(out, src, run);
+    out += run;
+    src += run;
+    if (src == end) break;
+    src++;
+    out += unescape_one(&src, end, out);
   }
-  ptr--;
-  size_t length = ptr - *json_string;
-  char *substr = malloc(length + 1);
-  if (!substr) {
-    *error = JSON_ENOMEM;
-    return NULL;
+  return out - dest;
+}
+
+int jsontok_view_equals(const struct JsonStringView *view, const char *key, size_t length) {
+  const char *src = view->data;
+  const char *end = src + view->length;
+  const char *key_end = key + length;
+  if (!memchr(src, '\\', view->length)) {
+    return view->length == length && memcmp(src, key, length) == 0;
   }
-  strncpy(substr, *json_string, length);
-  substr[length] = '\0';
-  errno = 0;
-  char *endptr = NULL;
-  double *number = malloc(sizeof(double));
-  if (!number) {
-    free(substr);
+  while (src < end) {
+    const char *backslash = memchr(src, '\\', end - src);
+    size_t run = (backslash ? backslash : end) - src;
+    char decoded[4];
+    size_t decoded_length;
+    if (run > (size_t)(key_end - key) || memcmp(src, key, run) != 0) return 0;
+    key += run;
+    src += run;
+    if (src == end) break;
+    src++;
+    decoded_length = unescape_one(&src, end, decoded);
+    if (decoded_length > (size_t)(key_end - key) || memcmp(decoded, key, decoded_length) != 0) return 0;
+    key += decoded_length;
+  }
+  return key == key_end;
+}
+
+size_t jsontok_view_unescape(const struct JsonToken *token, char *dest) {
+  size_t length = token->as_view.length;
+  if (token->escaped) {
+    length = unescape_string(token->as_view.data, length, dest);
+  } else {
+    memcpy(dest, token->as_view.data, length);
+  }
+  dest[length] = '\0';
+  return length;
+}
+
+char *jsontok_view_dup(const struct JsonToken *token) {
+  return jsontok_view_dup_allocator(token, NULL);
+}
+
+char *jsontok_view_dup_allocator(const struct JsonToken *token, const struct Allocator *allocator) {
+  if (token->type == JSON_STRING) return allocator_strndup(allocator, token->as_string, strlen(token->as_string));
+  if (token->type != JSON_STRING_VIEW) return NULL;
+  char *copy = allocator_alloc(allocator, token->as_view.length + 1);
+  if (copy) jsontok_view_unescape(token, copy);
+  return copy;
+}
+
+/**
+ * Parses the string at *json_string according to the parser's string mode.
+ * Copies and in-place strings come back unescaped and NUL-terminated; views
+ * come back as the raw body with `escaped` telling whether it needs
+ * unescaping. *length receives the length of whatever is returned.
+ */
+static char *jsontok_parse_string(struct JsonParser *parser, const char **json_string, size_t *length, unsigned char *escaped, enum JsonError *error) {
+  const char *start = *json_string;
+  if (*start != '"') {
+    *error = JSON_EFMT;
     return NULL;
   }
-  *number = strtod(substr, &endptr);
-  if (errno || *endptr != '\0') {
+  start++;
+  const char *end = scan_string(parser->scanner, start, parser->end, escaped);
+  if (!end) {
     *error = JSON_EFMT;
-    free(number);
-    free(substr);
     return NULL;
   }
-  free(substr);
+  *json_string = end + 1;
+  *length = end - start;
+  switch (parser->strings) {
+    case JSON_STRINGS_VIEW:
+      return (char *)start;
+    case JSON_STRINGS_INPLACE: {
+      char *result = (char *)start;
+      if (*escaped) *length = unescape_string(start, *length, result);
+      result[*length] = '\0';
+      *escaped = 0;
+      return result;
+    }
+    default: {
+      char *result = parser_alloc(parser, *length + 1);
+      if (!result) {
+        *error = JSON_ENOMEM;
+        return NULL;
+      }
+      if (*escaped) {
+        *length = unescape_string(start, *length, result);
+      } else {
+        memcpy(result, start, *length);
+      }
+      result[*length] = '\0';
+      *escaped = 0;
+      return result;
+    }
+  }
+}
+
+/* Powers of ten that are exactly representable as doubles. */
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+/**
+ * Converts a validated JSON number with strtod. Only reached for numbers the
+ * fast path cannot convert exactly, so the copy is normally on the stack;
+ * long numbers are copied through `allocator`.
+ */
+static int parse_number_slow(const struct Allocator *allocator, const char *start, size_t length, double *number,
+                             enum JsonError *error) {
+  char digits[128];
+  char *copy = digits;
+  if (length >= sizeof(digits)) {
+    copy = allocator_alloc(allocator, length + 1);
+    if (!copy) {
+      *error = JSON_ENOMEM;
+      return 0;
+    }
+  }
+  memcpy(copy, start, length);
+  copy[length] = '\0';
+  char *endptr = NULL;
+  *number = strtod(copy, &endptr);
+  int valid = endptr == copy + length && *number <= DBL_MAX && *number >= -DBL_MAX;
+  if (copy != digits) allocator_free(allocator, copy);
+  if (!valid) *error = JSON_EFMT;
+  return valid;
+}
+
+/**
+ * Parses a JSON number in place. Integers that fit in 64 bits become exact
+ * JSON_INTEGER tokens; everything else becomes a JSON_NUMBER. Doubles whose
+ * mantissa fits in 53 bits and whose exponent is within the exact powers of
+ * ten are converted with a single multiply or divide, which is correctly
+ * rounded, and only the remaining cases fall back to strtod.
+ */
+static int jsontok_parse_number(const struct Allocator *allocator, const char **json_string, const char *end,
+                                struct JsonToken *token, enum JsonError *error) {
+  const char *start = *json_string, *ptr = start;
+  unsigned char negative = 0;
+  if (ptr < end && *ptr == '-') {
+    negative = 1;
+    ptr++;
+  }
+  if (ptr == end || *ptr < '0' || *ptr > '9') {
+    *error = JSON_EFMT;
+    return 0;
+  }
+  uint64_t mantissa = 0;
+  int digits = 0;
+  unsigned char truncated = 0;
+  long exponent = 0;
+  if (*ptr == '0') {
+    ptr++;
+  } else {
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+      unsigned int digit = *ptr++ - '0';
+      if (digits < 19) {
+        mantissa = mantissa * 10 + digit;
+        digits++;
+      } else if (digits == 19 && !truncated && mantissa <= (UINT64_MAX - digit) / 10) {
+        mantissa = mantissa * 10 + digit;
+        digits++;
+      } else {
+        truncated = 1;
+        exponent++;
+      }
+    }
+  }
+  unsigned char integer = 1;
+  if (ptr < end && *ptr == '.') {
+    integer = 0;
+    ptr++;
+    if (ptr == end || *ptr < '0' || *ptr > '9') {
+      *error = JSON_EFMT;
+      return 0;
+    }
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+      if (digits < 19 && !truncated) {
+        mantissa = mantissa * 10 + (*ptr - '0');
+        if (mantissa) digits++;
+        exponent--;
+      } else if (*ptr != '0') {
+        truncated = 1;
+      }
+      ptr++;
+    }
+  }
+  if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+    integer = 0;
+    ptr++;
+    unsigned char negative_exponent = 0;
+    if (ptr < end && (*ptr == '+' || *ptr == '-')) negative_exponent = *ptr++ == '-';
+    if (ptr == end || *ptr < '0' || *ptr > '9') {
+      *error = JSON_EFMT;
+      return 0;
+    }
+    long value = 0;
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+      if (value < 100000) value = value * 10 + (*ptr - '0');
+      ptr++;
+    }
+    exponent += negative_exponent ? -value : value;
+  }
   *json_string = ptr;
-  return number;
+  token->unsigned_integer = 0;
+  if (integer && !truncated) {
+    if (!negative && mantissa > (uint64_t)INT64_MAX) {
+      token->type = JSON_INTEGER;
+      token->unsigned_integer = 1;
+      token->as_unsigned = mantissa;
+      return 1;
+    }
+    if (mantissa <= (uint64_t)INT64_MAX || (negative && mantissa == (uint64_t)INT64_MAX + 1)) {
+      token->type = JSON_INTEGER;
+      token->as_integer = negative ? (int64_t)(0 - mantissa) : (int64_t)mantissa;
+      return 1;
+    }
+  }
+  token->type = JSON_NUMBER;
+  if (!truncated && mantissa <= ((uint64_t)1 << 53) && exponent >= -22 && exponent <= 22) {
+    double value = (double)mantissa;
+    value = exponent < 0 ? value / exact_powers_of_ten[-exponent] : value * exact_powers_of_ten[exponent];
+    token->as_number = negative ? -value : value;
+    return 1;
+  }
+  return parse_number_slow(allocator, start, ptr - start, &token->as_number, error);
 }
 
-static struct JsonObject *jsontok_parse_object(const char **json_string, enum JsonError *error) {
-  struct JsonObject *object = malloc(sizeof(struct JsonObject));
+/**
+ * Builds the open-addressing index for an object, sized to a power of two at
+ * least twice the entry count. Duplicate keys keep the first occurrence.
+ */
+static int jsontok_index_object(struct JsonParser *parser, struct JsonObject *object) {
+  size_t size = 16;
+  while (size < object->count * 2) size <<= 1;
+  uint32_t *index = parser_alloc(parser, size * sizeof(uint32_t));
+  if (!index) return 0;
+  memset(index, 0, size * sizeof(uint32_t));
+  size_t i = 0;
+  for (; i < object->count; i++) {
+    size_t slot = object->entries[i]->hash & (size - 1);
+    while (index[slot]) slot = (slot + 1) & (size - 1);
+    index[slot] = (uint32_t)(i + 1);
+  }
+  object->index = index;
+  object->index_size = size;
+  return 1;
+}
+
+static struct JsonObject *jsontok_parse_object(struct JsonParser *parser, const char **json_string, enum JsonError *error) {
+  struct JsonObject *object = parser_alloc(parser, sizeof(struct JsonObject));
   if (!object) {
     *error = JSON_ENOMEM;
     return NULL;
   }
   object->count = 0;
   object->entries = NULL;
+  object->index = NULL;
+  object->index_size = 0;
+  size_t capacity = 0;
   const char *ptr = (char *)(*json_string + 1);
-  while (*ptr != '}') {
-    skip_whitespace(&ptr);
-    if (*ptr != '"') {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
+  skip_whitespace(parser, &ptr);
+  while (ptr == parser->end || *ptr != '}') {
+    if (ptr == parser->end || *ptr != '"') {
+      parser_release_object(parser, object);
       *error = JSON_EFMT;
       return NULL;
     }
-    char *key = jsontok_parse_string((const char **)&ptr, error);
+    size_t key_length;
+    unsigned char escaped;
+    char *key = jsontok_parse_string(parser, (const char **)&ptr, &key_length, &escaped, error);
     if (!key) {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
-      *error = JSON_ENOMEM;
+      parser_release_object(parser, object);
       return NULL;
     }
-    skip_whitespace(&ptr);
-    if (*ptr != ':') {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
+    /* Keys are compared byte-wise, so escaped view keys get an unescaped copy. */
+    if (escaped) {
+      char *unescaped = parser_alloc(parser, key_length + 1);
+      if (!unescaped) {
+        parser_release_object(parser, object);
+        *error = JSON_ENOMEM;
+        return NULL;
       }
-      free(object->entries);
-      free(object);
-      free(key);
+      key_length = unescape_string(key, key_length, unescaped);
+      unescaped[key_length] = '\0';
+      key = unescaped;
+    }
+    skip_whitespace(parser, &ptr);
+    if (ptr == parser->end || *ptr != ':') {
+      parser_release_object(parser, object);
+      parser_free(parser, key);
       *error = JSON_EFMT;
       return NULL;
     }
     ptr++;
-    skip_whitespace(&ptr);
-    struct JsonToken *token = jsontok_parse_value((const char **)&ptr, error);
+    skip_whitespace(parser, &ptr);
+    struct JsonToken *token = jsontok_parse_value(parser, (const char **)&ptr, error);
     if (!token) {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
-      free(key);
+      parser_release_object(parser, object);
+      parser_free(parser, key);
       return NULL;
     }
-    struct JsonEntry *entry = malloc(sizeof(struct JsonEntry));
+    struct JsonEntry *entry = parser_alloc(parser, sizeof(struct JsonEntry));
     if (!entry) {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
-      }
-      free(object->entries);
-      free(object);
-      free(key);
-      jsontok_free(token);
+      parser_release_object(parser, object);
+      parser_free(parser, key);
+      parser_release(parser, token);
       *error = JSON_ENOMEM;
       return NULL;
     }
     entry->key = key;
+    entry->key_length = key_length;
+    entry->hash = hash_key(key, key_length);
     entry->value = token;
-    struct JsonEntry **new_entries = realloc(object->entries, (object->count + 1) * sizeof(struct JsonEntry *));
-    if (!new_entries) {
-      size_t i = 0;
-      for (; i < object->count; i++) {
-        free(object->entries[i]->key);
-        jsontok_free(object->entries[i]->value);
+    if (object->count == capacity) {
+      size_t new_capacity = capacity ? capacity * 2 : 8;
+      struct JsonEntry **new_entries = parser_realloc(parser, object->entries, capacity * sizeof(struct JsonEntry *), new_capacity * sizeof(struct JsonEntry *));
+      if (!new_entries) {
+        parser_release_object(parser, object);
+        parser_free(parser, key);
+        parser_release(parser, token);
+        parser_free(parser, entry);
+        *error = JSON_ENOMEM;
+        return NULL;
       }
-      free(object->entries);
-      free(object);
-      free(key);
-      jsontok_free(token);
-      free(entry);
-      *error = JSON_ENOMEM;
-      return NULL;
+      object->entries = new_entries;
+      capacity = new_capacity;
     }
-    object->entries = new_entries;
     object->entries[object->count++] = entry;
-    skip_whitespace(&ptr);
-    if (*ptr == ',') ptr++;
-    skip_whitespace(&ptr);
+    skip_whitespace(parser, &ptr);
+    if (ptr != parser->end && *ptr == ',') ptr++;
+    skip_whitespace(parser, &ptr);
+  }
+  if (object->count > JSON_INDEX_THRESHOLD && !jsontok_index_object(parser, object)) {
+    parser_release_object(parser, object);
+    *error = JSON_ENOMEM;
+    return NULL;
   }
   *json_string = ptr + 1;
   return object;
 }
 
-static struct JsonArray *jsontok_parse_array(const char **json_string, enum JsonError *error) {
-  struct JsonArray *array = malloc(sizeof(struct JsonArray));
+static struct JsonArray *jsontok_parse_array(struct JsonParser *parser, const char **json_string, enum JsonError *error) {
+  struct JsonArray *array = parser_alloc(parser, sizeof(struct JsonArray));
   if (!array) {
     *error = JSON_ENOMEM;
     return NULL;
   }
   array->length = 0;
   array->elements = NULL;
+  size_t capacity = 0;
   const char *ptr = *json_string + 1;
-  while (*ptr != ']') {
-    skip_whitespace(&ptr);
-    if (*ptr == '\0') {
-      size_t i = 0;
-      for (; i < array->length; i++) jsontok_free(array->elements[i]);
-      free(array->elements);
-      free(array);
+  skip_whitespace(parser, &ptr);
+  while (ptr == parser->end || *ptr != ']') {
+    if (ptr == parser->end) {
+      parser_release_array(parser, array);
       *error = JSON_EFMT;
       return NULL;
     }
-    struct JsonToken *token = jsontok_parse_value((const char **)&ptr, error);
+    struct JsonToken *token = jsontok_parse_value(parser, (const char **)&ptr, error);
     if (!token) {
-      size_t i = 0;
-      for (; i < array->length; i++) jsontok_free(array->elements[i]);
-      free(array->elements);
-      free(array);
+      parser_release_array(parser, array);
       return NULL;
     }
-    void *new_elements = realloc(array->elements, (array->length + 1) * sizeof(struct JsonToken));
-    if (!new_elements) {
-      size_t i = 0;
-      for (; i < array->length; i++) jsontok_free(array->elements[i]);
-      free(array->elements);
-      free(array);
-      *error = JSON_ENOMEM;
-      return NULL;
+    if (array->length == capacity) {
+      size_t new_capacity = capacity ? capacity * 2 : 8;
+      struct JsonToken **new_elements = parser_realloc(parser, array->elements, capacity * sizeof(struct JsonToken *), new_capacity * sizeof(struct JsonToken *));
+      if (!new_elements) {
+        parser_release_array(parser, array);
+        parser_release(parser, token);
+        *error = JSON_ENOMEM;
+        return NULL;
+      }
+      array->elements = new_elements;
+      capacity = new_capacity;
     }
-    array->elements = new_elements;
     array->elements[array->length++] = token;
-    skip_whitespace(&ptr);
-    if (*ptr == ',') ptr++;
-    skip_whitespace(&ptr);
+    skip_whitespace(parser, &ptr);
+    if (ptr != parser->end && *ptr == ',') ptr++;
+    skip_whitespace(parser, &ptr);
   }
   *json_string = ptr + 1;
   return array;
 }
 
-static char *jsontok_parse_sub_object(const char **json_string, enum JsonError *error) {
-  char *ptr = (char *)(*json_string + 1);
-  size_t counter = 1;
-  while (counter > 1 || *ptr != '}') {
-    if (*ptr == '\0') {
-      *error = JSON_EFMT;
-      return NULL;
+/* Records where a nested container is instead of copying its text. */
+static int jsontok_parse_sub_container(struct JsonParser *parser, const char **json_string, char open, char close, struct JsonSpan *span, enum JsonError *error) {
+  const char *start = *json_string;
+  if (*start != open) {
+    *error = JSON_EFMT;
+    return 0;
+  }
+  struct BracketState state = {1, 0, 0};
+  const char *ptr = parser->scanner->match_bracket(&state, start + 1, parser->end, open, close);
+  if (!ptr) {
+    *error = JSON_EFMT;
+    return 0;
+  }
+  span->offset = start - parser->base;
+  span->length = ptr - start + 1;
+  *json_string = ptr + 1;
+  return 1;
+}
+
+enum JsonStreamState {
+  JSON_STREAM_VALUE,
+  JSON_STREAM_FIRST_VALUE,
+  JSON_STREAM_FIRST_KEY,
+  JSON_STREAM_KEY,
+  JSON_STREAM_COLON,
+  JSON_STREAM_AFTER_VALUE,
+  JSON_STREAM_STRING,
+  JSON_STREAM_ESCAPE,
+  JSON_STREAM_UNICODE,
+  JSON_STREAM_NUMBER,
+  JSON_STREAM_LITERAL,
+  JSON_STREAM_SKIP,
+  JSON_STREAM_DONE,
+  JSON_STREAM_ERROR,
+};
+
+/**
+ * Push parser state. Only the container stack and the token being built
+ * across chunk boundaries are kept, so memory does not grow with the size of
+ * the document.
+ */
+struct JsonStream {
+  const struct Allocator *allocator;
+  int (*callback)(void *user, enum JsonEvent event, const char *data, size_t length);
+  void *user;
+  const struct JsonScanner *scanner;
+  enum JsonStreamState state;
+  char *stack;
+  size_t depth;
+  size_t stack_capacity;
+  char *scratch;
+  size_t scratch_length;
+  size_t scratch_capacity;
+  unsigned char in_key;
+  unsigned int unicode_value;
+  unsigned int unicode_digits;
+  unsigned int high_surrogate;
+  const char *literal;
+  size_t literal_matched;
+  enum JsonEvent literal_event;
+  struct BracketState skip;
+  char skip_open;
+  char skip_close;
+};
+
+static int valid_number(const char *ptr, size_t length) {
+  const char *end = ptr + length;
+  if (ptr < end && *ptr == '-') ptr++;
+  if (ptr == end) return 0;
+  if (*ptr == '0') {
+    ptr++;
+  } else if (*ptr >= '1' && *ptr <= '9') {
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') ptr++;
+  } else {
+    return 0;
+  }
+  if (ptr < end && *ptr == '.') {
+    ptr++;
+    if (ptr == end || *ptr < '0' || *ptr > '9') return 0;
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') ptr++;
+  }
+  if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+    ptr++;
+    if (ptr < end && (*ptr == '+' || *ptr == '-')) ptr++;
+    if (ptr == end || *ptr < '0' || *ptr > '9') return 0;
+    while (ptr < end && *ptr >= '0' && *ptr <= '9') ptr++;
+  }
+  return ptr == end;
+}
+
+struct JsonStream *jsontok_stream_new(int (*callback)(void *user, enum JsonEvent event, const char *data, size_t length), void *user) {
+  return jsontok_stream_new_allocator(callback, user, NULL);
+}
+
+struct JsonStream *jsontok_stream_new_allocator(int (*callback)(void *user, enum JsonEvent event, const char *data, size_t length), void *user, const struct Allocator *allocator) {
+  if (!callback) return NULL;
+  struct JsonStream *stream = allocator_alloc(allocator, sizeof(struct JsonStream));
+  if (!stream) return NULL;
+  memset(stream, 0, sizeof(struct JsonStream));
+  stream->allocator = allocator;
+  stream->callback = callback;
+  stream->user = user;
+  stream->scanner = json_scanner();
+  stream->state = JSON_STREAM_VALUE;
+  return stream;
+}
+
+void jsontok_stream_free(struct JsonStream *stream) {
+  if (!stream) return;
+  allocator_free(stream->allocator, stream->stack);
+  allocator_free(stream->allocator, stream->scratch);
+  allocator_free(stream->allocator, stream);
+}
+
+static int stream_append(struct JsonStream *stream, const char *data, size_t length) {
+  if (stream->scratch_length + length > stream->scratch_capacity) {
+    size_t capacity = stream->scratch_capacity ? stream->scratch_capacity : 256;
+    while (capacity < stream->scratch_length + length) capacity *= 2;
+    char *scratch = allocator_realloc(stream->allocator, stream->scratch, capacity);
+    if (!scratch) return 0;
+    stream->scratch = scratch;
+    stream->scratch_capacity = capacity;
+  }
+  memcpy(stream->scratch + stream->scratch_length, data, length);
+  stream->scratch_length += length;
+  return 1;
+}
+
+static int stream_push(struct JsonStream *stream, char open) {
+  if (stream->depth == stream->stack_capacity) {
+    size_t capacity = stream->stack_capacity ? stream->stack_capacity * 2 : 32;
+    char *stack = allocator_realloc(stream->allocator, stream->stack, capacity);
+    if (!stack) return 0;
+    stream->stack = stack;
+    stream->stack_capacity = capacity;
+  }
+  stream->stack[stream->depth++] = open;
+  return 1;
+}
+
+static void stream_value_done(struct JsonStream *stream) {
+  stream->state = stream->depth ? JSON_STREAM_AFTER_VALUE : JSON_STREAM_DONE;
+}
+
+static int stream_close(struct JsonStream *stream, char close) {
+  char open = close == '}' ? '{' : '[';
+  if (!stream->depth || stream->stack[stream->depth - 1] != open) return 0;
+  stream->depth--;
+  stream->callback(stream->user, close == '}' ? JSON_EVENT_OBJECT_END : JSON_EVENT_ARRAY_END, NULL, 0);
+  stream_value_done(stream);
+  return 1;
+}
+
+static int stream_flush_surrogate(struct JsonStream *stream) {
+  char utf8[4];
+  size_t length = encode_utf8(stream->high_surrogate, utf8);
+  stream->high_surrogate = 0;
+  return stream_append(stream, utf8, length);
+}
+
+static int stream_fail(struct JsonStream *stream, enum JsonError code, enum JsonError *error) {
+  stream->state = JSON_STREAM_ERROR;
+  *error = code;
+  return 0;
+}
+
+int jsontok_feed(struct JsonStream *stream, const char *buffer, size_t length, enum JsonError *error) {
+  const char *ptr = buffer;
+  const char *end = buffer + length;
+  if (stream->state == JSON_STREAM_ERROR) return stream_fail(stream, JSON_EFMT, error);
+  while (ptr < end) {
+    switch (stream->state) {
+      case JSON_STREAM_DONE:
+        ptr = stream->scanner->skip_whitespace(ptr, end);
+        if (ptr != end) return stream_fail(stream, JSON_EFMT, error);
+        break;
+      case JSON_STREAM_FIRST_KEY:
+      case JSON_STREAM_KEY:
+        ptr = stream->scanner->skip_whitespace(ptr, end);
+        if (ptr == end) break;
+        if (*ptr == '}' && stream->state == JSON_STREAM_FIRST_KEY) {
+          ptr++;
+          stream_close(stream, '}');
+          break;
+        }
+        if (*ptr != '"') return stream_fail(stream, JSON_EFMT, error);
+        ptr++;
+        stream->in_key = 1;
+        stream->scratch_length = 0;
+        stream->state = JSON_STREAM_STRING;
+        break;
+      case JSON_STREAM_COLON:
+        ptr = stream->scanner->skip_whitespace(ptr, end);
+        if (ptr == end) break;
+        if (*ptr++ != ':') return stream_fail(stream, JSON_EFMT, error);
+        stream->state = JSON_STREAM_VALUE;
+        break;
+      case JSON_STREAM_AFTER_VALUE:
+        ptr = stream->scanner->skip_whitespace(ptr, end);
+        if (ptr == end) break;
+        if (*ptr == ',') {
+          stream->state = stream->stack[stream->depth - 1] == '{' ? JSON_STREAM_KEY : JSON_STREAM_VALUE;
+        } else if ((*ptr != '}' && *ptr != ']') || !stream_close(stream, *ptr)) {
+          return stream_fail(stream, JSON_EFMT, error);
+        }
+        ptr++;
+        break;
+      case JSON_STREAM_FIRST_VALUE:
+      case JSON_STREAM_VALUE:
+        ptr = stream->scanner->skip_whitespace(ptr, end);
+        if (ptr == end) break;
+        if (*ptr == ']' && stream->state == JSON_STREAM_FIRST_VALUE) {
+          ptr++;
+          stream_close(stream, ']');
+          break;
+        }
+        switch (*ptr) {
+          case '"':
+            ptr++;
+            stream->in_key = 0;
+            stream->scratch_length = 0;
+            stream->state = JSON_STREAM_STRING;
+            break;
+          case '{':
+          case '[': {
+            char open = *ptr++;
+            enum JsonEvent event = open == '{' ? JSON_EVENT_OBJECT_START : JSON_EVENT_ARRAY_START;
+            if (stream->callback(stream->user, event, NULL, 0)) {
+              stream->skip.depth = 1;
+              stream->skip.in_string = 0;
+              stream->skip.skip_first = 0;
+              stream->skip_open = open;
+              stream->skip_close = open == '{' ? '}' : ']';
+              stream->state = JSON_STREAM_SKIP;
+              break;
+            }
+            if (!stream_push(stream, open)) return stream_fail(stream, JSON_ENOMEM, error);
+            stream->state = open == '{' ? JSON_STREAM_FIRST_KEY : JSON_STREAM_FIRST_VALUE;
+            break;
+          }
+          case 't':
+            stream->literal = "true";
+            stream->literal_event = JSON_EVENT_TRUE;
+            stream->literal_matched = 0;
+            stream->state = JSON_STREAM_LITERAL;
+            break;
+          case 'f':
+            stream->literal = "false";
+            stream->literal_event = JSON_EVENT_FALSE;
+            stream->literal_matched = 0;
+            stream->state = JSON_STREAM_LITERAL;
+            break;
+          case 'n':
+            stream->literal = "null";
+            stream->literal_event = JSON_EVENT_NULL;
+            stream->literal_matched = 0;
+            stream->state = JSON_STREAM_LITERAL;
+            break;
+          default:
+            if (*ptr != '-' && (*ptr < '0' || *ptr > '9')) return stream_fail(stream, JSON_EFMT, error);
+            stream->scratch_length = 0;
+            stream->state = JSON_STREAM_NUMBER;
+            break;
+        }
+        break;
+      case JSON_STREAM_STRING: {
+        if (stream->high_surrogate && *ptr != '\\' && !stream_flush_surrogate(stream)) return stream_fail(stream, JSON_ENOMEM, error);
+        const char *special = stream->scanner->find_string_special(ptr, end);
+        if (special == end) {
+          if (!stream_append(stream, ptr, end - ptr)) return stream_fail(stream, JSON_ENOMEM, error);
+          ptr = end;
+          break;
+        }
+        if (*special == '\\') {
+          if (!stream_append(stream, ptr, special - ptr)) return stream_fail(stream, JSON_ENOMEM, error);
+          ptr = special + 1;
+          stream->state = JSON_STREAM_ESCAPE;
+          break;
+        }
+        /* A string that started and ended in this chunk is passed through. */
+        const char *data = ptr;
+        size_t data_length = special - ptr;
+        if (stream->scratch_length) {
+          if (!stream_append(stream, ptr, special - ptr)) return stream_fail(stream, JSON_ENOMEM, error);
+          data = stream->scratch;
+          data_length = stream->scratch_length;
+        }
+        ptr = special + 1;
+        if (stream->in_key) {
+          stream->callback(stream->user, JSON_EVENT_KEY, data, data_length);
+          stream->state = JSON_STREAM_COLON;
+        } else {
+          stream->callback(stream->user, JSON_EVENT_STRING, data, data_length);
+          stream_value_done(stream);
+        }
+        break;
+      }
+      case JSON_STREAM_ESCAPE: {
+        char c = *ptr++;
+        if (c == 'u') {
+          stream->unicode_value = 0;
+          stream->unicode_digits = 0;
+          stream->state = JSON_STREAM_UNICODE;
+          break;
+        }
+        if (stream->high_surrogate && !stream_flush_surrogate(stream)) return stream_fail(stream, JSON_ENOMEM, error);
+        switch (c) {
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'n': c = '\n'; break;
+          case 'r': c = '\r'; break;
+          case 't': c = '\t'; break;
+          case '"':
+          case '\\':
+          case '/':
+            break;
+          default:
+            return stream_fail(stream, JSON_EFMT, error);
+        }
+        if (!stream_append(stream, &c, 1)) return stream_fail(stream, JSON_ENOMEM, error);
+        stream->state = JSON_STREAM_STRING;
+        break;
+      }
+      case JSON_STREAM_UNICODE: {
+        int digit = hex_value(*ptr++);
+        if (digit < 0) return stream_fail(stream, JSON_EFMT, error);
+        stream->unicode_value = (stream->unicode_value << 4) | digit;
+        if (++stream->unicode_digits < 4) break;
+        stream->state = JSON_STREAM_STRING;
+        unsigned int unicode_value = stream->unicode_value;
+        if (stream->high_surrogate) {
+          if (unicode_value >= 0xDC00 && unicode_value <= 0xDFFF) {
+            unicode_value = 0x10000 + ((stream->high_surrogate - 0xD800) << 10) + (unicode_value - 0xDC00);
+            stream->high_surrogate = 0;
+          } else if (!stream_flush_surrogate(stream)) {
+            return stream_fail(stream, JSON_ENOMEM, error);
+          }
+        }
+        if (unicode_value >= 0xD800 && unicode_value <= 0xDBFF) {
+          stream->high_surrogate = unicode_value;
+          break;
+        }
+        char utf8[4];
+        if (!stream_append(stream, utf8, encode_utf8(unicode_value, utf8))) return stream_fail(stream, JSON_ENOMEM, error);
+        break;
+      }
+      case JSON_STREAM_NUMBER: {
+        const char *start = ptr;
+        while (ptr < end && IS_NUMBER_CHAR(*ptr)) ptr++;
+        if (ptr == end) {
+          if (!stream_append(stream, start, ptr - start)) return stream_fail(stream, JSON_ENOMEM, error);
+          break;
+        }
+        const char *data = start;
+        size_t data_length = ptr - start;
+        if (stream->scratch_length) {
+          if (!stream_append(stream, start, ptr - start)) return stream_fail(stream, JSON_ENOMEM, error);
+          data = stream->scratch;
+          data_length = stream->scratch_length;
+        }
+        if (!valid_number(data, data_length)) return stream_fail(stream, JSON_EFMT, error);
+        stream->callback(stream->user, JSON_EVENT_NUMBER, data, data_length);
+        stream_value_done(stream);
+        break;
+      }
+      case JSON_STREAM_LITERAL:
+        while (ptr < end && stream->literal[stream->literal_matched]) {
+          if (*ptr++ != stream->literal[stream->literal_matched++]) return stream_fail(stream, JSON_EFMT, error);
+        }
+        if (!stream->literal[stream->literal_matched]) {
+          stream->callback(stream->user, stream->literal_event, NULL, 0);
+          stream_value_done(stream);
+        }
+        break;
+      case JSON_STREAM_SKIP: {
+        const char *close = stream->scanner->match_bracket(&stream->skip, ptr, end, stream->skip_open, stream->skip_close);
+        if (!close) {
+          ptr = end;
+          break;
+        }
+        ptr = close + 1;
+        stream_value_done(stream);
+        break;
+      }
+      default:
+        return stream_fail(stream, JSON_EFMT, error);
+    }
+  }
+  return 1;
+}
+
+int jsontok_finish(struct JsonStream *stream, enum JsonError *error) {
+  if (stream->state == JSON_STREAM_NUMBER && stream->depth == 0) {
+    if (!valid_number(stream->scratch, stream->scratch_length)) {
+      stream->state = JSON_STREAM_ERROR;
+    } else {
+      stream->callback(stream->user, JSON_EVENT_NUMBER, stream->scratch, stream->scratch_length);
+      stream->state = JSON_STREAM_DONE;
+    }
+  }
+  if (stream->state != JSON_STREAM_DONE) {
+    *error = JSON_EFMT;
+    return 0;
+  }
+  return 1;
+}
+
+static int cursor_fail(enum JsonError code, enum JsonError *error) {
+  *error = code;
+  return 0;
+}
+
+static void cursor_skip_whitespace(struct JsonCursor *cursor) {
+  if (cursor->ptr < cursor->end && IS_WHITESPACE(*cursor->ptr)) {
+    cursor->ptr = json_scanner()->skip_whitespace(cursor->ptr, cursor->end);
+  }
+}
+
+/* Positions the cursor on the first byte of the pending value. */
+static int cursor_value(struct JsonCursor *cursor, enum JsonError *error) {
+  if (!cursor->pending) return cursor_fail(JSON_ETYPE, error);
+  cursor_skip_whitespace(cursor);
+  if (cursor->ptr == cursor->end) return cursor_fail(JSON_EFMT, error);
+  return 1;
+}
+
+/* Returns one past the end of the value starting at cursor->ptr, or NULL. */
+static const char *cursor_value_end(struct JsonCursor *cursor) {
+  const char *ptr = cursor->ptr, *end = cursor->end;
+  switch (*ptr) {
+    case '"': {
+      unsigned char escaped;
+      const char *close = scan_string(json_scanner(), ptr + 1, end, &escaped);
+      return close ? close + 1 : NULL;
+    }
+    case '{':
+    case '[': {
+      struct BracketState state = {1, 0, 0};
+      const char *close = json_scanner()->match_bracket(&state, ptr + 1, end, *ptr, *ptr == '{' ? '}' : ']');
+      return close ? close + 1 : NULL;
+    }
+    case 't':
+      return end - ptr >= 4 && !memcmp(ptr, "true", 4) ? ptr + 4 : NULL;
+    case 'f':
+      return end - ptr >= 5 && !memcmp(ptr, "false", 5) ? ptr + 5 : NULL;
+    case 'n':
+      return end - ptr >= 4 && !memcmp(ptr, "null", 4) ? ptr + 4 : NULL;
+    default: {
+      const char *number_end = ptr;
+      while (number_end < end && IS_NUMBER_CHAR(*number_end)) number_end++;
+      return valid_number(ptr, number_end - ptr) ? number_end : NULL;
+    }
+  }
+}
+
+static int cursor_enter(struct JsonCursor *cursor, char open, enum JsonError *error) {
+  if (!cursor_value(cursor, error)) return 0;
+  if (*cursor->ptr != open) return cursor_fail(JSON_ETYPE, error);
+  if (cursor->depth == JSONTOK_CURSOR_MAX_DEPTH) return cursor_fail(JSON_EFMT, error);
+  cursor->ptr++;
+  cursor->containers[cursor->depth] = open;
+  cursor->starts[cursor->depth] = cursor->ptr;
+  cursor->depth++;
+  cursor->pending = 0;
+  cursor->at_start = 1;
+  return 1;
+}
+
+/**
+ * Consumes the separator before the next member of the current container.
+ * Returns 0 and steps out of the container when its closing bracket is next.
+ */
+static int cursor_advance(struct JsonCursor *cursor, char open, enum JsonError *error) {
+  if (!cursor->depth || cursor->containers[cursor->depth - 1] != open) return cursor_fail(JSON_ETYPE, error);
+  if (cursor->pending && !jsontok_cursor_skip_value(cursor, error)) return 0;
+  cursor_skip_whitespace(cursor);
+  if (cursor->ptr == cursor->end) return cursor_fail(JSON_EFMT, error);
+  if (*cursor->ptr == (open == '{' ? '}' : ']')) {
+    cursor->ptr++;
+    cursor->depth--;
+    cursor->at_start = 0;
+    return 0;
+  }
+  if (!cursor->at_start) {
+    if (*cursor->ptr != ',') return cursor_fail(JSON_EFMT, error);
+    cursor->ptr++;
+    cursor_skip_whitespace(cursor);
+    if (cursor->ptr == cursor->end) return cursor_fail(JSON_EFMT, error);
+  }
+  cursor->at_start = 0;
+  return 1;
+}
+
+
+void jsontok_cursor_init(struct JsonCursor *cursor, const char *json_string, size_t length) {
+  jsontok_cursor_init_allocator(cursor, json_string, length, NULL);
+}
+
+void jsontok_cursor_init_allocator(struct JsonCursor *cursor, const char *json_string, size_t length, const struct Allocator *allocator) {
+  cursor->ptr = json_string;
+  cursor->end = json_string + length;
+  cursor->depth = 0;
+  cursor->pending = 1;
+  cursor->at_start = 0;
+  cursor->allocator = allocator;
+}
+
+int jsontok_cursor_peek(struct JsonCursor *cursor, enum JsonType *type, enum JsonError *error) {
+  if (!cursor_value(cursor, error)) return 0;
+  switch (*cursor->ptr) {
+    case '"': *type = JSON_STRING; break;
+    case '{': *type = JSON_OBJECT; break;
+    case '[': *type = JSON_ARRAY; break;
+    case 't':
+    case 'f': *type = JSON_BOOLEAN; break;
+    case 'n': *type = JSON_NULL; break;
+    default:
+      if (*cursor->ptr != '-' && (*cursor->ptr < '0' || *cursor->ptr > '9')) return cursor_fail(JSON_EFMT, error);
+      *type = JSON_NUMBER;
+      break;
+  }
+  return 1;
+}
+
+int jsontok_cursor_enter_object(struct JsonCursor *cursor, enum JsonError *error) {
+  return cursor_enter(cursor, '{', error);
+}
+
+int jsontok_cursor_enter_array(struct JsonCursor *cursor, enum JsonError *error) {
+  return cursor_enter(cursor, '[', error);
+}
+
+int jsontok_cursor_next(struct JsonCursor *cursor, enum JsonError *error) {
+  if (!cursor_advance(cursor, '[', error)) return 0;
+  if (*cursor->ptr == ']') return cursor_fail(JSON_EFMT, error);
+  cursor->pending = 1;
+  return 1;
+}
+
+int jsontok_cursor_next_field(struct JsonCursor *cursor, struct JsonStringView *key, enum JsonError *error) {
+  if (!cursor_advance(cursor, '{', error)) return 0;
+  if (*cursor->ptr != '"') return cursor_fail(JSON_EFMT, error);
+  unsigned char escaped;
+  const char *close = scan_string(json_scanner(), cursor->ptr + 1, cursor->end, &escaped);
+  if (!close) return cursor_fail(JSON_EFMT, error);
+  if (key) {
+    key->data = cursor->ptr + 1;
+    key->length = close - cursor->ptr - 1;
+  }
+  cursor->ptr = close + 1;
+  cursor_skip_whitespace(cursor);
+  if (cursor->ptr == cursor->end || *cursor->ptr != ':') return cursor_fail(JSON_EFMT, error);
+  cursor->ptr++;
+  cursor->pending = 1;
+  return 1;
+}
+
+int jsontok_cursor_find_field(struct JsonCursor *cursor, const char *key, enum JsonError *error) {
+  if (!cursor->depth || cursor->containers[cursor->depth - 1] != '{') return cursor_fail(JSON_ETYPE, error);
+  if (cursor->pending && !jsontok_cursor_skip_value(cursor, error)) return 0;
+  size_t length = strlen(key);
+  const char *origin = cursor->ptr;
+  unsigned char origin_at_start = cursor->at_start;
+  unsigned char wrapped = 0;
+  for (;;) {
+    if (cursor->pending && !jsontok_cursor_skip_value(cursor, error)) return 0;
+    if (wrapped && cursor->ptr >= origin) {
+      cursor->at_start = origin_at_start;
+      return 0;
+    }
+    struct JsonStringView name;
+    enum JsonError next_error = JSON_ENOERR;
+    if (!jsontok_cursor_next_field(cursor, &name, &next_error)) {
+      if (next_error != JSON_ENOERR) return cursor_fail(next_error, error);
+      if (wrapped) return 0;
+      /* Hit the closing brace, so search the fields before the origin. */
+      cursor->depth++;
+      cursor->ptr = cursor->starts[cursor->depth - 1];
+      cursor->at_start = 1;
+      wrapped = 1;
+      continue;
+    }
+    if (jsontok_view_equals(&name, key, length)) return 1;
+  }
+}
+
+int jsontok_cursor_leave(struct JsonCursor *cursor, enum JsonError *error) {
+  if (!cursor->depth) return cursor_fail(JSON_ETYPE, error);
+  char open = cursor->containers[cursor->depth - 1];
+  struct BracketState state = {1, 0, 0};
+  const char *close = json_scanner()->match_bracket(&state, cursor->ptr, cursor->end, open, open == '{' ? '}' : ']');
+  if (!close) return cursor_fail(JSON_EFMT, error);
+  cursor->ptr = close + 1;
+  cursor->depth--;
+  cursor->pending = 0;
+  cursor->at_start = 0;
+  return 1;
+}
+
+int jsontok_cursor_skip_value(struct JsonCursor *cursor, enum JsonError *error) {
+  if (!cursor_value(cursor, error)) return 0;
+  const char *value_end = cursor_value_end(cursor);
+  if (!value_end) return cursor_fail(JSON_EFMT, error);
+  cursor->ptr = value_end;
+  cursor->pending = 0;
+  return 1;
+}
+
+int jsontok_cursor_get_string_view(struct JsonCursor *cursor, struct JsonToken *view, enum JsonError *error) {
+  if (!cursor_value(cursor, error)) return 0;
+  if (*cursor->ptr != '"') return cursor_fail(JSON_ETYPE, error);
+  unsigned char escaped;
+  const char *close = scan_string(json_scanner(), cursor->ptr + 1, cursor->end, &escaped);
+  if (!close) return cursor_fail(JSON_EFMT, error);
+  view->type = JSON_STRING_VIEW;
+  view->escaped = escaped;
+  view->as_view.data = cursor->ptr + 1;
+  view->as_view.length = close - cursor->ptr - 1;
+  cursor->ptr = close + 1;
+  cursor->pending = 0;
+  return 1;
+}
+
+int jsontok_cursor_get_number(struct JsonCursor *cursor, double *number, enum JsonError *error) {
+  if (!cursor_value(cursor, error)) return 0;
+  if (*cursor->ptr != '-' && (*cursor->ptr < '0' || *cursor->ptr > '9')) return cursor_fail(JSON_ETYPE, error);
+  struct JsonToken token;
+  if (!jsontok_parse_number(cursor->allocator, &cursor->ptr, cursor->end, &token, error)) return 0;
+  if (token.type == JSON_NUMBER) {
+    *number = token.as_number;
+  } else {
+    *number = token.unsigned_integer ? (double)token.as_unsigned : (double)token.as_integer;
+  }
+  cursor->pending = 0;
+  return 1;
+}
+
+int jsontok_cursor_get_integer(struct JsonCursor *cursor, int64_t *integer, enum JsonError *error) {
+  if (!cursor_value(cursor, error)) return 0;
+  if (*cursor->ptr != '-' && (*cursor->ptr < '0' || *cursor->ptr > '9')) return cursor_fail(JSON_ETYPE, error);
+  const char *start = cursor->ptr;
+  struct JsonToken token;
+  if (!jsontok_parse_number(cursor->allocator, &cursor->ptr, cursor->end, &token, error)) return 0;
+  if (token.type != JSON_INTEGER || token.unsigned_integer) {
+    cursor->ptr = start;
+    return cursor_fail(JSON_ETYPE, error);
+  }
+  *integer = token.as_integer;
+  cursor->pending = 0;
+  return 1;
+}
+
+int jsontok_cursor_get_boolean(struct JsonCursor *cursor, unsigned char *boolean, enum JsonError *error) {
+  if (!cursor_value(cursor, error)) return 0;
+  if (*cursor->ptr != 't' && *cursor->ptr != 'f') return cursor_fail(JSON_ETYPE, error);
+  const char *value_end = cursor_value_end(cursor);
+  if (!value_end) return cursor_fail(JSON_EFMT, error);
+  *boolean = *cursor->ptr == 't';
+  cursor->ptr = value_end;
+  cursor->pending = 0;
+  return 1;
+}
+
+int jsontok_cursor_get_raw(struct JsonCursor *cursor, struct JsonStringView *raw, enum JsonError *error) {
+  if (!cursor_value(cursor, error)) return 0;
+  const char *value_end = cursor_value_end(cursor);
+  if (!value_end) return cursor_fail(JSON_EFMT, error);
+  raw->data = cursor->ptr;
+  raw->length = value_end - cursor->ptr;
+  cursor->ptr = value_end;
+  cursor->pending = 0;
+  return 1;
+}
+
+#define JSON_TAPE_PAYLOAD_MASK ((((uint64_t)1) << 56) - 1)
+#define JSON_TAPE_ENTRY(tag, payload) (((uint64_t)(unsigned char)(tag) << 56) | ((uint64_t)(payload) & JSON_TAPE_PAYLOAD_MASK))
+#define JSON_TAPE_TAG(entry) ((unsigned char)((entry) >> 56))
+#define JSON_TAPE_COUNT_MAX 0xFFFFFF
+
+struct JsonTape {
+  size_t count;
+  const char *strings;
+  const struct Allocator *allocator;
+  uint64_t entries[1];
+};
+
+struct TapeBuilder {
+  const struct Allocator *allocator;
+  struct JsonTape *tape;
+  size_t capacity;
+  char *strings;
+  size_t strings_length;
+  size_t strings_capacity;
+  size_t starts[JSONTOK_CURSOR_MAX_DEPTH];
+  size_t counts[JSONTOK_CURSOR_MAX_DEPTH];
+};
+
+static int tape_reserve(struct TapeBuilder *builder, size_t entries) {
+  if (builder->tape->count + entries <= builder->capacity) return 1;
+  size_t capacity = builder->capacity * 2;
+  while (capacity < builder->tape->count + entries) capacity *= 2;
+  struct JsonTape *tape = allocator_realloc(builder->allocator, builder->tape, sizeof(struct JsonTape) + (capacity - 1) * sizeof(uint64_t));
+  if (!tape) return 0;
+  builder->tape = tape;
+  builder->capacity = capacity;
+  return 1;
+}
+
+static int tape_append(struct TapeBuilder *builder, uint64_t entry) {
+  if (!tape_reserve(builder, 1)) return 0;
+  builder->tape->entries[builder->tape->count++] = entry;
+  return 1;
+}
+
+/* Stores a string as a 32-bit length, its unescaped bytes and a NUL. */
+static int tape_append_string(struct TapeBuilder *builder, const struct JsonToken *view) {
+  size_t length = view->as_view.length;
+  if (length > UINT32_MAX) return 0;
+  size_t needed = builder->strings_length + sizeof(uint32_t) + length + 1;
+  if (needed > builder->strings_capacity) {
+    size_t capacity = builder->strings_capacity ? builder->strings_capacity * 2 : 256;
+    while (capacity < needed) capacity *= 2;
+    char *strings = allocator_realloc(builder->allocator, builder->strings, capacity);
+    if (!strings) return 0;
+    builder->strings = strings;
+    builder->strings_capacity = capacity;
+  }
+  size_t offset = builder->strings_length;
+  char *dest = builder->strings + offset + sizeof(uint32_t);
+  uint32_t stored = view->escaped ? unescape_string(view->as_view.data, length, dest) : length;
+  if (!view->escaped) memcpy(dest, view->as_view.data, length);
+  memcpy(builder->strings + offset, &stored, sizeof(uint32_t));
+  dest[stored] = '\0';
+  builder->strings_length = offset + sizeof(uint32_t) + stored + 1;
+  return tape_append(builder, JSON_TAPE_ENTRY('"', offset));
+}
+
+static int tape_append_scalar(struct TapeBuilder *builder, struct JsonCursor *cursor, enum JsonType type, enum JsonError *error) {
+  struct JsonToken token;
+  switch (type) {
+    case JSON_STRING:
+      if (!jsontok_cursor_get_string_view(cursor, &token, error)) return 0;
+      if (!tape_append_string(builder, &token)) return cursor_fail(JSON_ENOMEM, error);
+      return 1;
+    case JSON_BOOLEAN: {
+      unsigned char boolean;
+      if (!jsontok_cursor_get_boolean(cursor, &boolean, error)) return 0;
+      if (!tape_append(builder, JSON_TAPE_ENTRY(boolean ? 't' : 'f', 0))) return cursor_fail(JSON_ENOMEM, error);
+      return 1;
+    }
+    case JSON_NULL:
+      if (!jsontok_cursor_skip_value(cursor, error)) return 0;
+      if (!tape_append(builder, JSON_TAPE_ENTRY('n', 0))) return cursor_fail(JSON_ENOMEM, error);
+      return 1;
+    default: {
+      if (!jsontok_parse_number(cursor->allocator, &cursor->ptr, cursor->end, &token, error)) return 0;
+      cursor->pending = 0;
+      if (!tape_reserve(builder, 2)) return cursor_fail(JSON_ENOMEM, error);
+      uint64_t *entries = builder->tape->entries + builder->tape->count;
+      if (token.type == JSON_NUMBER) {
+        entries[0] = JSON_TAPE_ENTRY('d', 0);
+        memcpy(&entries[1], &token.as_number, sizeof(double));
+      } else {
+        entries[0] = JSON_TAPE_ENTRY(token.unsigned_integer ? 'u' : 'l', 0);
+        entries[1] = token.as_unsigned;
+      }
+      builder->tape->count += 2;
+      return 1;
+    }
+  }
+}
+
+/**
+ * Builds the tape with a pull cursor. Containers are written as a start
+ * entry holding the index just past their end entry and their member count,
+ * and an end entry pointing back at the start.
+ */
+static int tape_build(struct TapeBuilder *builder, struct JsonCursor *cursor, enum JsonError *error) {
+  for (;;) {
+    enum JsonType type;
+    if (!jsontok_cursor_peek(cursor, &type, error)) return 0;
+    if (type == JSON_OBJECT || type == JSON_ARRAY) {
+      if (!cursor_enter(cursor, type == JSON_OBJECT ? '{' : '[', error)) return 0;
+      builder->starts[cursor->depth - 1] = builder->tape->count;
+      builder->counts[cursor->depth - 1] = 0;
+      if (!tape_append(builder, JSON_TAPE_ENTRY(type == JSON_OBJECT ? '{' : '[', 0))) return cursor_fail(JSON_ENOMEM, error);
+    } else if (!tape_append_scalar(builder, cursor, type, error)) {
+      return 0;
+    }
+    for (;;) {
+      if (!cursor->depth) return 1;
+      size_t depth = cursor->depth;
+      char open = cursor->containers[depth - 1];
+      enum JsonError next_error = JSON_ENOERR;
+      int more;
+      if (open == '{') {
+        struct JsonToken key;
+        more = jsontok_cursor_next_field(cursor, &key.as_view, &next_error);
+        key.escaped = more && memchr(key.as_view.data, '\\', key.as_view.length) != NULL;
+        if (more && !tape_append_string(builder, &key)) return cursor_fail(JSON_ENOMEM, error);
+      } else {
+        more = jsontok_cursor_next(cursor, &next_error);
+      }
+      if (next_error != JSON_ENOERR) return cursor_fail(next_error, error);
+      if (more) {
+        builder->counts[depth - 1]++;
+        break;
+      }
+      size_t start = builder->starts[depth - 1];
+      size_t count = builder->counts[depth - 1];
+      if (count > JSON_TAPE_COUNT_MAX) count = JSON_TAPE_COUNT_MAX;
+      if (!tape_append(builder, JSON_TAPE_ENTRY(open == '{' ? '}' : ']', start))) return cursor_fail(JSON_ENOMEM, error);
+      builder->tape->entries[start] = JSON_TAPE_ENTRY(open, ((uint64_t)count << 32) | builder->tape->count);
     }
-    if (*ptr == '{')
-      counter++;
-    else if (*ptr == '}')
-      counter--;
-    ptr += (*ptr == '\\') + 1;
   }
-  size_t length = ptr - *json_string + 1;
-  char *substr = malloc(length + 1);
-  if (!substr) {
+}
+
+struct JsonTape *jsontok_parse_tape(const char *json_string, enum JsonError *error) {
+  return jsontok_parse_tape_allocator(json_string, NULL, error);
+}
+
+struct JsonTape *jsontok_parse_tape_allocator(const char *json_string, const struct Allocator *allocator, enum JsonError *error) {
+  struct TapeBuilder builder;
+  if (!json_string) {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  builder.allocator = allocator;
+  builder.capacity = 64;
+  builder.tape = allocator_alloc(allocator, sizeof(struct JsonTape) + (builder.capacity - 1) * sizeof(uint64_t));
+  builder.strings = NULL;
+  builder.strings_length = 0;
+  builder.strings_capacity = 0;
+  if (!builder.tape) {
     *error = JSON_ENOMEM;
     return NULL;
   }
-  strncpy(substr, *json_string, length);
-  substr[length] = '\0';
-  *json_string = ptr + 1;
-  return substr;
+  builder.tape->count = 0;
+  struct JsonCursor cursor;
+  jsontok_cursor_init_allocator(&cursor, json_string, strlen(json_string), allocator);
+  if (!tape_build(&builder, &cursor, error)) {
+    allocator_free(allocator, builder.tape);
+    allocator_free(allocator, builder.strings);
+    return NULL;
+  }
+  cursor_skip_whitespace(&cursor);
+  if (cursor.ptr != cursor.end) {
+    allocator_free(allocator, builder.tape);
+    allocator_free(allocator, builder.strings);
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  /* A zero tag terminates the tape; the strings follow it in the same block. */
+  if (!tape_append(&builder, 0)) {
+    allocator_free(allocator, builder.tape);
+    allocator_free(allocator, builder.strings);
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  size_t entries_size = sizeof(struct JsonTape) + (builder.tape->count - 1) * sizeof(uint64_t);
+  struct JsonTape *tape = allocator_realloc(allocator, builder.tape, entries_size + builder.strings_length);
+  if (!tape) {
+    allocator_free(allocator, builder.tape);
+    allocator_free(allocator, builder.strings);
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  if (builder.strings_length) memcpy((char *)tape + entries_size, builder.strings, builder.strings_length);
+  allocator_free(allocator, builder.strings);
+  tape->strings = (const char *)tape + entries_size;
+  tape->allocator = allocator;
+  return tape;
 }
 
-static char *jsontok_parse_sub_array(const char **json_string, enum JsonError *error) {
-  const char *ptr = *json_string;
-  if (*ptr != '[') {
-    *error = JSON_EFMT;
+void jsontok_tape_free(struct JsonTape *tape) {
+  if (tape) allocator_free(tape->allocator, tape);
+}
+
+const uint64_t *jsontok_tape_root(const struct JsonTape *tape) {
+  return tape->entries;
+}
+
+enum JsonType jsontok_tape_type(const uint64_t *entry) {
+  switch (JSON_TAPE_TAG(*entry)) {
+    case '{': return JSON_OBJECT;
+    case '[': return JSON_ARRAY;
+    case '"': return JSON_STRING;
+    case 'l':
+    case 'u': return JSON_INTEGER;
+    case 'd': return JSON_NUMBER;
+    case 't':
+    case 'f': return JSON_BOOLEAN;
+    default: return JSON_NULL;
+  }
+}
+
+const uint64_t *jsontok_tape_child(const uint64_t *container) {
+  unsigned char tag = JSON_TAPE_TAG(*container);
+  if (tag != '{' && tag != '[') return NULL;
+  tag = JSON_TAPE_TAG(container[1]);
+  return tag == '}' || tag == ']' ? NULL : container + 1;
+}
+
+const uint64_t *jsontok_tape_next(const struct JsonTape *tape, const uint64_t *entry) {
+  const uint64_t *next;
+  switch (JSON_TAPE_TAG(*entry)) {
+    case '{':
+    case '[':
+      next = tape->entries + (uint32_t)*entry;
+      break;
+    case 'l':
+    case 'u':
+    case 'd':
+      next = entry + 2;
+      break;
+    default:
+      next = entry + 1;
+      break;
+  }
+  unsigned char tag = JSON_TAPE_TAG(*next);
+  return tag == '}' || tag == ']' || tag == 0 ? NULL : next;
+}
+
+size_t jsontok_tape_count(const struct JsonTape *tape, const uint64_t *container) {
+  unsigned char tag = JSON_TAPE_TAG(*container);
+  if (tag != '{' && tag != '[') return 0;
+  size_t count = (*container & JSON_TAPE_PAYLOAD_MASK) >> 32;
+  if (count < JSON_TAPE_COUNT_MAX) return count;
+  const uint64_t *entry = jsontok_tape_child(container);
+  for (count = 0; entry; count++) {
+    entry = jsontok_tape_next(tape, entry);
+    if (tag == '{') entry = jsontok_tape_next(tape, entry);
+  }
+  return count;
+}
+
+const char *jsontok_tape_string(const struct JsonTape *tape, const uint64_t *entry, size_t *length) {
+  if (JSON_TAPE_TAG(*entry) != '"') return NULL;
+  const char *string = tape->strings + (*entry & JSON_TAPE_PAYLOAD_MASK);
+  uint32_t stored;
+  memcpy(&stored, string, sizeof(uint32_t));
+  if (length) *length = stored;
+  return string + sizeof(uint32_t);
+}
+
+int64_t jsontok_tape_integer(const uint64_t *entry) {
+  if (JSON_TAPE_TAG(*entry) == 'd') {
+    double number;
+    memcpy(&number, &entry[1], sizeof(double));
+    return (int64_t)number;
+  }
+  return (int64_t)entry[1];
+}
+
+double jsontok_tape_number(const uint64_t *entry) {
+  switch (JSON_TAPE_TAG(*entry)) {
+    case 'l': return (double)(int64_t)entry[1];
+    case 'u': return (double)entry[1];
+    case 'd': {
+      double number;
+      memcpy(&number, &entry[1], sizeof(double));
+      return number;
+    }
+    default: return 0;
+  }
+}
+
+unsigned char jsontok_tape_boolean(const uint64_t *entry) {
+  return JSON_TAPE_TAG(*entry) == 't';
+}
+
+const uint64_t *jsontok_tape_get(const struct JsonTape *tape, const uint64_t *object, const char *key) {
+  if (JSON_TAPE_TAG(*object) != '{') return NULL;
+  size_t length = strlen(key);
+  const uint64_t *entry = jsontok_tape_child(object);
+  while (entry) {
+    size_t entry_length = 0;
+    const char *name = jsontok_tape_string(tape, entry, &entry_length);
+    if (entry_length == length && memcmp(name, key, length) == 0) return entry + 1;
+    entry = jsontok_tape_next(tape, entry + 1);
+  }
+  return NULL;
+}
+
+const uint64_t *jsontok_tape_index(const struct JsonTape *tape, const uint64_t *array, size_t index) {
+  if (JSON_TAPE_TAG(*array) != '[') return NULL;
+  const uint64_t *entry = jsontok_tape_child(array);
+  while (entry && index--) entry = jsontok_tape_next(tape, entry);
+  return entry;
+}
+
+static void writer_init(struct JsonWriter *writer) {
+  writer->buffer = writer->inline_buffer;
+  writer->length = 0;
+  writer->capacity = JSONTOK_WRITER_BUFFER_SIZE;
+  writer->growable = 0;
+  writer->comma = 0;
+  writer->file = NULL;
+  writer->fd = -1;
+  writer->error = JSON_ENOERR;
+  writer->allocator = NULL;
+}
+
+void jsontok_writer_init(struct JsonWriter *writer) {
+  jsontok_writer_init_allocator(writer, NULL);
+}
+
+void jsontok_writer_init_allocator(struct JsonWriter *writer, const struct Allocator *allocator) {
+  writer_init(writer);
+  writer->growable = 1;
+  writer->allocator = allocator;
+}
+
+void jsontok_writer_init_buffer(struct JsonWriter *writer, char *buffer, size_t capacity) {
+  writer_init(writer);
+  writer->buffer = buffer;
+  writer->capacity = capacity;
+}
+
+void jsontok_writer_init_file(struct JsonWriter *writer, FILE *file) {
+  writer_init(writer);
+  writer->file = file;
+}
+
+void jsontok_writer_init_fd(struct JsonWriter *writer, int fd) {
+  writer_init(writer);
+  writer->fd = fd;
+}
+
+static int writer_drain(struct JsonWriter *writer, const char *data, size_t length) {
+  if (writer->file) {
+    if (fwrite(data, 1, length, writer->file) != length) return 0;
+    return 1;
+  }
+  while (length) {
+    ssize_t written = write(writer->fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    data += written;
+    length -= written;
+  }
+  return 1;
+}
+
+static int writer_flush(struct JsonWriter *writer) {
+  if (!writer->length) return 1;
+  if (!writer_drain(writer, writer->buffer, writer->length)) {
+    writer->error = JSON_EIO;
+    return 0;
+  }
+  writer->length = 0;
+  return 1;
+}
+
+/* Makes room for `length` more bytes, keeping one spare for the final NUL. */
+static int writer_reserve(struct JsonWriter *writer, size_t length) {
+  if (writer->error) return 0;
+  if (writer->length + length < writer->capacity) return 1;
+  if (writer->file || writer->fd >= 0) {
+    if (!writer_flush(writer)) return 0;
+    return length < writer->capacity;
+  }
+  if (!writer->growable) {
+    writer->error = JSON_ENOMEM;
+    return 0;
+  }
+  size_t capacity = writer->capacity * 2;
+  while (writer->length + length >= capacity) capacity *= 2;
+  char *buffer = writer->buffer == writer->inline_buffer ? allocator_alloc(writer->allocator, capacity) : allocator_realloc(writer->allocator, writer->buffer, capacity);
+  if (!buffer) {
+    writer->error = JSON_ENOMEM;
+    return 0;
+  }
+  if (writer->buffer == writer->inline_buffer) memcpy(buffer, writer->inline_buffer, writer->length);
+  writer->buffer = buffer;
+  writer->capacity = capacity;
+  return 1;
+}
+
+static void writer_put(struct JsonWriter *writer, const char *data, size_t length) {
+  if (!writer_reserve(writer, length)) {
+    /* Streams pass chunks larger than the buffer straight through. */
+    if (!writer->error && !writer_drain(writer, data, length)) writer->error = JSON_EIO;
+    return;
+  }
+  memcpy(writer->buffer + writer->length, data, length);
+  writer->length += length;
+}
+
+static void writer_put_char(struct JsonWriter *writer, char c) {
+  if (writer->length + 1 < writer->capacity && !writer->error) {
+    writer->buffer[writer->length++] = c;
+    return;
+  }
+  writer_put(writer, &c, 1);
+}
+
+static void writer_separate(struct JsonWriter *writer) {
+  if (writer->comma) writer_put_char(writer, ',');
+  writer->comma = 1;
+}
+
+void jsontok_writer_object_start(struct JsonWriter *writer) {
+  writer_separate(writer);
+  writer_put_char(writer, '{');
+  writer->comma = 0;
+}
+
+void jsontok_writer_object_end(struct JsonWriter *writer) {
+  writer_put_char(writer, '}');
+  writer->comma = 1;
+}
+
+void jsontok_writer_array_start(struct JsonWriter *writer) {
+  writer_separate(writer);
+  writer_put_char(writer, '[');
+  writer->comma = 0;
+}
+
+void jsontok_writer_array_end(struct JsonWriter *writer) {
+  writer_put_char(writer, ']');
+  writer->comma = 1;
+}
+
+static void writer_escaped(struct JsonWriter *writer, const char *string, size_t length) {
+  static const char hex[] = "0123456789abcdef";
+  const char *end = string + length, *run = string;
+  writer_put_char(writer, '"');
+  while (string < end) {
+    unsigned char c = *string;
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      string++;
+      continue;
+    }
+    if (string > run) writer_put(writer, run, string - run);
+    char escape[6] = {'\\', 0, '0', '0', 0, 0};
+    size_t escape_length = 2;
+    switch (c) {
+      case '"': escape[1] = '"'; break;
+      case '\\': escape[1] = '\\'; break;
+      case '\b': escape[1] = 'b'; break;
+      case '\f': escape[1] = 'f'; break;
+      case '\n': escape[1] = 'n'; break;
+      case '\r': escape[1] = 'r'; break;
+      case '\t': escape[1] = 't'; break;
+      default:
+        escape[1] = 'u';
+        escape[4] = hex[c >> 4];
+        escape[5] = hex[c & 15];
+        escape_length = 6;
+        break;
+    }
+    writer_put(writer, escape, escape_length);
+    run = ++string;
+  }
+  if (string > run) writer_put(writer, run, string - run);
+  writer_put_char(writer, '"');
+}
+
+void jsontok_writer_key(struct JsonWriter *writer, const char *key) {
+  writer_separate(writer);
+  writer_escaped(writer, key, strlen(key));
+  writer_put_char(writer, ':');
+  writer->comma = 0;
+}
+
+void jsontok_writer_string(struct JsonWriter *writer, const char *string) {
+  jsontok_writer_string_n(writer, string, strlen(string));
+}
+
+void jsontok_writer_string_n(struct JsonWriter *writer, const char *string, size_t length) {
+  writer_separate(writer);
+  writer_escaped(writer, string, length);
+}
+
+static void writer_digits(struct JsonWriter *writer, uint64_t value, unsigned char negative) {
+  char digits[21];
+  char *ptr = digits + sizeof(digits);
+  do {
+    *--ptr = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  if (negative) *--ptr = '-';
+  writer_separate(writer);
+  writer_put(writer, ptr, digits + sizeof(digits) - ptr);
+}
+
+void jsontok_writer_integer(struct JsonWriter *writer, int64_t integer) {
+  writer_digits(writer, integer < 0 ? 0 - (uint64_t)integer : (uint64_t)integer, integer < 0);
+}
+
+void jsontok_writer_unsigned(struct JsonWriter *writer, uint64_t integer) {
+  writer_digits(writer, integer, 0);
+}
+
+void jsontok_writer_number(struct JsonWriter *writer, double number) {
+  if (number != number || number > DBL_MAX || number < -DBL_MAX) {
+    if (!writer->error) writer->error = JSON_ETYPE;
+    return;
+  }
+  /* Use the shortest precision that reads back as the same double. */
+  char digits[32];
+  int precision, length = 0;
+  for (precision = 15; precision <= 17; precision++) {
+    length = sprintf(digits, "%.*g", precision, number);
+    if (strtod(digits, NULL) == number) break;
+  }
+  writer_separate(writer);
+  writer_put(writer, digits, length);
+}
+
+void jsontok_writer_boolean(struct JsonWriter *writer, unsigned char boolean) {
+  writer_separate(writer);
+  if (boolean) {
+    writer_put(writer, "true", 4);
+  } else {
+    writer_put(writer, "false", 5);
+  }
+}
+
+void jsontok_writer_null(struct JsonWriter *writer) {
+  writer_separate(writer);
+  writer_put(writer, "null", 4);
+}
+
+void jsontok_writer_raw(struct JsonWriter *writer, const char *json, size_t length) {
+  writer_separate(writer);
+  writer_put(writer, json, length);
+}
+
+char *jsontok_writer_finish(struct JsonWriter *writer, size_t *length, enum JsonError *error) {
+  if (!writer->error && (writer->file || writer->fd >= 0)) {
+    writer_flush(writer);
+    if (!writer->error && writer->file && fflush(writer->file)) writer->error = JSON_EIO;
+    if (!writer->error) return NULL;
+  }
+  if (writer->error) {
+    *error = writer->error;
     return NULL;
   }
-  ptr++;
-  size_t counter = 1;
-  while (counter > 0) {
-    if (*ptr == '\0') {
-      *error = JSON_EFMT;
-      return NULL;
+  if (!writer->capacity) {
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  writer->buffer[writer->length] = '\0';
+  if (length) *length = writer->length;
+  return writer->buffer;
+}
+
+void jsontok_writer_free(struct JsonWriter *writer) {
+  if (writer->growable && writer->buffer != writer->inline_buffer) allocator_free(writer->allocator, writer->buffer);
+  writer->buffer = writer->inline_buffer;
+  writer->length = 0;
+  writer->capacity = JSONTOK_WRITER_BUFFER_SIZE;
+}
+
+struct ParallelJob {
+  const struct Allocator *allocator;
+  const char *base;
+  struct JsonSpan *spans;
+  struct JsonToken **elements;
+  size_t count;
+  size_t next;
+  enum JsonError error;
+};
+
+/**
+ * Claims batches of elements until none are left or another worker failed.
+ * Each element is parsed from the span the split pass found, so object and
+ * array elements come out expanded rather than wrapped.
+ */
+static void *parallel_worker(void *argument) {
+  struct ParallelJob *job = argument;
+  struct JsonParser parser;
+  parser.arena = NULL;
+  parser.allocator = job->allocator;
+  parser.strings = JSON_STRINGS_COPY;
+  parser.base = job->base;
+  for (;;) {
+    size_t first = __sync_fetch_and_add(&job->next, JSON_PARALLEL_BATCH);
+    if (first >= job->count || job->error) break;
+    size_t last = first + JSON_PARALLEL_BATCH < job->count ? first + JSON_PARALLEL_BATCH : job->count;
+    size_t i;
+    for (i = first; i < last; i++) {
+      enum JsonError error = JSON_ENOERR;
+      const char *start = job->base + job->spans[i].offset;
+      job->elements[i] = jsontok_parse_root(&parser, start, start + job->spans[i].length, &error);
+      if (!job->elements[i]) {
+        __sync_bool_compare_and_swap(&job->error, JSON_ENOERR, error);
+        break;
+      }
     }
-    if (*ptr == '[')
-      counter++;
-    else if (*ptr == ']')
-      counter--;
-    ptr++;
-    if (*(ptr - 1) == '\\' && *ptr != '\0') ptr++;
   }
-  size_t length = ptr - *json_string;
-  char *substr = malloc(length + 1);
-  if (!substr) {
+  return NULL;
+}
+
+/**
+ * Finds the span of each element of a top-level array, relative to base. The
+ * cursor matches brackets and strings with the SIMD scanner, so this pass is
+ * much cheaper than parsing the elements.
+ */
+static struct JsonSpan *parallel_split(const struct Allocator *allocator, const char *base, const char *json_string, const char *end, size_t *count, enum JsonError *error) {
+  struct JsonCursor cursor;
+  struct JsonStringView raw;
+  size_t capacity = 64;
+  struct JsonSpan *spans = allocator_alloc(allocator, capacity * sizeof(struct JsonSpan));
+  if (!spans) {
     *error = JSON_ENOMEM;
     return NULL;
   }
-  strncpy(substr, *json_string, length);
-  substr[length] = '\0';
-  *json_string = ptr;
-  return substr;
+  *count = 0;
+  jsontok_cursor_init_allocator(&cursor, json_string, end - json_string, allocator);
+  enum JsonError cursor_error = JSON_ENOERR;
+  if (!jsontok_cursor_enter_array(&cursor, &cursor_error)) {
+    allocator_free(allocator, spans);
+    *error = cursor_error;
+    return NULL;
+  }
+  while (jsontok_cursor_next(&cursor, &cursor_error)) {
+    if (!jsontok_cursor_get_raw(&cursor, &raw, &cursor_error)) break;
+    if (*count == capacity) {
+      capacity *= 2;
+      struct JsonSpan *new_spans = allocator_realloc(allocator, spans, capacity * sizeof(struct JsonSpan));
+      if (!new_spans) {
+        cursor_error = JSON_ENOMEM;
+        break;
+      }
+      spans = new_spans;
+    }
+    spans[*count].offset = raw.data - base;
+    spans[*count].length = raw.length;
+    (*count)++;
+  }
+  cursor_skip_whitespace(&cursor);
+  if (!cursor_error && cursor.ptr != cursor.end) cursor_error = JSON_EFMT;
+  if (cursor_error) {
+    allocator_free(allocator, spans);
+    *error = cursor_error;
+    return NULL;
+  }
+  return spans;
+}
+
+struct JsonToken *jsontok_parse_parallel(const char *json_string, size_t threads, enum JsonError *error) {
+  return jsontok_parse_parallel_allocator(json_string, threads, NULL, error);
+}
+
+struct JsonToken *jsontok_parse_parallel_allocator(const char *json_string, size_t threads, const struct Allocator *allocator, enum JsonError *error) {
+  if (!json_string) {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  const char *ptr = json_string;
+  while (IS_WHITESPACE(*ptr)) ptr++;
+  if (*ptr != '[') return jsontok_parse_allocator(json_string, strlen(json_string), allocator, error);
+  if (!threads) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (size_t)online : 1;
+  }
+  if (threads > JSON_PARALLEL_MAX_THREADS) threads = JSON_PARALLEL_MAX_THREADS;
+
+  const char *end = ptr + strlen(ptr);
+  struct ParallelJob job;
+  job.spans = parallel_split(allocator, json_string, ptr, end, &job.count, error);
+  if (!job.spans) return NULL;
+  if (!job.count) {
+    allocator_free(allocator, job.spans);
+    return jsontok_parse_allocator(json_string, end - json_string, allocator, error);
+  }
+  /* Small arrays are parsed the same way, only on the calling thread. */
+  if (job.count < JSON_PARALLEL_THRESHOLD) threads = 1;
+
+  struct JsonToken *token = allocator_alloc(allocator, sizeof(struct JsonToken));
+  struct JsonArray *array = allocator_alloc(allocator, sizeof(struct JsonArray));
+  job.elements = allocator_alloc(allocator, job.count * sizeof(struct JsonToken *));
+  if (!token || !array || !job.elements) {
+    allocator_free(allocator, token);
+    allocator_free(allocator, array);
+    allocator_free(allocator, job.elements);
+    allocator_free(allocator, job.spans);
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  memset(job.elements, 0, job.count * sizeof(struct JsonToken *));
+  job.next = 0;
+  job.allocator = allocator;
+  job.base = json_string;
+  job.error = JSON_ENOERR;
+
+  /* The calling thread works too, so only threads - 1 are spawned. */
+  pthread_t workers[JSON_PARALLEL_MAX_THREADS];
+  size_t spawned = 0;
+  while (spawned < threads - 1 && pthread_create(&workers[spawned], NULL, parallel_worker, &job) == 0) spawned++;
+  parallel_worker(&job);
+  size_t i;
+  for (i = 0; i < spawned; i++) pthread_join(workers[i], NULL);
+  allocator_free(allocator, job.spans);
+
+  if (job.error) {
+    for (i = 0; i < job.count; i++) jsontok_free_allocator(job.elements[i], allocator);
+    allocator_free(allocator, job.elements);
+    allocator_free(allocator, array);
+    allocator_free(allocator, token);
+    *error = job.error;
+    return NULL;
+  }
+  array->length = job.count;
+  array->elements = job.elements;
+  token->type = JSON_ARRAY;
+  token->escaped = 0;
+  token->as_array = array;
+  return token;
+}
+
+int jsontok_span_count(const char *buffer, struct JsonSpan span, size_t *count, enum JsonError *error) {
+  struct JsonCursor cursor;
+  enum JsonType type;
+  jsontok_cursor_init(&cursor, buffer + span.offset, span.length);
+  if (!jsontok_cursor_peek(&cursor, &type, error)) return 0;
+  if (type != JSON_OBJECT && type != JSON_ARRAY) return cursor_fail(JSON_ETYPE, error);
+  if (!cursor_enter(&cursor, type == JSON_OBJECT ? '{' : '[', error)) return 0;
+  enum JsonError next_error = JSON_ENOERR;
+  *count = 0;
+  if (type == JSON_OBJECT) {
+    while (jsontok_cursor_next_field(&cursor, NULL, &next_error)) (*count)++;
+  } else {
+    while (jsontok_cursor_next(&cursor, &next_error)) (*count)++;
+  }
+  if (next_error) return cursor_fail(next_error, error);
+  return 1;
+}
+
+int jsontok_span_element(const char *buffer, struct JsonSpan span, size_t index, struct JsonSpan *element, enum JsonError *error) {
+  struct JsonCursor cursor;
+  struct JsonStringView raw;
+  jsontok_cursor_init(&cursor, buffer + span.offset, span.length);
+  if (!jsontok_cursor_enter_array(&cursor, error)) return 0;
+  for (;;) {
+    if (!jsontok_cursor_next(&cursor, error)) return 0;
+    if (!index--) break;
+  }
+  if (!jsontok_cursor_get_raw(&cursor, &raw, error)) return 0;
+  element->offset = raw.data - buffer;
+  element->length = raw.length;
+  return 1;
+}
+
+enum JsonPathStep {
+  JSON_PATH_KEY,
+  JSON_PATH_INDEX,
+  JSON_PATH_ANY,
+};
+
+/* Index steps keep their text too, since "0" may also name an object key. */
+struct JsonPathSegment {
+  enum JsonPathStep step;
+  const char *key;
+  size_t key_length;
+  size_t index;
+};
+
+/* One allocation: the segments, followed by their unescaped keys. */
+struct JsonPath {
+  const struct Allocator *allocator;
+  size_t count;
+  struct JsonPathSegment segments[1];
+};
+
+struct JsonPathWalk {
+  const struct JsonPath *path;
+  int (*callback)(void *user, struct JsonCursor *cursor);
+  void *user;
+  unsigned char stopped;
+};
+
+struct JsonPath *jsontok_path_compile(const char *path, enum JsonError *error) {
+  return jsontok_path_compile_allocator(path, NULL, error);
+}
+
+struct JsonPath *jsontok_path_compile_allocator(const char *path, const struct Allocator *allocator, enum JsonError *error) {
+  size_t length = strlen(path), count = 0, i;
+  if (length && path[0] != '/') {
+    *error = JSON_EFMT;
+    return NULL;
+  }
+  for (i = 0; i < length; i++) count += path[i] == '/';
+  struct JsonPath *compiled = allocator_alloc(allocator, sizeof(struct JsonPath) + count * sizeof(struct JsonPathSegment) + length);
+  if (!compiled) {
+    *error = JSON_ENOMEM;
+    return NULL;
+  }
+  char *keys = (char *)&compiled->segments[count ? count : 1];
+  const char *ptr = path;
+  compiled->allocator = allocator;
+  compiled->count = count;
+  for (i = 0; i < count; i++) {
+    struct JsonPathSegment *segment = &compiled->segments[i];
+    const char *start = ++ptr;
+    segment->key = keys;
+    /* RFC 6901 escapes: ~0 is '~' and ~1 is '/'. */
+    while (*ptr && *ptr != '/') {
+      if (*ptr == '~') {
+        if (ptr[1] != '0' && ptr[1] != '1') {
+          allocator_free(allocator, compiled);
+          *error = JSON_EFMT;
+          return NULL;
+        }
+        *keys++ = ptr[1] == '0' ? '~' : '/';
+        ptr += 2;
+      } else {
+        *keys++ = *ptr++;
+      }
+    }
+    segment->key_length = keys - segment->key;
+    segment->step = JSON_PATH_KEY;
+    if (ptr - start == 1 && *start == '*') {
+      segment->step = JSON_PATH_ANY;
+    } else if (ptr > start && ptr - start < 20 && (*start != '0' || ptr - start == 1)) {
+      const char *digit = start;
+      segment->index = 0;
+      while (digit < ptr && *digit >= '0' && *digit <= '9') segment->index = segment->index * 10 + (*digit++ - '0');
+      if (digit == ptr) segment->step = JSON_PATH_INDEX;
+    }
+  }
+  return compiled;
+}
+
+void jsontok_path_free(struct JsonPath *path) {
+  if (path) allocator_free(path->allocator, path);
+}
+
+/* Returns 0 on failure or once the callback has asked to stop. */
+static int path_walk(struct JsonPathWalk *walk, struct JsonCursor *cursor, size_t depth, enum JsonError *error) {
+  enum JsonError next_error = JSON_ENOERR;
+  if (depth == walk->path->count) {
+    size_t cursor_depth = cursor->depth;
+    if (walk->callback(walk->user, cursor)) {
+      walk->stopped = 1;
+      return 0;
+    }
+    /* Step past whatever part of the match the callback did not read. */
+    while (cursor->depth > cursor_depth) {
+      if (!jsontok_cursor_leave(cursor, error)) return 0;
+    }
+    return !cursor->pending || jsontok_cursor_skip_value(cursor, error);
+  }
+  const struct JsonPathSegment *segment = &walk->path->segments[depth];
+  enum JsonType type;
+  if (!jsontok_cursor_peek(cursor, &type, error)) return 0;
+  if (type == JSON_OBJECT) {
+    struct JsonStringView key;
+    if (!cursor_enter(cursor, '{', error)) return 0;
+    while (jsontok_cursor_next_field(cursor, &key, &next_error)) {
+      if (segment->step != JSON_PATH_ANY && !jsontok_view_equals(&key, segment->key, segment->key_length)) continue;
+      if (!path_walk(walk, cursor, depth + 1, error)) return 0;
+      if (segment->step != JSON_PATH_ANY) return jsontok_cursor_leave(cursor, error);
+    }
+    return next_error ? cursor_fail(next_error, error) : 1;
+  }
+  if (type == JSON_ARRAY && segment->step != JSON_PATH_KEY) {
+    size_t index = 0;
+    if (!cursor_enter(cursor, '[', error)) return 0;
+    while (jsontok_cursor_next(cursor, &next_error)) {
+      if (segment->step == JSON_PATH_INDEX && index++ != segment->index) continue;
+      if (!path_walk(walk, cursor, depth + 1, error)) return 0;
+      if (segment->step == JSON_PATH_INDEX) return jsontok_cursor_leave(cursor, error);
+    }
+    return next_error ? cursor_fail(next_error, error) : 1;
+  }
+  return jsontok_cursor_skip_value(cursor, error);
+}
+
+int jsontok_path_eval(const struct JsonPath *path, const char *json_string, size_t length, int (*callback)(void *user, struct JsonCursor *cursor), void *user, enum JsonError *error) {
+  struct JsonCursor cursor;
+  struct JsonPathWalk walk;
+  enum JsonError walk_error = JSON_ENOERR;
+  walk.path = path;
+  walk.callback = callback;
+  walk.user = user;
+  walk.stopped = 0;
+  jsontok_cursor_init_allocator(&cursor, json_string, length, path->allocator);
+  if (!path_walk(&walk, &cursor, 0, &walk_error) && !walk.stopped) return cursor_fail(walk_error, error);
+  return 1;
 }
@@ -1,5 +1,8 @@
 #include <openssl/ssl.h>
 #include <stdio.h>
+#ifndef _WIN32
+#include <signal.h>
+#endif
 #ifdef _WIN32
 #include <windows.h>
 #elif _POSIX_C_SOURCE >= 199309L
@@ -9,8 +12,11 @@
 #endif
 
 #include "discrub_interface.h"
+#include "http2.h"
 #include "input_helpers.h"
 
+#define DELETE_ATTEMPTS 3
+
 /* Credit to @Bernardo Ramos https://stackoverflow.com/a/28827188/20918291 */
 void sleep_ms(int milliseconds) {
 #ifdef WIN32
@@ -27,6 +33,46 @@ void sleep_ms(int milliseconds) {
 #endif
 }
 
+static void print_allocation_stats(const char *label, struct CountingAllocator *counter) {
+  if (!counter) return;
+  printf("[%s] %zu allocations, %zu reallocations, %zu bytes, peak %zu bytes, longest realloc chain %zu\n", label,
+         counter->stats.allocations, counter->stats.reallocations, counter->stats.bytes, counter->stats.peak,
+         counter->stats.longest_realloc_chain);
+  counting_allocator_reset(counter);
+}
+
+static void on_deleted(void *user, enum DiscrubError error) {
+  struct DiscordMessage *message = user;
+  if (error) {
+    fprintf(stderr, "Failed to delete message %s: %s\n", message->id, discrub_strerror(&error));
+    return;
+  }
+  printf("Deleted message %s.\n[%s] %s: %s\n\n", message->id, message->timestamp, message->author_username,
+         message->content);
+}
+
+/* Keeps up to connections deletes in flight at once, still started 1.5 s apart. */
+static void delete_concurrently(SSL_CTX *ctx, size_t connections, struct DiscrubRequests *requests,
+                                struct DiscordMessage *messages, size_t message_count,
+                                const struct Allocator *allocator) {
+  enum HTTPError http_error = HTTP_ENOERR;
+  enum DiscrubError error = DISCRUB_ENOERR;
+  struct EventLoop *loop = event_loop_new(ctx, "discord.com:443", connections, 1500, allocator, &http_error);
+  if (!loop) {
+    fprintf(stderr, "Failed to start event loop: %s\n", http_strerror(&http_error));
+    return;
+  }
+  size_t i;
+  for (i = 0; i < message_count; i++) {
+    if (!discrub_requests_delete_async(loop, requests, messages[i].id, on_deleted, &messages[i], &error)) {
+      fprintf(stderr, "Failed to delete message %s: %s\n", messages[i].id, discrub_strerror(&error));
+      break;
+    }
+  }
+  if (!event_loop_run(loop)) fprintf(stderr, "Event loop failed\n");
+  event_loop_free(loop);
+}
+
 static char *allocate_string(const char *source) {
   if (!source) return NULL;
   char *dest = malloc(strlen(source) + 1);
@@ -66,21 +112,21 @@ int main() {
   }
   char *server_id = allocate_string(server_id_string->as_string);
   struct JsonToken *limit_number = jsontok_get(options_object->as_object, "limit");
-  if (!limit_number || limit_number->type != JSON_NUMBER) {
+  if (!limit_number || limit_number->type != JSON_INTEGER) {
     fprintf(stderr, "Error in options.json: 'limit' is a required key\n");
     free(server_id);
     free(options_string);
     jsontok_free(options_object);
     return 1;
   }
-  if (limit_number->as_number < 0) {
+  if (!limit_number->unsigned_integer && limit_number->as_integer < 0) {
     fprintf(stderr, "Error in options.json: 'limit' cannot be negative\n");
     free(server_id);
     free(options_string);
     jsontok_free(options_object);
     return 1;
   }
-  size_t limit = limit_number->as_number;
+  size_t limit = limit_number->unsigned_integer ? limit_number->as_unsigned : (uint64_t)limit_number->as_integer;
   struct JsonToken *channel_id_string = jsontok_get(options_object->as_object, "channel_id");
   if (!channel_id_string || channel_id_string->type != JSON_STRING) {
     fprintf(stderr, "Error in options.json: 'channel_id' is a required key\n");
@@ -106,9 +152,36 @@ int main() {
   if (pinned_boolean && pinned_boolean->type == JSON_BOOLEAN) {
     search_options.pinned = pinned_boolean->as_boolean;
   }
+  /* With "allocation_stats" set, each search page and delete reports its allocations. */
+  struct CountingAllocator counting_allocator, *counter = NULL;
+  const struct Allocator *allocator = NULL;
+  struct JsonToken *allocation_stats_boolean = jsontok_get(options_object->as_object, "allocation_stats");
+  if (allocation_stats_boolean && allocation_stats_boolean->type == JSON_BOOLEAN && allocation_stats_boolean->as_boolean) {
+    counting_allocator_init(&counting_allocator, NULL);
+    counter = &counting_allocator;
+    allocator = &counting_allocator.allocator;
+  }
+  /* With "pipeline_depth" above 1, that many DELETEs are kept in flight at once. */
+  size_t pipeline_depth = 1;
+  struct JsonToken *pipeline_depth_number = jsontok_get(options_object->as_object, "pipeline_depth");
+  if (pipeline_depth_number && pipeline_depth_number->type == JSON_INTEGER && pipeline_depth_number->as_integer > 0) {
+    pipeline_depth = pipeline_depth_number->as_integer;
+  }
+  /* With "connections" above 1, deletes run concurrently on an event loop. */
+  size_t connections = 1;
+  struct JsonToken *connections_number = jsontok_get(options_object->as_object, "connections");
+  if (connections_number && connections_number->type == JSON_INTEGER && connections_number->as_integer > 0) {
+    connections = connections_number->as_integer;
+  }
+  struct JsonToken *http2_boolean = jsontok_get(options_object->as_object, "http2");
+  bool http2 = http2_boolean && http2_boolean->type == JSON_BOOLEAN && http2_boolean->as_boolean;
   jsontok_free(options_object);
   free(options_string);
 
+#ifndef _WIN32
+  /* Writing to a kept-alive connection the server has closed must fail, not kill us. */
+  signal(SIGPIPE, SIG_IGN);
+#endif
   SSL_library_init();
   SSL_load_error_strings();
   OpenSSL_add_all_algorithms();
@@ -119,6 +192,18 @@ int main() {
     return 1;
   }
 
+  /* Restarts and reconnects resume the last TLS session instead of a full handshake. */
+  if (!tls_session_cache_enable(ctx, ".discrub_session")) {
+    fprintf(stderr, "Failed to initialize SSL context\n");
+    SSL_CTX_free(ctx);
+    return 1;
+  }
+
+  /* With "http2" set, searches and deletes share one multiplexed h2 connection. */
+  if (http2 && !http2_enable(ctx)) {
+    fprintf(stderr, "HTTP/2 support is not compiled in, using HTTP/1.1\n");
+  }
+
   BIO *connection = BIO_new_ssl_connect(ctx);
   if (!connection) {
     fprintf(stderr, "Failed to create SSL connection\n");
@@ -128,7 +213,7 @@ int main() {
 
   BIO_set_conn_hostname(connection, "discord.com:443");
 
-  if (BIO_do_connect(connection) <= 0) {
+  if (!http_connect(connection)) {
     fprintf(stderr, "Failed connection\n");
     BIO_free_all(connection);
     SSL_CTX_free(ctx);
@@ -152,7 +237,7 @@ int main() {
     printf("Enter password: ");
     password = get_password();
 
-    struct LoginResponse *login_response = discrub_login(connection, username, password, &error);
+    struct LoginResponse *login_response = discrub_login(connection, username, password, allocator, &error);
     if (!login_response) {
       fprintf(stderr, "Login failed: %s\n", discrub_strerror(&error));
       free(server_id);
@@ -163,7 +248,7 @@ int main() {
       ERR_free_strings();
       return 1;
     }
-    FILE *file = fopen(".discrub_cache", "w");
+    FILE *file = fopen_private(".discrub_cache");
     if (file) {
       fprintf(file, "%s;%s", login_response->token, login_response->user_id);
       fclose(file);
@@ -172,21 +257,28 @@ int main() {
   printf("\nLogged in successfully.\n");
   search_options.author_id = login_response->user_id;
 
+  /* Searches and deletes are compiled once; each page or batch only fills in IDs. */
+  struct DiscrubRequests *requests = discrub_requests_new(login_response->token, server_id, search_options.channel_id,
+                                                          &search_options, allocator, &error);
+  if (!requests) {
+    fprintf(stderr, "Failed to prepare requests: %s\n", discrub_strerror(&error));
+    free(server_id);
+    free(password);
+    BIO_free_all(connection);
+    SSL_CTX_free(ctx);
+    EVP_cleanup();
+    ERR_free_strings();
+    return 1;
+  }
+
   size_t message_count = 0;
   struct DiscordMessage *messages = NULL;
   while (message_count < limit) {
-    search_options.offset = message_count;
-    struct SearchResponse *search_response = discrub_search(connection, login_response->token, server_id, &search_options, &error);
+    struct SearchResponse *search_response = discrub_requests_search(connection, requests, message_count, &error);
     if (!search_response) {
       size_t i = 0;
-      for (; i < message_count; i++) {
-        struct DiscordMessage *message = &messages[i];
-        free(message->id);
-        free(message->content);
-        free(message->timestamp);
-        free(message->author_id);
-        free(message->author_username);
-      }
+      for (; i < message_count; i++) discrub_free_message(&messages[i], allocator);
+      discrub_requests_free(requests);
       free(messages);
       free(server_id);
       free(password);
@@ -204,14 +296,8 @@ int main() {
     struct DiscordMessage *new_messages = realloc(messages, message_count * sizeof(struct DiscordMessage));
     if (!new_messages) {
       size_t i = 0;
-      for (; i < message_count; i++) {
-        struct DiscordMessage *message = &messages[i];
-        free(message->id);
-        free(message->content);
-        free(message->timestamp);
-        free(message->author_id);
-        free(message->author_username);
-      }
+      for (; i < message_count; i++) discrub_free_message(&messages[i], allocator);
+      discrub_requests_free(requests);
       free(messages);
       free(server_id);
       free(password);
@@ -227,36 +313,65 @@ int main() {
     for (; i < search_response->length; i++) {
       messages[message_count - search_response->length + i] = search_response->messages[i];
     }
-    free(search_response->messages);
-    free(search_response);
+    allocator_free(allocator, search_response->messages);
+    allocator_free(allocator, search_response);
     printf("\rFetched %zu/%zu messages...", message_count, limit);
     fflush(stdout);
+    if (counter) printf("\n");
+    print_allocation_stats("search", counter);
     sleep_ms(1500);
   }
   printf("\rFetched all messages successfully.\n");
   printf("\nDeleting messages...\n\n");
 
-  size_t i = 0;
-  for (; i < message_count; i++) {
-    struct DiscordMessage message = messages[i];
-    printf("Deleting message %s...\n[%s] %s: %s\n", message.id, message.timestamp, message.author_username,
-           message.content);
-    if (discrub_delete_message(connection, login_response->token, search_options.channel_id, message.id, &error)) {
-      fprintf(stderr, "Failed to delete message %s: %s\n", message.id, discrub_strerror(&error));
-      break;
+  /* Messages are deleted in batches of pipeline_depth, re-queuing any the
+   * server did not confirm. */
+  size_t *queue = malloc((message_count + 1) * sizeof(size_t));
+  const char **batch_ids = malloc(pipeline_depth * sizeof(char *));
+  bool *deleted = malloc(pipeline_depth * sizeof(bool));
+  if (!queue || !batch_ids || !deleted) {
+    fprintf(stderr, "Failed to delete messages: Out of memory\n");
+    message_count = 0;
+  }
+  size_t queue_length = message_count, stalled = 0, i;
+  if (connections > 1) {
+    delete_concurrently(ctx, connections, requests, messages, message_count, allocator);
+    queue_length = 0;
+  }
+  for (i = 0; i < queue_length; i++) queue[i] = i;
+  while (queue_length) {
+    size_t batch = queue_length < pipeline_depth ? queue_length : pipeline_depth, kept = 0;
+    for (i = 0; i < batch; i++) batch_ids[i] = messages[queue[i]].id;
+    error = DISCRUB_ENOERR;
+    discrub_requests_delete(connection, requests, batch_ids, batch, pipeline_depth, deleted, &error);
+    for (i = 0; i < batch; i++) {
+      struct DiscordMessage *message = &messages[queue[i]];
+      if (deleted[i]) {
+        printf("Deleted message %s.\n[%s] %s: %s\n\n", message->id, message->timestamp, message->author_username,
+               message->content);
+      } else {
+        queue[kept++] = queue[i];
+      }
     }
-    printf("Deleted message %s successfully.\n\n", message.id);
-    sleep_ms(1500);
+    print_allocation_stats("delete", counter);
+    if (kept == batch) {
+      if (++stalled == DELETE_ATTEMPTS) {
+        fprintf(stderr, "Failed to delete message %s: %s\n", messages[queue[0]].id, discrub_strerror(&error));
+        break;
+      }
+    } else {
+      stalled = 0;
+    }
+    memmove(queue + kept, queue + batch, (queue_length - batch) * sizeof(size_t));
+    queue_length -= batch - kept;
+    sleep_ms(1500 * batch);
   }
+  free(queue);
+  free(batch_ids);
+  free(deleted);
+  discrub_requests_free(requests);
 
-  for (i = 0; i < message_count; i++) {
-    struct DiscordMessage *message = &messages[i];
-    free(message->id);
-    free(message->content);
-    free(message->timestamp);
-    free(message->author_id);
-    free(message->author_username);
-  }
+  for (i = 0; i < message_count; i++) discrub_free_message(&messages[i], allocator);
   free(messages);
   free(server_id);
   free(password);
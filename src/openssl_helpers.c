@@ -1,71 +1,933 @@
 #include "openssl_helpers.h"
 
-#define RESPONSE_BUFFER_SIZE 1024
+#include <errno.h>
+#include <limits.h>
+#include <openssl/pem.h>
+#include <strings.h>
 
-struct HTTPResponse *http_request(BIO *connection, const char *request,
-                                  enum HTTPError *error) {
-  BIO_reset(connection);
-  if (BIO_write(connection, request, strlen(request)) <= 0) {
+#include "content_encoding.h"
+#include "http2.h"
+#include "input_helpers.h"
+
+#define RESPONSE_BUFFER_SIZE 16384
+#define HEAD_BUFFER_SIZE 2048
+/* The largest body accepted, by Content-Length or in one chunk. */
+#define BODY_SIZE_LIMIT ((size_t)INT_MAX)
+#define HEADER_BUFFER_LIMIT 65536
+#define SEND_ATTEMPTS 2
+
+enum ChunkState {
+  CHUNK_SIZE,
+  CHUNK_EXTENSION,
+  CHUNK_DATA,
+  CHUNK_DATA_END,
+  CHUNK_TRAILER,
+  CHUNK_TRAILER_LINE,
+  CHUNK_DONE,
+};
+
+/**
+ * The most recent session for an SSL_CTX and where it is persisted, kept in
+ * the context's ex_data so every connection made from it can resume.
+ */
+struct TLSSessionCache {
+  char *path;
+  SSL_SESSION *session;
+};
+
+static int session_cache_index = -1;
+
+/**
+ * Incremental decoder for Transfer-Encoding: chunked bodies that forwards
+ * chunk data as soon as it is available.
+ */
+struct ChunkDecoder {
+  enum ChunkState state;
+  size_t remaining;
+  unsigned char saw_digit;
+};
+
+/**
+ * Returns 0 on a malformed chunk header, otherwise 1. Stops after the last
+ * chunk, storing how much of data was used in consumed.
+ */
+static int chunk_decode(struct ChunkDecoder *decoder, const char *data, size_t length,
+                        void (*on_body)(void *user, const char *data, size_t length),
+                        void *user, size_t *body_length, size_t *consumed) {
+  const char *ptr = data, *end = data + length;
+  while (ptr < end && decoder->state != CHUNK_DONE) {
+    switch (decoder->state) {
+      case CHUNK_SIZE: {
+        char c = *ptr++;
+        int digit = (c >= '0' && c <= '9')   ? c - '0'
+                    : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                    : (c >= 'A' && c <= 'F') ? c - 'A' + 10
+                                             : -1;
+        if (digit >= 0) {
+          /* A size past the limit would wrap the body length. */
+          if (decoder->remaining > (BODY_SIZE_LIMIT - digit) / 16) return 0;
+          decoder->remaining = decoder->remaining * 16 + digit;
+          decoder->saw_digit = 1;
+        } else if (!decoder->saw_digit) {
+          return 0;
+        } else if (c == '\n') {
+          decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+        } else {
+          decoder->state = CHUNK_EXTENSION;
+        }
+        break;
+      }
+      case CHUNK_EXTENSION:
+        if (*ptr++ == '\n') decoder->state = decoder->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+        break;
+      case CHUNK_DATA: {
+        size_t available = end - ptr;
+        size_t take = available < decoder->remaining ? available : decoder->remaining;
+        on_body(user, ptr, take);
+        *body_length += take;
+        ptr += take;
+        decoder->remaining -= take;
+        if (decoder->remaining == 0) decoder->state = CHUNK_DATA_END;
+        break;
+      }
+      case CHUNK_DATA_END:
+        if (*ptr++ == '\n') {
+          decoder->state = CHUNK_SIZE;
+          decoder->saw_digit = 0;
+        }
+        break;
+      case CHUNK_TRAILER:
+        /* Either the blank line ending the body or the start of a trailer. */
+        if (*ptr == '\r') {
+          ptr++;
+        } else if (*ptr++ == '\n') {
+          decoder->state = CHUNK_DONE;
+        } else {
+          decoder->state = CHUNK_TRAILER_LINE;
+        }
+        break;
+      case CHUNK_TRAILER_LINE:
+        if (*ptr++ == '\n') decoder->state = CHUNK_TRAILER;
+        break;
+      default:
+        break;
+    }
+  }
+  *consumed = ptr - data;
+  return 1;
+}
+
+static void free_session_cache(void *parent, void *ptr, CRYPTO_EX_DATA *data, int index, long argl, void *argp) {
+  struct TLSSessionCache *cache = ptr;
+  (void)parent;
+  (void)data;
+  (void)index;
+  (void)argl;
+  (void)argp;
+  if (!cache) return;
+  SSL_SESSION_free(cache->session);
+  free(cache->path);
+  free(cache);
+}
+
+static struct TLSSessionCache *get_session_cache(SSL_CTX *ctx) {
+  if (session_cache_index < 0) return NULL;
+  return SSL_CTX_get_ex_data(ctx, session_cache_index);
+}
+
+/* Called for every session or ticket the server issues. */
+static int store_session(SSL *ssl, SSL_SESSION *session) {
+  struct TLSSessionCache *cache = get_session_cache(SSL_get_SSL_CTX(ssl));
+  if (!cache) return 0;
+  FILE *file = fopen_private(cache->path);
+  if (file) {
+    PEM_write_SSL_SESSION(file, session);
+    fclose(file);
+  }
+  /* A copy, because closing a connection uncleanly marks its own session as
+   * not resumable. */
+  SSL_SESSION *copy = SSL_SESSION_dup(session);
+  if (copy) {
+    SSL_SESSION_free(cache->session);
+    cache->session = copy;
+  }
+  return 0;
+}
+
+int tls_session_cache_enable(SSL_CTX *ctx, const char *path) {
+  if (session_cache_index < 0) {
+    session_cache_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, free_session_cache);
+    if (session_cache_index < 0) return 0;
+  }
+  struct TLSSessionCache *cache = malloc(sizeof(struct TLSSessionCache));
+  if (!cache) return 0;
+  cache->path = malloc(strlen(path) + 1);
+  if (!cache->path) {
+    free(cache);
+    return 0;
+  }
+  strcpy(cache->path, path);
+  cache->session = NULL;
+  FILE *file = fopen(path, "r");
+  if (file) {
+    cache->session = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+    fclose(file);
+  }
+  if (!SSL_CTX_set_ex_data(ctx, session_cache_index, cache)) {
+    free_session_cache(ctx, cache, NULL, session_cache_index, 0, NULL);
+    return 0;
+  }
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, store_session);
+  return 1;
+}
+
+int http_connect(BIO *connection) {
+  SSL *ssl = NULL;
+  BIO_get_ssl(connection, &ssl);
+  if (ssl) {
+    struct TLSSessionCache *cache = get_session_cache(SSL_get_SSL_CTX(ssl));
+    if (cache && cache->session) SSL_set_session(ssl, cache->session);
+  }
+  return BIO_do_connect(connection) > 0;
+}
+
+enum ParserState {
+  PARSE_HEAD,
+  PARSE_BODY,
+  PARSE_CHUNKED,
+  PARSE_DONE,
+};
+
+/**
+ * Buffers kept with a connection and reused by each request on it: the
+ * header block, the response with its header table, and the body. They only
+ * grow, so once they fit the largest response a connection sees, reading
+ * responses allocates nothing.
+ */
+struct ReceiveBuffer {
+  const struct Allocator *allocator;
+  char *head;
+  size_t head_capacity;
+  struct HTTPResponse *response;
+  size_t header_capacity;
+  char *body;
+  size_t body_capacity;
+  /* An HTTP/2 response handed out as a view, freed by the next request. */
+  struct HTTPResponse *owned;
+};
+
+/**
+ * Incremental HTTP/1.1 response parser. The status line and headers are
+ * collected into one buffer and indexed once the blank line arrives; the
+ * body is then decoded straight into a buffer sized from Content-Length or
+ * from each chunk header, or handed to on_body as it is read. gzip and
+ * deflate bodies are inflated on the way in.
+ */
+struct HTTPParser {
+  enum ParserState state;
+  enum HTTPError error;
+  const struct Allocator *allocator;
+  struct HTTPResponse *response;
+  char *head;
+  size_t head_size;
+  size_t head_capacity;
+  /* How many bytes of the blank line ending the headers have been seen. */
+  unsigned char head_match;
+  unsigned char until_close;
+  unsigned char close_after;
+  size_t expected;
+  /* Body bytes as framed on the wire, before any decompression. */
+  size_t body_read;
+  size_t body_capacity;
+  struct ChunkDecoder decoder;
+  struct ContentDecoder content;
+  /* Where the response is parsed into, if not newly allocated buffers. */
+  struct ReceiveBuffer *receive;
+  void (*on_body)(void *user, const char *data, size_t length);
+  void *user;
+};
+
+static void parser_init(struct HTTPParser *parser, const struct Allocator *allocator,
+                        void (*on_body)(void *user, const char *data, size_t length), void *user) {
+  memset(parser, 0, sizeof(struct HTTPParser));
+  parser->state = PARSE_HEAD;
+  parser->allocator = allocator;
+  parser->decoder.state = CHUNK_SIZE;
+  parser->on_body = on_body;
+  parser->user = user;
+}
+
+/* Parses into the connection's buffers instead of allocating new ones. */
+static void parser_use(struct HTTPParser *parser, struct ReceiveBuffer *receive) {
+  parser->receive = receive;
+  parser->head = receive->head;
+  parser->head_capacity = receive->head_capacity;
+}
+
+static void parser_release(struct HTTPParser *parser) {
+  content_decoder_end(&parser->content);
+  if (parser->receive) {
+    /* The buffers may have moved while growing; the connection keeps them. */
+    parser->receive->head = parser->head;
+    parser->receive->head_capacity = parser->head_capacity;
+    if (parser->response) {
+      parser->receive->body = parser->response->data;
+      parser->receive->body_capacity = parser->body_capacity;
+    }
+  } else if (parser->response) {
+    http_response_free(parser->response, parser->allocator);
+  } else {
+    allocator_free(parser->allocator, parser->head);
+  }
+  parser->response = NULL;
+  parser->head = NULL;
+}
+
+/* Grows the body buffer geometrically to hold size bytes and a NUL. */
+static int parser_reserve(struct HTTPParser *parser, size_t size) {
+  if (size < parser->body_capacity) return 1;
+  /* Keeps size + 1 and the doubled capacity from wrapping. */
+  if (size >= (size_t)-1 / 2) {
+    parser->error = HTTP_ENOMEM;
+    return 0;
+  }
+  size_t capacity = parser->body_capacity * 2;
+  if (capacity <= size) capacity = size + 1;
+  char *data;
+  if (parser->response->length) {
+    data = allocator_realloc(parser->allocator, parser->response->data, capacity);
+  } else {
+    /* A reused buffer holds nothing worth copying yet. */
+    allocator_free(parser->allocator, parser->response->data);
+    parser->response->data = NULL;
+    parser->body_capacity = 0;
+    data = allocator_alloc(parser->allocator, capacity);
+  }
+  if (!data) {
+    parser->error = HTTP_ENOMEM;
+    return 0;
+  }
+  parser->response->data = data;
+  parser->body_capacity = capacity;
+  return 1;
+}
+
+/**
+ * Passes body bytes to on_body or appends them to the body, reserving room
+ * for the rest bytes still framed after them at once. Compressed bodies are
+ * inflated straight into the body buffer, which grows as they expand.
+ */
+static int parser_body(struct HTTPParser *parser, const char *data, size_t length, size_t rest) {
+  struct HTTPResponse *response = parser->response;
+  if (!parser->content.active) {
+    if (parser->on_body) {
+      if (length) parser->on_body(parser->user, data, length);
+    } else {
+      if (!parser_reserve(parser, response->length + rest)) return 0;
+      /* Reads of a known-length body land in place already. */
+      if (response->data + response->length != data) memcpy(response->data + response->length, data, length);
+    }
+    response->length += length;
+    return 1;
+  }
+  size_t produced, out_size;
+  do {
+    char buffer[RESPONSE_BUFFER_SIZE];
+    char *out = buffer;
+    out_size = sizeof(buffer);
+    if (!parser->on_body) {
+      /* JSON typically inflates several times over. */
+      size_t estimate = length * 4 > RESPONSE_BUFFER_SIZE ? length * 4 : RESPONSE_BUFFER_SIZE;
+      if (!parser_reserve(parser, response->length + estimate)) return 0;
+      out = response->data + response->length;
+      out_size = parser->body_capacity - response->length - 1;
+    }
+    if (!content_decoder_run(&parser->content, &data, &length, out, out_size, &produced)) {
+      parser->error = HTTP_EPARSE;
+      return 0;
+    }
+    if (parser->on_body && produced) parser->on_body(parser->user, out, produced);
+    response->length += produced;
+    /* A full buffer may leave output pending inside zlib. */
+  } while (length || produced == out_size);
+  return 1;
+}
+
+/* Chunk sink: reserves the rest of the current chunk at once. */
+static void store_chunk(void *user, const char *data, size_t length) {
+  struct HTTPParser *parser = user;
+  if (!parser->error) parser_body(parser, data, length, parser->decoder.remaining);
+}
+
+/* Marks the response complete and NUL-terminates a stored body. */
+static int parser_complete(struct HTTPParser *parser) {
+  /* A compressed body cut short would otherwise pass as a shorter one. */
+  if (parser->content.active && !parser->content.done) {
+    parser->error = HTTP_EPARSE;
+    return 0;
+  }
+  content_decoder_end(&parser->content);
+  parser->state = PARSE_DONE;
+  if (parser->on_body) return 1;
+  if (!parser_reserve(parser, parser->response->length)) return 0;
+  parser->response->data[parser->response->length] = '\0';
+  return 1;
+}
+
+static int header_has_token(const char *value, const char *token) {
+  size_t length = strlen(token);
+  for (; value && *value; value++) {
+    if (strncasecmp(value, token, length) == 0) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Parses the status line, indexes the headers in place and decides how the
+ * body is framed: by Content-Length, by chunks, or by the connection closing.
+ */
+static int parse_head(struct HTTPParser *parser) {
+  char *head = parser->head, *end = parser->head + parser->head_size;
+  if (parser->head_size < 12 || strncmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ' || head[9] < '1' || head[9] > '5' ||
+      head[10] < '0' || head[10] > '9' || head[11] < '0' || head[11] > '9') {
+    parser->error = HTTP_EPARSE;
+    return 0;
+  }
+  /* Each line but the status line and the blank one is a header. */
+  size_t header_count = 0;
+  char *line;
+  for (line = head; line < end; line++) {
+    if (*line == '\n') header_count++;
+  }
+  header_count -= 2;
+  struct HTTPResponse *response = parser->receive ? parser->receive->response : NULL;
+  if (!response || parser->receive->header_capacity < header_count) {
+    response = allocator_realloc(parser->allocator, response,
+                                 sizeof(struct HTTPResponse) + header_count * sizeof(struct HTTPHeader));
+    if (!response) {
+      parser->error = HTTP_ENOMEM;
+      return 0;
+    }
+    if (parser->receive) {
+      parser->receive->response = response;
+      parser->receive->header_capacity = header_count;
+    }
+  }
+  response->code = (head[9] - '0') * 100 + (head[10] - '0') * 10 + (head[11] - '0');
+  response->data = parser->receive ? parser->receive->body : NULL;
+  parser->body_capacity = parser->receive ? parser->receive->body_capacity : 0;
+  response->length = 0;
+  response->headers = (struct HTTPHeader *)(response + 1);
+  response->header_count = 0;
+  response->buffer = head;
+  parser->response = response;
+
+  /* Names and values are NUL-terminated where the ':' and CRLF were. */
+  line = memchr(head, '\n', end - head) + 1;
+  while (line < end && *line != '\r' && *line != '\n') {
+    char *line_end = memchr(line, '\n', end - line);
+    char *colon = memchr(line, ':', line_end - line);
+    if (!colon || colon == line) {
+      parser->error = HTTP_EPARSE;
+      return 0;
+    }
+    char *value = colon + 1, *value_end = line_end;
+    while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+    while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+    struct HTTPHeader *header = &response->headers[response->header_count++];
+    *colon = '\0';
+    *value_end = '\0';
+    header->name = line;
+    header->name_length = colon - line;
+    header->value = value;
+    header->value_length = value_end - value;
+    line = line_end + 1;
+  }
+
+  const char *transfer_encoding = http_response_header(response, "Transfer-Encoding");
+  const char *content_length = http_response_header(response, "Content-Length");
+  const char *connection = http_response_header(response, "Connection");
+  parser->close_after = header_has_token(connection, "close") || (head[7] == '0' && !header_has_token(connection, "keep-alive"));
+  if (response->code / 100 == 1 || response->code == 204 || response->code == 304) {
+    parser->state = PARSE_DONE;
+  } else if (header_has_token(transfer_encoding, "chunked")) {
+    parser->state = PARSE_CHUNKED;
+  } else if (content_length) {
+    if (!http_content_length(content_length, &parser->expected)) {
+      parser->error = HTTP_EPARSE;
+      return 0;
+    }
+    parser->state = parser->expected ? PARSE_BODY : PARSE_DONE;
+  } else {
+    parser->until_close = 1;
+    parser->close_after = 1;
+    parser->state = PARSE_BODY;
+  }
+  if (parser->state == PARSE_DONE) return parser_complete(parser);
+  int compressed = content_decoder_init(&parser->content, http_response_header(response, "Content-Encoding"),
+                                        parser->allocator);
+  if (compressed < 0) {
+    parser->error = HTTP_EPARSE;
+    return 0;
+  }
+  if (parser->on_body) return 1;
+  /* A known length is reserved once, up front, unless it is compressed. */
+  if (parser->state == PARSE_BODY && !parser->until_close && !compressed) return parser_reserve(parser, parser->expected);
+  return 1;
+}
+
+/**
+ * Consumes bytes of the response, returning how many were part of it, or
+ * (size_t)-1 with parser->error set when the response is malformed.
+ */
+static size_t parser_feed(struct HTTPParser *parser, const char *data, size_t length) {
+  const char *ptr = data, *end = data + length;
+  if (parser->state == PARSE_HEAD) {
+    while (ptr < end && parser->head_match < 4) {
+      char c = *ptr++;
+      parser->head_match = c == "\r\n\r\n"[parser->head_match] ? parser->head_match + 1 : c == '\r';
+    }
+    size_t size = ptr - data;
+    if (parser->head_size + size + 1 > HEADER_BUFFER_LIMIT) {
+      parser->error = HTTP_EPARSE;
+      return (size_t)-1;
+    }
+    if (parser->head_size + size + 1 > parser->head_capacity) {
+      size_t capacity = parser->head_capacity ? parser->head_capacity : HEAD_BUFFER_SIZE;
+      while (capacity < parser->head_size + size + 1) capacity *= 2;
+      char *head = allocator_realloc(parser->allocator, parser->head, capacity);
+      if (!head) {
+        parser->error = HTTP_ENOMEM;
+        return (size_t)-1;
+      }
+      parser->head = head;
+      parser->head_capacity = capacity;
+    }
+    memcpy(parser->head + parser->head_size, data, size);
+    parser->head_size += size;
+    parser->head[parser->head_size] = '\0';
+    if (parser->head_match < 4) return size;
+    if (!parse_head(parser)) return (size_t)-1;
+  }
+  if (parser->state == PARSE_BODY) {
+    size_t take = end - ptr;
+    size_t rest = parser->until_close ? take : parser->expected - parser->body_read;
+    if (take > rest) take = rest;
+    if (!parser_body(parser, ptr, take, rest)) return (size_t)-1;
+    parser->body_read += take;
+    ptr += take;
+    if (!parser->until_close && parser->body_read == parser->expected && !parser_complete(parser)) return (size_t)-1;
+  } else if (parser->state == PARSE_CHUNKED) {
+    size_t consumed;
+    if (!chunk_decode(&parser->decoder, ptr, end - ptr, store_chunk, parser, &parser->body_read, &consumed)) {
+      parser->error = HTTP_EPARSE;
+      return (size_t)-1;
+    }
+    if (parser->error) return (size_t)-1;
+    ptr += consumed;
+    if (parser->decoder.state == CHUNK_DONE && !parser_complete(parser)) return (size_t)-1;
+  }
+  return ptr - data;
+}
+
+/* Ends the response at end of stream, which only a body delimited by the
+ * connection closing may do. */
+static int parser_finish(struct HTTPParser *parser) {
+  if (parser->state != PARSE_BODY || !parser->until_close) {
+    parser->error = HTTP_EPARSE;
+    return 0;
+  }
+  return parser_complete(parser);
+}
+
+struct HTTPParser *http_parser_new(const struct Allocator *allocator) {
+  struct HTTPParser *parser = allocator_alloc(allocator, sizeof(struct HTTPParser));
+  if (parser) parser_init(parser, allocator, NULL, NULL);
+  return parser;
+}
+
+size_t http_parser_feed(struct HTTPParser *parser, const char *data, size_t length, enum HTTPError *error) {
+  size_t used = parser_feed(parser, data, length);
+  if (used == (size_t)-1) *error = parser->error;
+  return used;
+}
+
+int http_parser_finish(struct HTTPParser *parser, enum HTTPError *error) {
+  if (parser->state == PARSE_DONE) return 1;
+  if (parser->state == PARSE_HEAD && !parser->head_size) {
     *error = HTTP_EBIO;
-    return NULL;
+    return 0;
+  }
+  if (!parser_finish(parser)) {
+    *error = parser->error;
+    return 0;
   }
+  return 1;
+}
 
-  char *raw_response = NULL;
-  int total_size = 0, size;
-  char buffer[RESPONSE_BUFFER_SIZE];
+int http_parser_done(const struct HTTPParser *parser) { return parser->state == PARSE_DONE; }
+
+struct HTTPResponse *http_parser_take(struct HTTPParser *parser, int *close_after) {
+  struct HTTPResponse *response = parser->response;
+  if (parser->state != PARSE_DONE) return NULL;
+  *close_after = parser->close_after;
+  parser->response = NULL;
+  parser->head = NULL;
+  parser_init(parser, parser->allocator, NULL, NULL);
+  return response;
+}
 
-  for (;;) {
-    size = BIO_read(connection, buffer, RESPONSE_BUFFER_SIZE - 1);
-    if (size < 1) break;
-    buffer[size] = '\0';
+void http_parser_free(struct HTTPParser *parser) {
+  if (!parser) return;
+  parser_release(parser);
+  allocator_free(parser->allocator, parser);
+}
+
+static int receive_index = -1;
+
+static void receive_release(struct ReceiveBuffer *receive) {
+  allocator_free(receive->allocator, receive->head);
+  allocator_free(receive->allocator, receive->response);
+  allocator_free(receive->allocator, receive->body);
+  http_response_free(receive->owned, receive->allocator);
+  allocator_free(receive->allocator, receive);
+}
+
+static void free_receive(void *parent, void *ptr, CRYPTO_EX_DATA *data, int index, long argl, void *argp) {
+  (void)parent;
+  (void)data;
+  (void)index;
+  (void)argl;
+  (void)argp;
+  if (ptr) receive_release(ptr);
+}
 
-    raw_response = realloc(raw_response, total_size + size + 1);
-    if (!raw_response) {
+/**
+ * Returns the buffers kept with the connection, creating them on first use.
+ * They are freed with the connection, or replaced if a request comes with a
+ * different allocator.
+ */
+static struct ReceiveBuffer *receive_buffer(BIO *connection, const struct Allocator *allocator, enum HTTPError *error) {
+  if (receive_index < 0) {
+    receive_index = BIO_get_ex_new_index(0, NULL, NULL, NULL, free_receive);
+    if (receive_index < 0) {
       *error = HTTP_ENOMEM;
       return NULL;
     }
-    memcpy(raw_response + total_size, buffer, size);
-    total_size += size;
   }
-
-  if (raw_response) raw_response[total_size] = '\0';
-
-  if (raw_response == NULL) {
-    *error = HTTP_EPARSE;
+  struct ReceiveBuffer *receive = BIO_get_ex_data(connection, receive_index);
+  if (receive && receive->allocator == allocator) return receive;
+  if (receive) {
+    BIO_set_ex_data(connection, receive_index, NULL);
+    receive_release(receive);
+  }
+  receive = allocator_alloc(allocator, sizeof(struct ReceiveBuffer));
+  if (!receive) {
+    *error = HTTP_ENOMEM;
     return NULL;
   }
-
-  char *headers_end = strstr(raw_response, "\r\n\r\n");
-  if (headers_end == NULL) {
-    *error = HTTP_EPARSE;
-    free(raw_response);
+  memset(receive, 0, sizeof(struct ReceiveBuffer));
+  receive->allocator = allocator;
+  if (!BIO_set_ex_data(connection, receive_index, receive)) {
+    allocator_free(allocator, receive);
+    *error = HTTP_ENOMEM;
     return NULL;
   }
+  return receive;
+}
+
+/**
+ * Sends a request on a kept-alive connection and parses exactly one
+ * response. Idle connections may have been closed by the server, so a
+ * request that got no reply at all is sent again once on a new connection.
+ */
+static struct HTTPResponse *exchange(BIO *connection, const char *request,
+                                     void (*on_body)(void *user, const char *data, size_t length), void *user,
+                                     struct ReceiveBuffer *receive, const struct Allocator *allocator,
+                                     enum HTTPError *error) {
+  size_t request_length = strlen(request);
+  int attempt;
+  for (attempt = 0; attempt < SEND_ATTEMPTS; attempt++) {
+    if (attempt) BIO_reset(connection);
+    /* Every new connection may negotiate h2, so the protocol is checked on each attempt. */
+    enum HTTPError session_error = HTTP_ENOERR;
+    struct HTTP2Session *session = http2_session(connection, &session_error);
+    if (session_error) {
+      *error = session_error;
+      return NULL;
+    }
+    if (session) {
+      struct HTTPResponse *response = http2_request(session, request, allocator, error);
+      if (response && on_body) {
+        on_body(user, response->data, response->length);
+        allocator_free(allocator, response->data);
+        response->data = NULL;
+      }
+      return response;
+    }
+    if (attempt && !http_connect(connection)) break;
+    if (BIO_write(connection, request, request_length) <= 0) continue;
+    struct HTTPParser parser;
+    char buffer[RESPONSE_BUFFER_SIZE];
+    size_t received = 0;
+    parser_init(&parser, allocator, on_body, user);
+    if (receive) parser_use(&parser, receive);
+    while (parser.state != PARSE_DONE) {
+      char *target = buffer;
+      size_t capacity = RESPONSE_BUFFER_SIZE;
+      /* The rest of a known-length body is read directly into place. */
+      if (parser.state == PARSE_BODY && !parser.until_close && !parser.content.active && !on_body) {
+        target = parser.response->data + parser.response->length;
+        capacity = parser.expected - parser.response->length;
+        if (capacity > INT_MAX) capacity = INT_MAX;
+      }
+      int size = BIO_read(connection, target, (int)capacity);
+      if (size < 1) break;
+      received += size;
+      if (parser_feed(&parser, target, size) == (size_t)-1) break;
+    }
+    if (parser.state != PARSE_DONE && !parser.error) {
+      if (!received) {
+        parser_release(&parser);
+        continue;
+      }
+      parser_finish(&parser);
+    }
+    if (parser.state != PARSE_DONE) {
+      BIO_reset(connection);
+      parser_release(&parser);
+      *error = parser.error;
+      return NULL;
+    }
+    /* The next request reconnects when this one ended the connection. */
+    if (parser.close_after) BIO_reset(connection);
+    struct HTTPResponse *response = parser.response;
+    if (receive) parser_release(&parser);
+    return response;
+  }
+  BIO_reset(connection);
+  *error = HTTP_EBIO;
+  return NULL;
+}
+
+struct HTTPResponse *http_request(BIO *connection, const char *request,
+                                  const struct Allocator *allocator,
+                                  enum HTTPError *error) {
+  return exchange(connection, request, NULL, NULL, NULL, allocator, error);
+}
+
+const struct HTTPResponse *http_request_view(BIO *connection, const char *request,
+                                             const struct Allocator *allocator, enum HTTPError *error) {
+  struct ReceiveBuffer *receive = receive_buffer(connection, allocator, error);
+  if (!receive) return NULL;
+  http_response_free(receive->owned, allocator);
+  receive->owned = NULL;
+  struct HTTPResponse *response = exchange(connection, request, NULL, NULL, receive, allocator, error);
+  /* An HTTP/2 response is not in the buffers, so it is kept until the next request instead. */
+  if (response && response != receive->response) receive->owned = response;
+  return response;
+}
+
+struct HTTPResponse *http_request_stream(BIO *connection, const char *request,
+                                         void (*on_body)(void *user, const char *data, size_t length),
+                                         void *user, const struct Allocator *allocator,
+                                         enum HTTPError *error) {
+  return exchange(connection, request, on_body, user, NULL, allocator, error);
+}
+
+/* Passes responses on with their index in the whole pipeline. */
+struct PipelineOffset {
+  int (*on_response)(void *user, size_t index, const struct HTTPResponse *response);
+  void *user;
+  size_t offset;
+};
+
+static int offset_response(void *user, size_t index, const struct HTTPResponse *response) {
+  struct PipelineOffset *offset = user;
+  return offset->on_response(offset->user, offset->offset + index, response);
+}
+
+size_t http_pipeline(BIO *connection, const char *const *requests, size_t count, size_t depth,
+                     int (*on_response)(void *user, size_t index, const struct HTTPResponse *response), void *user,
+                     const struct Allocator *allocator, enum HTTPError *error) {
+  struct ReceiveBuffer *receive = receive_buffer(connection, allocator, error);
+  if (!receive) return 0;
+  char buffer[RESPONSE_BUFFER_SIZE];
+  size_t acknowledged = 0, limit = count;
+  int failures = 0;
+  if (!depth) depth = 1;
+  while (acknowledged < limit) {
+    /* Over h2, what is left becomes concurrent streams instead. Every
+     * reconnect may negotiate h2, so this is checked after each one. */
+    enum HTTPError session_error = HTTP_ENOERR;
+    struct HTTP2Session *session = http2_session(connection, &session_error);
+    if (session_error) {
+      *error = session_error;
+      return acknowledged;
+    }
+    if (session) {
+      struct PipelineOffset offset;
+      offset.on_response = on_response;
+      offset.user = user;
+      offset.offset = acknowledged;
+      return acknowledged + http2_pipeline(session, requests + acknowledged, limit - acknowledged, depth,
+                                           offset_response, &offset, allocator, error);
+    }
+    /* Everything unacknowledged is (re)sent from here on this connection. */
+    size_t sent = acknowledged, available = 0, offset = 0;
+    int dropped = 0;
+    while (acknowledged < limit && !dropped) {
+      while (sent < limit && sent - acknowledged < depth) {
+        if (BIO_write(connection, requests[sent], strlen(requests[sent])) <= 0) break;
+        sent++;
+      }
+      if (sent == acknowledged) break;
+      struct HTTPParser parser;
+      parser_init(&parser, allocator, NULL, NULL);
+      parser_use(&parser, receive);
+      while (parser.state != PARSE_DONE) {
+        /* Bytes past one response are the start of the next. */
+        if (offset == available) {
+          int size = BIO_read(connection, buffer, RESPONSE_BUFFER_SIZE);
+          if (size < 1) {
+            if (parser.state == PARSE_HEAD && !parser.head_size) {
+              dropped = 1;
+            } else {
+              parser_finish(&parser);
+            }
+            break;
+          }
+          available = size;
+          offset = 0;
+        }
+        size_t used = parser_feed(&parser, buffer + offset, available - offset);
+        if (used == (size_t)-1) break;
+        offset += used;
+      }
+      if (dropped) {
+        parser_release(&parser);
+        break;
+      }
+      if (parser.state != PARSE_DONE) {
+        BIO_reset(connection);
+        parser_release(&parser);
+        *error = parser.error;
+        return acknowledged;
+      }
+      /* Responses already in flight are still read after on_response stops the pipeline. */
+      if (on_response(user, acknowledged, parser.response)) limit = sent;
+      parser_release(&parser);
+      acknowledged++;
+      failures = 0;
+      if (parser.close_after) dropped = 1;
+    }
+    if (acknowledged == limit) {
+      if (dropped) BIO_reset(connection);
+      break;
+    }
+    /* The connection dropped mid-pipeline; requeue what it did not answer. */
+    BIO_reset(connection);
+    if (++failures == SEND_ATTEMPTS || !http_connect(connection)) {
+      *error = HTTP_EBIO;
+      return acknowledged;
+    }
+  }
+  return acknowledged;
+}
+
+struct TemplatePiece {
+  const char *data;
+  size_t length;
+};
+
+/**
+ * The pieces follow the template in the same allocation, and their text
+ * follows the pieces.
+ */
+struct HTTPTemplate {
+  const struct Allocator *allocator;
+  struct TemplatePiece *pieces;
+  size_t count;
+  size_t fixed_length;
+};
 
-  struct HTTPResponse *parsed_response = malloc(sizeof(struct HTTPResponse));
-  if (parsed_response == NULL) {
+struct HTTPTemplate *http_template_compile(const char *const *pieces, size_t count,
+                                           const struct Allocator *allocator, enum HTTPError *error) {
+  size_t text_size = 0, i;
+  for (i = 0; i < count; i++) text_size += strlen(pieces[i]);
+  struct HTTPTemplate *request_template =
+      allocator_alloc(allocator, sizeof(struct HTTPTemplate) + count * sizeof(struct TemplatePiece) + text_size);
+  if (!request_template) {
     *error = HTTP_ENOMEM;
-    free(raw_response);
     return NULL;
   }
+  request_template->allocator = allocator;
+  request_template->pieces = (struct TemplatePiece *)(request_template + 1);
+  request_template->count = count;
+  request_template->fixed_length = text_size;
+  char *text = (char *)(request_template->pieces + count);
+  for (i = 0; i < count; i++) {
+    struct TemplatePiece *piece = &request_template->pieces[i];
+    piece->length = strlen(pieces[i]);
+    piece->data = text;
+    memcpy(text, pieces[i], piece->length);
+    text += piece->length;
+  }
+  return request_template;
+}
 
-  if (sscanf(raw_response, "HTTP/1.1 %hd", &(parsed_response->code)) == 0) {
-    *error = HTTP_EPARSE;
-    free(raw_response);
-    free(parsed_response);
-    return NULL;
+size_t http_template_size(const struct HTTPTemplate *request_template, const char *const *values) {
+  size_t size = request_template->fixed_length, i;
+  for (i = 0; i + 1 < request_template->count; i++) size += strlen(values[i]);
+  return size;
+}
+
+size_t http_template_render(const struct HTTPTemplate *request_template, const char *const *values, char *out) {
+  char *ptr = out;
+  size_t i;
+  for (i = 0; i < request_template->count; i++) {
+    const struct TemplatePiece *piece = &request_template->pieces[i];
+    memcpy(ptr, piece->data, piece->length);
+    ptr += piece->length;
+    if (i + 1 < request_template->count) {
+      size_t length = strlen(values[i]);
+      memcpy(ptr, values[i], length);
+      ptr += length;
+    }
   }
+  *ptr = '\0';
+  return ptr - out;
+}
 
-  const char *content_length_start =
-      strcasestr(raw_response, "Content-Length: ");
-  if (content_length_start && content_length_start <= headers_end) {
-    content_length_start += strlen("Content-Length: ");
-    sscanf(content_length_start, "%d", &(parsed_response->length));
+void http_template_free(struct HTTPTemplate *request_template) {
+  if (request_template) allocator_free(request_template->allocator, request_template);
+}
+
+const char *http_response_header(const struct HTTPResponse *response, const char *name) {
+  size_t name_length = strlen(name), i;
+  for (i = 0; i < response->header_count; i++) {
+    const struct HTTPHeader *header = &response->headers[i];
+    if (header->name_length == name_length && strncasecmp(header->name, name, name_length) == 0) return header->value;
   }
+  return NULL;
+}
 
-  parsed_response->data = headers_end + strlen("\r\n\r\n");
+void http_response_free(struct HTTPResponse *response, const struct Allocator *allocator) {
+  if (!response) return;
+  allocator_free(allocator, response->data);
+  allocator_free(allocator, response->buffer);
+  allocator_free(allocator, response);
+}
 
-  return parsed_response;
+int http_content_length(const char *value, size_t *length) {
+  /* strtoul would also take a sign, and "-1" would become SIZE_MAX. */
+  size_t digits = strspn(value, "0123456789");
+  errno = 0;
+  unsigned long parsed = strtoul(value, NULL, 10);
+  if (!digits || value[digits] || errno == ERANGE || parsed > BODY_SIZE_LIMIT) return 0;
+  *length = parsed;
+  return 1;
 }
 
 const char *http_strerror(enum HTTPError *error) {
@@ -73,6 +935,7 @@ const char *http_strerror(enum HTTPError *error) {
     case HTTP_ENOMEM: return "Memory allocation failed";
     case HTTP_EBIO: return "BIO operation failed";
     case HTTP_EPARSE: return "Failed to parse response";
+    case HTTP_ETIMEOUT: return "Request timed out";
     default: return "Unknown HTTP error";
   }
 }